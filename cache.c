@@ -0,0 +1,304 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* in-process answer cache
+ *
+ * The cache is split in a number of shards, each guarded by its own
+ * rwlock, such that concurrent lookups for different names hardly ever
+ * contend, and lookups for the same (hot) name only take a read lock.
+ * All entries are allocated upfront, so the cache never grows beyond
+ * the size given at init.  When a shard is full, an entry is evicted
+ * using the CLOCK algorithm (second chance LRU approximation).
+ *
+ * Entries are kept around past their expiry (until evicted), such that
+ * they can be served stale when the servers can't be reached.  Each
+ * entry has a point in time from which a refresh ahead of its expiry is
+ * due, the first lookup past it claims the refresh, and pushes the
+ * point ahead by CACHE_STALE_TTL, such that it is never done by all
+ * lookups at once.  Expired entries are only served as is once asking
+ * the servers failed, after which they are for CACHE_STALE_TTL, before
+ * the servers are tried again. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "dnspq.h"
+#include "cache.h"
+
+#ifndef CACHE_SHARD_BITS
+# define CACHE_SHARD_BITS  4
+#endif
+#define CACHE_SHARDS  (1 << CACHE_SHARD_BITS)
+/* shards are selected on the high bits, buckets on the low bits */
+#define CACHE_SHARD(hash)  (&shards[(hash) >> (32 - CACHE_SHARD_BITS)])
+
+typedef struct _cache_entry {
+	uint32_t hash;
+	uint32_t gid;
+	int next;            /* next entry in bucket chain, -1 terminates */
+	unsigned char ref;   /* CLOCK reference bit */
+	char err;            /* dnsq error for negative entries, else 0 */
+	time_t expire;
+	time_t refreshat;    /* a refresh is due from this point */
+	time_t staleuntil;   /* expired, served as is until then */
+	struct dnsq_answer ans;
+	char name[256];
+} cache_entry;
+
+typedef struct _cache_shard {
+	pthread_rwlock_t lock;
+	int *buckets;
+	size_t bucketmask;
+	cache_entry *entries;
+	size_t cap;
+	size_t used;
+	size_t hand;
+} cache_shard;
+
+static cache_shard *shards = NULL;
+static unsigned int refreshpct = 0;
+
+/* monotonic seconds, CLOCK_MONOTONIC_COARSE is served from the vDSO */
+static inline time_t cache_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+/* FNV-1a over the lowercased name, DNS names are case insensitive */
+uint32_t cache_hash(const char *name) {
+	uint32_t h = 2166136261U;
+	for (; *name != '\0'; name++) {
+		h ^= (unsigned char)tolower((unsigned char)*name);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* size is the number of entries, refresh the percentage of the TTL
+ * after which lookups ask for a refresh, 0 for none before expiry */
+int cache_init(size_t size, unsigned int refresh) {
+	cache_shard *s;
+	size_t cap;
+	size_t nb;
+	size_t i;
+	int j;
+
+	if (size == 0)
+		return 0;
+	refreshpct = refresh < 100 ? refresh : 0;
+
+	cap = (size + CACHE_SHARDS - 1) / CACHE_SHARDS;
+	for (nb = 1; nb < cap; nb <<= 1)
+		;
+
+	if ((s = calloc(CACHE_SHARDS, sizeof(*s))) == NULL)
+		return 1;
+	for (j = 0; j < CACHE_SHARDS; j++) {
+		s[j].entries = calloc(cap, sizeof(cache_entry));
+		s[j].buckets = malloc(sizeof(int) * nb);
+		if (s[j].entries == NULL || s[j].buckets == NULL)
+			return 1;  /* leaks, but we're out of memory anyway */
+		for (i = 0; i < nb; i++)
+			s[j].buckets[i] = -1;
+		s[j].bucketmask = nb - 1;
+		s[j].cap = cap;
+		pthread_rwlock_init(&s[j].lock, NULL);
+	}
+
+	shards = s;
+
+	return 0;
+}
+
+static inline cache_entry *cache_find(
+		cache_shard *s,
+		uint32_t hash,
+		uint32_t gid,
+		const char *name)
+{
+	int i;
+	cache_entry *e;
+
+	for (i = s->buckets[hash & s->bucketmask]; i != -1; i = e->next) {
+		e = &s->entries[i];
+		if (e->hash == hash && e->gid == gid && strcasecmp(e->name, name) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/* lookup name in the cache, hash is cache_hash(name), fills in err and
+ * ans on a hit, ans->ttl being the remaining time to live, for
+ * negative entries (err set) only the TTL is filled in; returns
+ * CACHE_MISS, or else CACHE_HIT, or CACHE_REFRESH when the caller
+ * should refresh the entry; entries expired less than stale seconds
+ * ago are returned with a TTL of CACHE_STALE_TTL, as CACHE_STALE, for
+ * the caller to ask the servers and only fall back to the entry when
+ * that fails, or as CACHE_HIT when that failed less than
+ * CACHE_STALE_TTL ago, see cache_stale() */
+int cache_lookup(
+		const char *name,
+		uint32_t hash,
+		uint32_t gid,
+		struct dnsq_answer *ans,
+		char *err,
+		unsigned int stale)
+{
+	cache_shard *s;
+	cache_entry *e;
+	time_t now;
+	time_t at;
+	int found = CACHE_MISS;
+
+	if (shards == NULL)
+		return CACHE_MISS;
+
+	s = CACHE_SHARD(hash);
+	now = cache_now();
+
+	pthread_rwlock_rdlock(&s->lock);
+	if ((e = cache_find(s, hash, gid, name)) != NULL &&
+			e->expire + (time_t)stale > now)
+	{
+		if ((*err = e->err) == 0)
+			*ans = e->ans;
+		/* multiple readers may set it, that's fine */
+		__atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+		found = CACHE_HIT;
+		if (e->expire > now) {
+			ans->ttl = (unsigned int)(e->expire - now);
+			/* only one of the readers gets to refresh */
+			at = __atomic_load_n(&e->refreshat, __ATOMIC_RELAXED);
+			if (at <= now && __atomic_compare_exchange_n(&e->refreshat,
+						&at, now + CACHE_STALE_TTL, 0,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				found = CACHE_REFRESH;
+		} else {
+			ans->ttl = CACHE_STALE_TTL;
+			if (__atomic_load_n(&e->staleuntil, __ATOMIC_RELAXED) <= now)
+				found = CACHE_STALE;
+		}
+	}
+	pthread_rwlock_unlock(&s->lock);
+
+	return found;
+}
+
+/* asking the servers for the expired entry of name failed, it is
+ * served as is for CACHE_STALE_TTL */
+void cache_stale(const char *name, uint32_t hash, uint32_t gid) {
+	cache_shard *s;
+	cache_entry *e;
+
+	if (shards == NULL)
+		return;
+
+	s = CACHE_SHARD(hash);
+	pthread_rwlock_rdlock(&s->lock);
+	if ((e = cache_find(s, hash, gid, name)) != NULL)
+		__atomic_store_n(&e->staleuntil, cache_now() + CACHE_STALE_TTL,
+				__ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&s->lock);
+}
+
+/* remove entry idx from its bucket chain */
+static void cache_unlink(cache_shard *s, int idx) {
+	int *p = &s->buckets[s->entries[idx].hash & s->bucketmask];
+
+	for (; *p != -1; p = &s->entries[*p].next) {
+		if (*p == idx) {
+			*p = s->entries[idx].next;
+			return;
+		}
+	}
+}
+
+/* select a slot to (re)use: a free one while the shard isn't full yet,
+ * or else the first entry that's expired or wasn't referenced since the
+ * clock hand last passed it */
+static int cache_evict(cache_shard *s, time_t now) {
+	cache_entry *e;
+	int idx;
+
+	if (s->used < s->cap)
+		return (int)s->used++;
+
+	for (;;) {
+		idx = (int)s->hand;
+		e = &s->entries[idx];
+		if (++s->hand == s->cap)
+			s->hand = 0;
+		if (e->ref && e->expire > now) {
+			e->ref = 0;
+			continue;
+		}
+		cache_unlink(s, idx);
+		return idx;
+	}
+}
+
+/* store an answer, or a negative entry for err when ans is NULL */
+void cache_insert(
+		const char *name,
+		uint32_t hash,
+		uint32_t gid,
+		const struct dnsq_answer *ans,
+		unsigned int ttl,
+		char err)
+{
+	cache_shard *s;
+	cache_entry *e;
+	time_t now;
+	size_t len;
+	int idx;
+
+	if (shards == NULL)
+		return;
+
+	if (ttl == 0 || (len = strlen(name)) >= sizeof(e->name))
+		return;
+
+	s = CACHE_SHARD(hash);
+	now = cache_now();
+
+	pthread_rwlock_wrlock(&s->lock);
+	if ((e = cache_find(s, hash, gid, name)) == NULL) {
+		idx = cache_evict(s, now);
+		e = &s->entries[idx];
+		e->hash = hash;
+		e->gid = gid;
+		memcpy(e->name, name, len + 1);
+		e->next = s->buckets[hash & s->bucketmask];
+		s->buckets[hash & s->bucketmask] = idx;
+	}
+	if (ans != NULL)
+		e->ans = *ans;
+	e->err = err;
+	e->expire = now + ttl;
+	e->refreshat = refreshpct == 0 ? e->expire :
+		now + (time_t)((unsigned long)ttl * refreshpct / 100);
+	e->staleuntil = 0;
+	e->ref = 0;
+	pthread_rwlock_unlock(&s->lock);
+}
@@ -0,0 +1,62 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+
+struct dnsq_answer;
+
+/* cache_lookup() results */
+#define CACHE_MISS     0
+#define CACHE_HIT      1
+#define CACHE_REFRESH  2  /* hit, the caller should refresh the entry */
+#define CACHE_STALE    3  /* expired, the caller should ask the servers */
+
+/* TTL of stale answers, and the time before the servers are asked
+ * again after they failed, as recommended by RFC 8767 */
+#ifndef CACHE_STALE_TTL
+# define CACHE_STALE_TTL  30
+#endif
+
+/* defaults of the options clamping the TTLs and controlling refreshes
+ * and stale answers, see README.md */
+#ifndef CACHE_MIN_TTL
+# define CACHE_MIN_TTL  0
+#endif
+#ifndef CACHE_MAX_TTL
+# define CACHE_MAX_TTL  300
+#endif
+#ifndef CACHE_NEG_MAX_TTL
+# define CACHE_NEG_MAX_TTL  60
+#endif
+#ifndef REFRESH_AHEAD
+# define REFRESH_AHEAD  0
+#endif
+#ifndef SERVE_STALE
+# define SERVE_STALE  0
+#endif
+#ifndef STALE_TIMEOUT
+# define STALE_TIMEOUT  100
+#endif
+
+uint32_t cache_hash(const char *name);
+int cache_init(size_t size, unsigned int refresh);
+int cache_lookup(const char *name, uint32_t hash, uint32_t gid,
+		struct dnsq_answer *ans, char *err, unsigned int stale);
+void cache_insert(const char *name, uint32_t hash, uint32_t gid,
+		const struct dnsq_answer *ans, unsigned int ttl, char err);
+void cache_stale(const char *name, uint32_t hash, uint32_t gid);
@@ -0,0 +1,947 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* compiled configuration
+ *
+ * The pools of resolv-dnspq.conf are compiled into a flat image, which
+ * references everything by offset, such that it can be written to a
+ * file by dnspq-compile as is, and mapped by the nss module without any
+ * parsing or allocation.  When no compiled file exists, the text file
+ * is parsed into the same image in memory.  The image holds a hash
+ * table of domains, each slot referencing the server lists of its
+ * providers, which are contiguous.  Domains are hashed from their end,
+ * such that a single pass over a name yields the hashes of all its
+ * suffixes. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dnspq.h"
+#include "cache.h"
+#include "config.h"
+#include "stats.h"
+#include "daemon.h"
+
+#define CONFIG_MAGIC    0x43717064  /* "dpqC" */
+#define CONFIG_VERSION  1
+
+typedef struct _config_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;        /* of the whole image */
+	uint32_t nslots;      /* a power of 2 */
+	uint32_t slots;       /* offset of config_slot[nslots] */
+	uint32_t nproviders;
+	uint32_t providers;   /* offset of uint32_t[nproviders], server lists */
+	uint32_t fallback;    /* server list of traditional mode, 0 for none */
+	uint32_t options;     /* option strings, ending with an empty one */
+} config_hdr;
+
+typedef struct _config_slot {
+	uint32_t domain;      /* offset of the string, 0 for an empty slot */
+	uint32_t hash;
+	uint32_t gid;
+	uint32_t first;       /* index in providers */
+	uint32_t count;
+} config_slot;
+
+/* a server list is a uint32_t count, followed by the sockaddr_ins */
+#define SERVERLIST_SIZE(n)  (sizeof(uint32_t) + (n) * sizeof(struct sockaddr_in))
+
+/* the config as parsed, before compilation */
+typedef struct _domaingroup {
+	char *domain;
+	uint32_t gid;
+	struct _domaingroup *next;
+	size_t poolcount;
+	struct sockaddr_in **dnsservers;
+} domaingroup;
+
+#define IMG(c, off)  ((const char *)(c)->img + (off))
+
+/* FNV-1a over the lowercased characters of a suffix, last to first,
+ * continuing from h, which starts at 2166136261 */
+static inline uint32_t suffixhash(uint32_t h, const char *s, const char *end) {
+	while (end > s) {
+		h ^= (unsigned char)tolower((unsigned char)*--end);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void freegroups(domaingroup *w) {
+	domaingroup *n;
+	int i;
+
+	for (; w != NULL; w = n) {
+		n = w->next;
+		for (i = 0; w->dnsservers[i] != NULL; i++)
+			free(w->dnsservers[i]);
+		free(w->dnsservers);
+		free(w->domain);
+		free(w);
+	}
+}
+
+static uint32_t putservers(char *img, uint32_t *off, struct sockaddr_in **srvs) {
+	uint32_t start = *off;
+	uint32_t n;
+
+	for (n = 0; srvs[n] != NULL; n++)
+		memcpy(img + start + SERVERLIST_SIZE(n), srvs[n],
+				sizeof(struct sockaddr_in));
+	memcpy(img + start, &n, sizeof(n));
+	*off += SERVERLIST_SIZE(n);
+
+	return start;
+}
+
+/* compile the groups, where the providers of a domain are the poolcount
+ * groups following its first, and the options (optslen bytes) into an
+ * image, returns NULL when out of memory */
+static char *compilegroups(
+		domaingroup *rpool,
+		const char *opts,
+		size_t optslen,
+		size_t *lenp)
+{
+	domaingroup *w;
+	size_t ndomains = 0;
+	size_t nproviders = 0;
+	size_t len;
+	size_t nb;
+	size_t i;
+	size_t j;
+	size_t n;
+	uint32_t off;
+	uint32_t soff;
+	uint32_t h;
+	char *img;
+	config_hdr *hdr;
+	config_slot *slots;
+	uint32_t *providers;
+
+	/* everything is sized upfront */
+	len = sizeof(config_hdr);
+	for (w = rpool; w != NULL; w = w->next) {
+		for (n = 0; w->dnsservers[n] != NULL; n++)
+			;
+		len += SERVERLIST_SIZE(n);
+		if (w->domain != NULL) {
+			ndomains++;
+			nproviders += w->poolcount;
+			len += strlen(w->domain) + 1;
+		}
+	}
+	/* at most half full, to keep the probe sequences short */
+	for (nb = 1; nb < ndomains * 2; nb <<= 1)
+		;
+	len += nb * sizeof(config_slot) + nproviders * sizeof(uint32_t);
+	len += optslen + 1;
+	if (len > UINT32_MAX || (img = calloc(1, len)) == NULL)
+		return NULL;
+
+	hdr = (config_hdr *)img;
+	hdr->magic = CONFIG_MAGIC;
+	hdr->version = CONFIG_VERSION;
+	hdr->size = (uint32_t)len;
+	hdr->nslots = (uint32_t)nb;
+	hdr->slots = sizeof(config_hdr);
+	hdr->nproviders = (uint32_t)nproviders;
+	hdr->providers = hdr->slots + nb * sizeof(config_slot);
+	slots = (config_slot *)(img + hdr->slots);
+	providers = (uint32_t *)(img + hdr->providers);
+
+	/* server lists first, they need alignment, strings after them */
+	off = hdr->providers + nproviders * sizeof(uint32_t);
+	soff = len - optslen - 1;
+	for (w = rpool; w != NULL; w = w->next)
+		if (w->domain != NULL)
+			soff -= strlen(w->domain) + 1;
+
+	j = 0;
+	for (w = rpool; w != NULL; ) {
+		if (w->domain == NULL) {
+			hdr->fallback = putservers(img, &off, w->dnsservers);
+			break;
+		}
+		h = suffixhash(2166136261U, w->domain, w->domain + strlen(w->domain));
+		for (i = h & (nb - 1); slots[i].domain != 0; i = (i + 1) & (nb - 1))
+			;
+		slots[i].domain = soff;
+		slots[i].hash = h;
+		slots[i].gid = w->gid;
+		slots[i].first = (uint32_t)j;
+		slots[i].count = (uint32_t)w->poolcount;
+		memcpy(img + soff, w->domain, strlen(w->domain) + 1);
+		soff += strlen(w->domain) + 1;
+		for (i = w->poolcount; i > 0 && w != NULL; i--, w = w->next)
+			providers[j++] = putservers(img, &off, w->dnsservers);
+	}
+
+	hdr->options = soff;
+	memcpy(img + soff, opts, optslen);
+
+	*lenp = len;
+	return img;
+}
+
+/* sanity check an image from a file, such that lookups needn't */
+static int checkimage(const char *img, size_t len) {
+	const config_hdr *hdr = (const config_hdr *)img;
+	const config_slot *slots;
+	const uint32_t *providers;
+	uint32_t used = 0;
+	uint32_t n;
+	uint32_t i;
+
+#define CHECK_LIST(off) \
+	((off) % 4 == 0 && (off) + sizeof(uint32_t) <= len && \
+	 (memcpy(&n, img + (off), sizeof(n)), n <= CONFIG_MAXSERVERS) && \
+	 (off) + SERVERLIST_SIZE(n) <= len)
+#define CHECK_STRING(off) \
+	((off) < len && memchr(img + (off), '\0', len - (off)) != NULL)
+
+	if (len < sizeof(config_hdr) ||
+			hdr->magic != CONFIG_MAGIC ||
+			hdr->version != CONFIG_VERSION ||
+			hdr->size != len ||
+			hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0 ||
+			hdr->slots % 4 != 0 || hdr->providers % 4 != 0 ||
+			hdr->slots + (uint64_t)hdr->nslots * sizeof(config_slot) > len ||
+			hdr->providers +
+				(uint64_t)hdr->nproviders * sizeof(uint32_t) > len ||
+			(hdr->fallback != 0 && !CHECK_LIST(hdr->fallback)) ||
+			!CHECK_STRING(hdr->options))
+		return 1;
+
+	/* a full table would make probing loop forever */
+	slots = (const config_slot *)(img + hdr->slots);
+	for (i = 0; i < hdr->nslots; i++)
+		if (slots[i].domain != 0 &&
+				(!CHECK_STRING(slots[i].domain) ||
+				 slots[i].first > hdr->nproviders ||
+				 slots[i].count == 0 ||
+				 slots[i].count > hdr->nproviders - slots[i].first ||
+				 ++used == hdr->nslots))
+			return 1;
+	providers = (const uint32_t *)(img + hdr->providers);
+	for (i = 0; i < hdr->nproviders; i++)
+		if (!CHECK_LIST(providers[i]))
+			return 1;
+	/* the options end with an empty string */
+	for (i = hdr->options; i < len && img[i] != '\0'; i += strlen(img + i) + 1)
+		if (!CHECK_STRING(i))
+			return 1;
+	if (i >= len)
+		return 1;
+
+	return 0;
+#undef CHECK_LIST
+#undef CHECK_STRING
+}
+
+/* a seed for rand_r(), different for each process and thread, the
+ * rand() of the application isn't ours to use, or to seed */
+unsigned int config_seed(void) {
+	unsigned int seed;
+
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+		seed = (unsigned int)getpid() ^ (unsigned int)time(NULL) ^
+			(unsigned int)(uintptr_t)&seed;
+	return seed;
+}
+
+static __thread unsigned int groupseed = 0;
+
+/* add a provider for domain, with the dnsi servers in fps (ip[:port]),
+ * to the groups in rpool, at a random position among the providers of
+ * the domain already there */
+static void addgroup(domaingroup **rpoolp, const char *domain, char *fps[], int dnsi) {
+	domaingroup *rpool = *rpoolp;
+	domaingroup *tdg = NULL;
+	domaingroup *ndg = NULL;
+	struct sockaddr_in *dnsserver = NULL;
+	char ip[INET_ADDRSTRLEN];
+	const char *p;
+	size_t len;
+	int port;
+	int j, k;
+
+	k = -1;
+	if (rpool == NULL) {
+		tdg = *rpoolp = rpool = malloc(sizeof(domaingroup));
+		tdg->next = NULL;
+	} else {
+		ndg = NULL;
+		for (tdg = rpool; ; tdg = tdg->next) {
+			if (tdg->domain != NULL &&
+					strcmp(tdg->domain, domain) == 0)
+			{
+				/* randomise insertion */
+				tdg->poolcount++;
+				if (groupseed == 0)
+					groupseed = config_seed();
+				k = rand_r(&groupseed) % tdg->poolcount;
+				if (k == 0) {
+					tdg = ndg;
+				} else {
+					for (j = 1; j < k; j++)
+						tdg = tdg->next;
+				}
+				break;
+			}
+			if (tdg->next == NULL)
+				break;
+			ndg = tdg;
+		}
+		ndg = malloc(sizeof(domaingroup));
+		if (tdg == NULL) {
+			ndg->next = rpool;
+			tdg = *rpoolp = rpool = ndg;
+		} else {
+			ndg->next = tdg->next;
+			tdg = tdg->next = ndg;
+		}
+	}
+	if (k == -1) {
+		tdg->domain = strdup(domain);
+		tdg->gid = cache_hash(tdg->domain);
+		tdg->poolcount = 1;
+	} else if (k == 0) {
+		tdg->domain = tdg->next->domain;
+		tdg->gid = tdg->next->gid;
+		tdg->poolcount = tdg->next->poolcount;
+		tdg->next->domain = NULL;
+		tdg->next->poolcount = 0;
+	} else {
+		tdg->domain = NULL;
+		tdg->poolcount = 0;
+	}
+	tdg->dnsservers = malloc(sizeof(*dnsserver) * (dnsi + 1));
+	for (j = 0, k = 0; j < dnsi; j++) {
+		dnsserver = tdg->dnsservers[k++] = malloc(sizeof(*dnsserver));
+		/* fps is left as is, it may be added for more domains */
+		port = 0;
+		len = strlen(fps[j]);
+		if ((p = strchr(fps[j], ':')) != NULL) {
+			len = p - fps[j];
+			port = atoi(p + 1);
+		}
+		if (len >= sizeof(ip))
+			len = 0;  /* makes inet_pton() fail */
+		memcpy(ip, fps[j], len);
+		ip[len] = '\0';
+		if (inet_pton(AF_INET, ip, &(dnsserver->sin_addr)) <= 0) {
+			free(dnsserver);
+			dnsserver = tdg->dnsservers[--k] = NULL;
+			continue;
+		}
+		dnsserver->sin_family = AF_INET;
+		dnsserver->sin_port = htons(port == 0 ? 53 : port);
+	}
+	tdg->dnsservers[k] = NULL;
+}
+
+/* the reverse domain (in-addr.arpa or ip6.arpa) of the first bits of
+ * addr, of family af, a multiple of 8 or 4 bits respectively, in name,
+ * which holds DNSQ_MAXNAME */
+void config_revname(int af, const void *addr, int bits, char *name) {
+	const unsigned char *a = addr;
+	int i;
+
+	*name = '\0';
+	if (af == AF_INET) {
+		for (i = bits / 8 - 1; i >= 0; i--)
+			name += sprintf(name, "%u.", a[i]);
+		strcpy(name, "in-addr.arpa");
+	} else {
+		for (i = bits / 4 - 1; i >= 0; i--)
+			name += sprintf(name, "%x.",
+					i % 2 == 0 ? a[i / 2] >> 4 : a[i / 2] & 0x0F);
+		strcpy(name, "ip6.arpa");
+	}
+}
+
+/* add the pools for a reverse line: an address prefix and the servers
+ * for it; prefixes not on a label boundary (an octet for IPv4, a
+ * nibble for IPv6) become one domain for each value of the bits up to
+ * it */
+static void addreverse(domaingroup **rpoolp, const char *prefix, char *fps[], int dnsi) {
+	unsigned char addr[16];
+	char buf[INET6_ADDRSTRLEN];
+	char domain[DNSQ_MAXNAME];
+	const char *p;
+	int af = strchr(prefix, ':') != NULL ? AF_INET6 : AF_INET;
+	int unit = af == AF_INET ? 8 : 4;
+	int maxbits = af == AF_INET ? 32 : 128;
+	int bits = maxbits;
+	int ubits;
+	int i;
+	int j;
+
+	if ((p = strchr(prefix, '/')) != NULL) {
+		bits = atoi(p + 1);
+		if (p - prefix >= sizeof(buf) || bits < 0 || bits > maxbits)
+			return;
+		memcpy(buf, prefix, p - prefix);
+		buf[p - prefix] = '\0';
+		prefix = buf;
+	}
+	if (inet_pton(af, prefix, addr) <= 0)
+		return;
+	ubits = (bits + unit - 1) / unit * unit;
+
+	for (i = 0; i < 1 << (ubits - bits); i++) {
+		/* the bits from the prefix length up to the boundary */
+		for (j = bits; j < ubits; j++) {
+			if (i & (1 << (ubits - 1 - j)))
+				addr[j / 8] |= 0x80 >> (j % 8);
+			else
+				addr[j / 8] &= ~(0x80 >> (j % 8));
+		}
+		config_revname(af, addr, ubits, domain);
+		addgroup(rpoolp, domain, fps, dnsi);
+	}
+}
+
+static dnspq_config *newconfig(const struct stat *st) {
+	dnspq_config *c;
+
+	if ((c = calloc(1, sizeof(dnspq_config))) == NULL)
+		return NULL;
+	c->dev = st->st_dev;
+	c->ino = st->st_ino;
+	c->size = st->st_size;
+	c->mtime = st->st_mtim;
+
+	return c;
+}
+
+/* read the text config at path and build up the structure per domain,
+ * returns NULL when the file can't be read */
+dnspq_config *config_load(const char *path) {
+	FILE *resolvconf = NULL;
+	struct stat st;
+	dnspq_config *c;
+	domaingroup *rpool = NULL;
+	char buf[1024];
+	domaingroup *tdg = NULL;
+	char *p = NULL, *save;
+	struct sockaddr_in *dnsservers[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	struct sockaddr_in *dnsserver = NULL;
+	int dnsi = 0;
+	char *fps[CONFIG_MAXSERVERS] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	char *opts = NULL;
+	char *domain;
+	char *nopts;
+	size_t optslen = 0;
+	size_t len;
+
+	/* .domain ip:port ip:port ...
+	 * or
+	 * nameserver ip
+	 * or
+	 * options key:value ...
+	 * or
+	 * reverse prefix/len ip:port ip:port ...
+	 *
+	 * The first form creates a group of DNS servers to query for the
+	 * domain.  The leading . is mandatory here (to distinguish easily).
+	 * The second form is to facilitate traditional /etc/resolv.conf
+	 * files.  Interleaving both forms is NOT supported.
+	 * The third form sets tunables, like resolv.conf's options line,
+	 * these are stored as is, for the nss module to interpret.
+	 * The fourth form creates groups for the in-addr.arpa or ip6.arpa
+	 * domains of an address prefix, for reverse lookups.
+	 */
+
+	if ((resolvconf = fopen(path, "re")) == NULL)
+		return NULL;
+	if (fstat(fileno(resolvconf), &st) != 0 ||
+			(c = newconfig(&st)) == NULL)
+	{
+		fclose(resolvconf);
+		return NULL;
+	}
+
+	while (fgets(buf, sizeof(buf), resolvconf) != NULL)
+		if (
+				buf[0] == 'n' &&
+				buf[1] == 'a' &&
+				buf[2] == 'm' &&
+				buf[3] == 'e' &&
+				buf[4] == 's' &&
+				buf[5] == 'e' &&
+				buf[6] == 'r' &&
+				buf[7] == 'v' &&
+				buf[8] == 'e' &&
+				buf[9] == 'r' &&
+				buf[10] == ' ')
+		{ /* traditional /etc/resolv.conf mode */
+			if (dnsi == sizeof(dnsservers) / sizeof(dnsservers[0]) - 1)
+				continue;
+			if ((p = strchr(buf + 11, '\n')) != NULL)
+				*p = '\0';
+			dnsserver = dnsservers[dnsi++] = malloc(sizeof(*dnsserver));
+			if (inet_pton(AF_INET, buf + 11, &(dnsserver->sin_addr)) <= 0) {
+				free(dnsserver);
+				dnsserver = dnsservers[--dnsi] = NULL;
+				continue;
+			}
+			dnsserver->sin_family = AF_INET;
+			dnsserver->sin_port = htons(53);
+		} else if (strncmp(buf, "options ", 8) == 0) {
+			/* not strtok, config_load also runs on reloads while other
+			 * threads may be tokenizing strings of their own */
+			for (p = strtok_r(buf + 8, " \t\n", &save); p != NULL;
+					p = strtok_r(NULL, " \t\n", &save))
+			{
+				len = strlen(p) + 1;
+				if ((nopts = realloc(opts, optslen + len)) == NULL)
+					break;
+				opts = nopts;
+				memcpy(opts + optslen, p, len);
+				optslen += len;
+			}
+		} else if (buf[0] == '.' || strncmp(buf, "reverse ", 8) == 0) {
+			/* group mode, a reverse line names a prefix instead */
+			domain = p = buf + (buf[0] == '.' ? 1 : 8);
+			dnsi = 0;
+			while (dnsi < sizeof(fps) / sizeof(fps[0]) &&
+					(p = strchr(p, ' ')) != NULL)
+			{
+				*p++ = '\0';
+				fps[dnsi] = p;
+				dnsi++;
+			}
+			if (dnsi == 0)
+				continue;
+			if ((p = strchr(fps[dnsi - 1], '\n')) != NULL)
+				*p = '\0';
+			if (buf[0] == '.')
+				addgroup(&rpool, domain, fps, dnsi);
+			else
+				addreverse(&rpool, domain, fps, dnsi);
+			dnsi = 0;
+		}
+	fclose(resolvconf);
+
+	if (dnsi > 0) {
+		/* create fallback group for traditional mode */
+		if (rpool == NULL) {
+			tdg = rpool = malloc(sizeof(domaingroup));
+		} else {
+			for (tdg = rpool; tdg->next != NULL; tdg = tdg->next)
+				;
+			tdg = tdg->next = malloc(sizeof(domaingroup));
+		}
+		tdg->domain = NULL;
+		tdg->gid = 0;
+		tdg->poolcount = 0;
+		tdg->next = NULL;
+		tdg->dnsservers = malloc(sizeof(dnsservers[0]) * (dnsi + 1));
+		memcpy(tdg->dnsservers, dnsservers, sizeof(dnsservers[0]) * (dnsi + 1));
+	}
+
+	c->img = compilegroups(rpool, opts, optslen, &c->len);
+	freegroups(rpool);
+	free(opts);
+	if (c->img == NULL) {
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+/* map the compiled config at path, returns NULL when there is none, or
+ * it isn't valid */
+dnspq_config *config_map(const char *path) {
+	dnspq_config *c;
+	struct stat st;
+	void *img;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(config_hdr) ||
+			(img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+						fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	if (checkimage(img, st.st_size) != 0 || (c = newconfig(&st)) == NULL) {
+		munmap(img, st.st_size);
+		return NULL;
+	}
+	c->img = img;
+	c->len = st.st_size;
+	c->mapped = 1;
+
+	return c;
+}
+
+/* write the image of c to path, replacing it atomically */
+int config_write(const dnspq_config *c, const char *path) {
+	char tmp[1024];
+	size_t off;
+	ssize_t r;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp) ||
+			(fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+					   0644)) == -1)
+		return 1;
+	for (off = 0; off < c->len; off += r)
+		if ((r = write(fd, IMG(c, off), c->len - off)) <= 0)
+			break;
+	if (off < c->len || fsync(fd) != 0) {
+		close(fd);
+		unlink(tmp);
+		return 1;
+	}
+	close(fd);
+
+	if (rename(tmp, path) != 0) {
+		unlink(tmp);
+		return 1;
+	}
+	return 0;
+}
+
+void config_free(dnspq_config *c) {
+	if (c->mapped)
+		munmap((void *)c->img, c->len);
+	else
+		free((void *)c->img);
+	free(c);
+}
+
+/* the file the config is read from, RESOLV_CONF_BIN unless
+ * RESOLV_CONF was changed after it was compiled, a stale compiled
+ * file doesn't hide edits; st describes it, NULL when neither exists */
+const char *config_pick(struct stat *st) {
+	struct stat tst;
+
+	if (stat(RESOLV_CONF, &tst) != 0)
+		return stat(RESOLV_CONF_BIN, st) == 0 ? RESOLV_CONF_BIN : NULL;
+	if (stat(RESOLV_CONF_BIN, st) == 0 &&
+			(st->st_mtim.tv_sec > tst.st_mtim.tv_sec ||
+			 (st->st_mtim.tv_sec == tst.st_mtim.tv_sec &&
+			  st->st_mtim.tv_nsec >= tst.st_mtim.tv_nsec)))
+		return RESOLV_CONF_BIN;
+	*st = tst;
+	return RESOLV_CONF;
+}
+
+/* whether c was read from the file st describes, as it is now */
+int config_from(const dnspq_config *c, const struct stat *st) {
+	return st->st_dev == c->dev && st->st_ino == c->ino &&
+		st->st_size == c->size &&
+		st->st_mtim.tv_sec == c->mtime.tv_sec &&
+		st->st_mtim.tv_nsec == c->mtime.tv_nsec;
+}
+
+/* iterate over the options, pass NULL for the first, returns NULL
+ * after the last */
+const char *config_option(const dnspq_config *c, const char *prev) {
+	const config_hdr *hdr = c->img;
+
+	prev = prev == NULL ? IMG(c, hdr->options) : prev + strlen(prev) + 1;
+	return *prev == '\0' ? NULL : prev;
+}
+
+/* parse a single key:value from an options line */
+static void readoption(dnspq_options *o, const char *opt) {
+	const char *val;
+
+	if (strcmp(opt, "rotate") == 0) {
+		o->rotate = 1;
+		return;
+	} else if (strcmp(opt, "adaptive-timeout") == 0) {
+		o->timing |= DNSQ_ADAPTIVE;
+		return;
+	} else if (strcmp(opt, "hedge") == 0) {
+		o->timing |= DNSQ_HEDGE;
+		return;
+	} else if (strcmp(opt, "stats") == 0) {
+		free(o->stats_prefix);
+		o->stats_prefix = strdup(STATS_PREFIX);
+		return;
+	} else if (strcmp(opt, "daemon") == 0) {
+		free(o->daemon_path);
+		o->daemon_path = strdup(DAEMON_SOCKET);
+		return;
+	}
+
+	if ((val = strchr(opt, ':')) == NULL)
+		return;
+	val++;
+
+	if (strncmp(opt, "cache-size:", 11) == 0) {
+		o->cache_size = (size_t)atol(val);
+	} else if (strncmp(opt, "cache-min-ttl:", 14) == 0) {
+		o->cache_minttl = (unsigned int)atoi(val);
+	} else if (strncmp(opt, "cache-max-ttl:", 14) == 0) {
+		o->cache_maxttl = (unsigned int)atoi(val);
+	} else if (strncmp(opt, "cache-max-neg-ttl:", 18) == 0) {
+		o->cache_negmaxttl = (unsigned int)atoi(val);
+	} else if (strncmp(opt, "shm-cache:", 10) == 0) {
+		free(o->shm_cache);
+		o->shm_cache = strdup(val);
+	} else if (strncmp(opt, "shm-cache-size:", 15) == 0) {
+		o->shm_cache_size = (size_t)atol(val);
+	} else if (strncmp(opt, "refresh-ahead:", 14) == 0) {
+		o->refresh_ahead = (unsigned int)atoi(val);
+	} else if (strncmp(opt, "serve-stale:", 12) == 0) {
+		o->serve_stale = (unsigned int)atoi(val);
+	} else if (strncmp(opt, "stale-timeout:", 14) == 0) {
+		o->stale_timeout = (unsigned int)atoi(val);
+	} else if (strncmp(opt, "edns:", 5) == 0) {
+		o->edns = (unsigned int)atoi(val);
+	} else if (strncmp(opt, "reload-interval:", 16) == 0) {
+		o->reload_interval = (unsigned int)atoi(val);
+	} else if (strncmp(opt, "stats:", 6) == 0) {
+		free(o->stats_prefix);
+		o->stats_prefix = strdup(val);
+	} else if (strncmp(opt, "daemon:", 7) == 0) {
+		free(o->daemon_path);
+		o->daemon_path = strdup(val);
+	}
+}
+
+/* the options of c, the defaults for the ones it doesn't set, or all of
+ * them if c is NULL; for the nss module and the daemon alike */
+void config_options(const dnspq_config *c, dnspq_options *o) {
+	const char *opt;
+
+	memset(o, 0, sizeof(*o));
+	o->cache_size = CACHE_SIZE;
+	o->cache_minttl = CACHE_MIN_TTL;
+	o->cache_maxttl = CACHE_MAX_TTL;
+	o->cache_negmaxttl = CACHE_NEG_MAX_TTL;
+	o->edns = EDNS_SIZE;
+	o->shm_cache_size = SHM_CACHE_SIZE;
+	o->refresh_ahead = REFRESH_AHEAD;
+	o->serve_stale = SERVE_STALE;
+	o->stale_timeout = STALE_TIMEOUT;
+	o->reload_interval = RELOAD_INTERVAL;
+	if (c == NULL)
+		return;
+	for (opt = config_option(c, NULL); opt != NULL; opt = config_option(c, opt))
+		readoption(o, opt);
+}
+
+/* the compiled config if there is one, and it isn't older than the
+ * text one, else the text one */
+dnspq_config *config_read(void) {
+	dnspq_config *c;
+	struct stat st;
+	const char *path;
+
+	if ((path = config_pick(&st)) == NULL)
+		return NULL;
+	if (strcmp(path, RESOLV_CONF_BIN) == 0 &&
+			(c = config_map(path)) != NULL)
+		return c;
+	return config_load(RESOLV_CONF);
+}
+
+static void getservers(
+		const dnspq_config *c,
+		uint32_t off,
+		struct sockaddr_in *servers[])
+{
+	uint32_t n;
+	uint32_t i;
+
+	memcpy(&n, IMG(c, off), sizeof(n));
+	for (i = 0; i < n; i++)
+		servers[i] = (struct sockaddr_in *)IMG(c, off + SERVERLIST_SIZE(i));
+	servers[i] = NULL;
+}
+
+/* locate the set of nameservers for name: the ones of the longest
+ * domain the name is in (the name itself not counting), picking one of
+ * multiple providers using counter rr, else the traditional mode
+ * servers; fills in servers (CONFIG_MAXSERVERS + 1 entries) and gid,
+ * returns 0 when there are none */
+int config_servers(
+		const dnspq_config *c,
+		const char *name,
+		struct sockaddr_in *servers[],
+		uint32_t *gid,
+		unsigned int *rr)
+{
+	const config_hdr *hdr = c->img;
+	const config_slot *slots = (const config_slot *)IMG(c, hdr->slots);
+	const config_slot *slot;
+	const config_slot *match = NULL;
+	const uint32_t *providers;
+	const char *end = name + strlen(name);
+	const char *p;
+	const char *q = end;
+	uint32_t h = 2166136261U;
+	uint32_t i;
+
+	/* probe every suffix starting after a dot, shortest first, the
+	 * last hit is the longest */
+	for (p = end; p > name; p--) {
+		if (p[-1] != '.')
+			continue;
+		h = suffixhash(h, p, q);
+		q = p;
+		for (i = h & (hdr->nslots - 1); (slot = &slots[i])->domain != 0;
+				i = (i + 1) & (hdr->nslots - 1))
+			if (slot->hash == h && strcasecmp(IMG(c, slot->domain), p) == 0) {
+				match = slot;
+				break;
+			}
+	}
+
+	if (match != NULL) {
+		*gid = match->gid;
+		i = 0;
+		if (match->count > 1) {
+			/* 0 means not started yet; forcing a bit to keep it from
+			 * 0 would make every thread start at the same provider of
+			 * an even number of them */
+			while (*rr == 0)
+				*rr = config_seed();
+			i = (*rr)++ % match->count;
+		}
+		providers = (const uint32_t *)IMG(c, hdr->providers);
+		getservers(c, providers[match->first + i], servers);
+		return 1;
+	} else if (hdr->fallback != 0) {
+		getservers(c, hdr->fallback, servers);
+		*gid = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* the domain of the pool with gid, NULL for the servers of
+ * traditional mode */
+const char *config_domain(const dnspq_config *c, uint32_t gid) {
+	const config_hdr *hdr = c->img;
+	const config_slot *slots = (const config_slot *)IMG(c, hdr->slots);
+	uint32_t i;
+
+	for (i = 0; i < hdr->nslots; i++)
+		if (slots[i].domain != 0 && slots[i].gid == gid)
+			return IMG(c, slots[i].domain);
+	return NULL;
+}
+
+#ifdef DNSPQ_COMPILE
+static void dump(const dnspq_config *c) {
+	const config_hdr *hdr = c->img;
+	const config_slot *slots = (const config_slot *)IMG(c, hdr->slots);
+	const uint32_t *providers = (const uint32_t *)IMG(c, hdr->providers);
+	struct sockaddr_in *servers[CONFIG_MAXSERVERS + 1];
+	const char *o;
+	uint32_t i;
+	uint32_t j;
+	int k;
+
+	for (o = config_option(c, NULL); o != NULL; o = config_option(c, o))
+		printf("option %s\n", o);
+	for (i = 0; i < hdr->nslots; i++) {
+		if (slots[i].domain == 0)
+			continue;
+		printf(".%s\n", IMG(c, slots[i].domain));
+		for (j = 0; j < slots[i].count; j++) {
+			getservers(c, providers[slots[i].first + j], servers);
+			printf("   ");
+			for (k = 0; servers[k] != NULL; k++)
+				printf(" %s:%d", inet_ntoa(servers[k]->sin_addr),
+						ntohs(servers[k]->sin_port));
+			printf("\n");
+		}
+	}
+	if (hdr->fallback != 0) {
+		getservers(c, hdr->fallback, servers);
+		for (k = 0; servers[k] != NULL; k++)
+			printf("nameserver %s\n", inet_ntoa(servers[k]->sin_addr));
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const char *conf = RESOLV_CONF;
+	const char *out = RESOLV_CONF_BIN;
+	const char *show = NULL;
+	dnspq_config *c;
+	int i;
+
+	while ((i = getopt(argc, argv, "f:o:d:")) != -1) {
+		switch (i) {
+			case 'f':
+				conf = optarg;
+				break;
+			case 'o':
+				out = optarg;
+				break;
+			case 'd':
+				show = optarg;
+				break;
+			default:
+				printf("DNS Parallel Query config compiler v" VERSION
+						" (" GIT_VERSION ")\n");
+				printf("usage: dnspq-compile [-f resolv-dnspq.conf] "
+						"[-o resolv-dnspq.conf.bin]\n");
+				printf("       dnspq-compile -d resolv-dnspq.conf.bin\n");
+				return 1;
+		}
+	}
+
+	if (show != NULL) {
+		if ((c = config_map(show)) == NULL) {
+			fprintf(stderr, "%s: not a valid compiled config\n", show);
+			return 1;
+		}
+		dump(c);
+		return 0;
+	}
+
+	if ((c = config_load(conf)) == NULL) {
+		fprintf(stderr, "%s: cannot read config\n", conf);
+		return 1;
+	}
+	if (config_write(c, out) != 0) {
+		fprintf(stderr, "%s: cannot write compiled config\n", out);
+		return 1;
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,97 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifndef RESOLV_CONF
+#define RESOLV_CONF "/etc/resolv-dnspq.conf"
+#endif
+/* the output of dnspq-compile, used instead of RESOLV_CONF if present
+ * and not older */
+#ifndef RESOLV_CONF_BIN
+#define RESOLV_CONF_BIN RESOLV_CONF ".bin"
+#endif
+/* seconds between checks whether the config file changed */
+#ifndef RELOAD_INTERVAL
+#define RELOAD_INTERVAL 5
+#endif
+/* answers the in-process and the shared cache hold */
+#ifndef CACHE_SIZE
+#define CACHE_SIZE 1024
+#endif
+#ifndef SHM_CACHE_SIZE
+#define SHM_CACHE_SIZE 4096
+#endif
+
+/* servers per provider */
+#define CONFIG_MAXSERVERS  8
+
+struct sockaddr_in;
+struct stat;
+
+/* a config compiled into a flat image, see config.c */
+typedef struct _dnspq_config {
+	const void *img;
+	size_t len;
+	char mapped;
+	/* the file it was read from */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	/* free for use by the owner */
+	time_t retired;
+	struct _dnspq_config *nextretired;
+} dnspq_config;
+
+/* the options lines of a config, see the README, the strings are
+ * malloc()ed; the daemon ignores the ones of the in-process caches */
+typedef struct _dnspq_options {
+	size_t cache_size;
+	unsigned int cache_minttl;
+	unsigned int cache_maxttl;
+	unsigned int cache_negmaxttl;
+	char rotate;
+	int timing;
+	unsigned int edns;
+	char *shm_cache;
+	size_t shm_cache_size;
+	unsigned int refresh_ahead;
+	unsigned int serve_stale;
+	unsigned int stale_timeout;
+	unsigned int reload_interval;
+	char *stats_prefix;
+	char *daemon_path;
+} dnspq_options;
+
+dnspq_config *config_load(const char *path);
+dnspq_config *config_map(const char *path);
+int config_write(const dnspq_config *c, const char *path);
+void config_free(dnspq_config *c);
+unsigned int config_seed(void);
+const char *config_pick(struct stat *st);
+int config_from(const dnspq_config *c, const struct stat *st);
+const char *config_option(const dnspq_config *c, const char *prev);
+void config_options(const dnspq_config *c, dnspq_options *o);
+dnspq_config *config_read(void);
+int config_servers(const dnspq_config *c, const char *name,
+		struct sockaddr_in *servers[], uint32_t *gid, unsigned int *rr);
+const char *config_domain(const dnspq_config *c, uint32_t gid);
+void config_revname(int af, const void *addr, int bits, char *name);
@@ -0,0 +1,695 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* host-local resolver daemon
+ *
+ * dnspq-daemon does the lookups of all processes on a host using the
+ * nss module with the daemon option, such that they share one cache
+ * and one view of the health of the servers, and the servers see one
+ * query per name instead of one per process.  The module sends the
+ * question in a datagram over a unix socket and gets the answer back
+ * the same way, a single local round trip.  When the daemon isn't
+ * running, or doesn't answer, the module asks the servers itself. */
+
+#define _GNU_SOURCE  /* recvmmsg, ppoll */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "dnspq.h"
+#include "daemon.h"
+
+#define DAEMON_MAGIC  0x64717064  /* "dpqd" */
+
+/* a question, sent up to and including the null byte of the name */
+typedef struct _daemon_request {
+	uint32_t magic;
+	uint32_t id;
+	int32_t qtypes;
+	char name[256];
+} daemon_request;
+
+/* err and ans like dnsq_ctx_query(), err -1 when the daemon can't take
+ * the question, the client asks the servers itself then */
+typedef struct _daemon_response {
+	uint32_t magic;
+	uint32_t id;
+	int32_t err;
+	struct dnsq_answer ans;
+} daemon_response;
+
+static inline int64_t now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
+/* Each thread has its own socket, with an autobound address, such that
+ * answers only reach the thread that asked.  It blocks for
+ * DAEMON_TIMEOUT at most, such that a lookup takes just a send and a
+ * receive. */
+static __thread int daemonfd = -1;
+static __thread uint32_t daemonseq = 0;
+static int64_t daemondown = 0;  /* usec, the daemon isn't tried until then */
+static pthread_key_t daemonkey;
+static pthread_once_t daemononce = PTHREAD_ONCE_INIT;
+
+static void daemon_key_free(void *v) {
+	close((int)(intptr_t)v - 1);
+}
+
+static void daemon_close(void) {
+	if (daemonfd == -1)
+		return;
+	close(daemonfd);
+	daemonfd = -1;
+	pthread_setspecific(daemonkey, NULL);
+}
+
+/* a forked child must not take the answers meant for its parent, the
+ * sockets of the other threads aren't used in the child */
+static void daemon_init(void) {
+	pthread_key_create(&daemonkey, daemon_key_free);
+	pthread_atfork(NULL, NULL, daemon_close);
+}
+
+/* the socket of this thread, connected to the daemon at path */
+static int daemon_socket(const char *path) {
+	struct sockaddr_un sa;
+	struct timeval tv;
+	int fd;
+
+	if (daemonfd != -1)
+		return daemonfd;
+	pthread_once(&daemononce, daemon_init);
+
+	if (strlen(path) >= sizeof(sa.sun_path) ||
+			(fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	tv.tv_sec = DAEMON_TIMEOUT / 1000;
+	tv.tv_usec = DAEMON_TIMEOUT % 1000 * 1000;
+	/* binding just the family picks a unique abstract address, which
+	 * the daemon sends the answers to */
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa_family_t)) != 0 ||
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		close(fd);
+		return -1;
+	}
+	daemonfd = fd;
+	pthread_setspecific(daemonkey, (void *)(intptr_t)(fd + 1));
+	return fd;
+}
+
+/* the daemon is gone or hung, leave it alone for a while */
+static void daemon_fail(int64_t now) {
+	daemon_close();
+	__atomic_store_n(&daemondown, now + DAEMON_RETRY * 1000 * 1000,
+			__ATOMIC_RELAXED);
+}
+
+/* ask the daemon listening on path for the qtypes records of name,
+ * returns like dnsq_ctx_query(), or -1 when the daemon can't be asked,
+ * in which case the caller should ask the servers itself */
+int daemon_query(
+		const char *path,
+		const char *name,
+		int qtypes,
+		struct dnsq_answer *ans)
+{
+	daemon_request req;
+	daemon_response resp;
+	int64_t now = now_usec();
+	int64_t end = now + DAEMON_TIMEOUT * 1000;
+	size_t len;
+	ssize_t r;
+	int fd;
+
+	if (now < __atomic_load_n(&daemondown, __ATOMIC_RELAXED) ||
+			(len = strlen(name)) >= sizeof(req.name))
+		return -1;
+	if ((fd = daemon_socket(path)) == -1) {
+		daemon_fail(now);
+		return -1;
+	}
+
+	req.magic = DAEMON_MAGIC;
+	req.id = ++daemonseq;
+	req.qtypes = qtypes;
+	memcpy(req.name, name, len + 1);
+	if (send(fd, &req, offsetof(daemon_request, name) + len + 1,
+				MSG_DONTWAIT) == -1)
+	{
+		/* a full queue means the daemon is busy, not gone */
+		if (errno != EAGAIN)
+			daemon_fail(now);
+		return -1;
+	}
+
+	for (;;) {
+		if ((r = recv(fd, &resp, sizeof(resp), 0)) == sizeof(resp) &&
+				resp.magic == DAEMON_MAGIC && resp.id == req.id)
+		{
+			/* whatever listens on path is another process, don't
+			 * trust what it sends blindly, a bad answer is none */
+			if (resp.err == -1 ||
+					resp.ans.naddrs < 0 || resp.ans.naddrs > DNSQ_MAXADDRS ||
+					resp.ans.naddrs6 < 0 ||
+					resp.ans.naddrs6 > DNSQ_MAXADDRS6)
+				return -1;
+			/* the names end in an empty one, whatever was sent */
+			resp.ans.canon[DNSQ_MAXNAME - 2] = '\0';
+			resp.ans.canon[DNSQ_MAXNAME - 1] = '\0';
+			*ans = resp.ans;
+			return resp.err;
+		}
+		/* answers to earlier questions we gave up on are skipped */
+		if ((r == -1 && errno != EINTR) || (now = now_usec()) >= end)
+			break;
+	}
+	daemon_fail(now);
+	return -1;
+}
+
+
+#ifdef DNSPQ_DAEMON
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "config.h"
+#include "stats.h"
+
+#ifndef DAEMON_CACHE_SIZE
+# define DAEMON_CACHE_SIZE  65536
+#endif
+#ifndef DAEMON_BATCH
+# define DAEMON_BATCH  32  /* questions taken per recvmmsg() */
+#endif
+/* buckets of the table of queries in flight, a power of 2 */
+#ifndef DAEMON_FLIGHTS
+# define DAEMON_FLIGHTS  4096
+#endif
+
+/* a client asking for a name that is being asked for already */
+typedef struct _joiner {
+	struct sockaddr_un from;
+	socklen_t fromlen;
+	uint32_t id;
+	int64_t begin;
+	char stale;                 /* it had a stale answer, served on failure */
+	struct _joiner *next;
+} joiner;
+
+/* a query to the servers, for a client waiting at from, or a refresh
+ * nobody waits for */
+typedef struct _pending {
+	struct sockaddr_un from;
+	socklen_t fromlen;          /* 0 when nobody waits (anymore) */
+	uint32_t id;
+	uint32_t hash;
+	uint32_t gid;
+	stats_pool *sp;
+	int64_t begin;
+	int64_t staleat;            /* serve stale past this, 0 if not */
+	char staleerr;
+	struct dnsq_answer stale;
+	struct _pending *prev;      /* the ones with a stale answer, by staleat */
+	struct _pending *next;
+	struct _pending *fnext;     /* in the flights table */
+	joiner *joined;             /* clients sharing the answer */
+	char name[256];
+} pending;
+
+static volatile sig_atomic_t stop = 0;
+static dnspq_config *conf = NULL;
+static unsigned int rrcnt = 0;
+static int sfd = -1;
+static dnsq_async *as = NULL;
+static int outstanding = 0;
+static pending *stalehead = NULL;
+static pending *staletail = NULL;
+static pending *flights[DAEMON_FLIGHTS];
+
+static size_t cache_size = DAEMON_CACHE_SIZE;
+/* the options of the nss module, the ones of the in-process caches
+ * don't apply, the cache size is given with -c */
+static dnspq_options opts;
+
+static void onsignal(int sig) {
+	(void)sig;
+	stop = 1;
+}
+
+/* pick up changes to the pools, queries copy the servers they use, so
+ * the old config can go right away */
+static void reload(void) {
+	dnspq_config *c;
+	struct stat st;
+
+	if (config_pick(&st) != NULL &&
+			(conf == NULL || !config_from(conf, &st)) &&
+			(c = config_read()) != NULL)
+	{
+		if (conf != NULL)
+			config_free(conf);
+		conf = c;
+	}
+}
+
+static void reply(
+		const struct sockaddr_un *to,
+		socklen_t tolen,
+		uint32_t id,
+		int err,
+		const struct dnsq_answer *ans)
+{
+	daemon_response resp;
+
+	resp.magic = DAEMON_MAGIC;
+	resp.id = id;
+	resp.err = err;
+	if (ans != NULL)
+		resp.ans = *ans;
+	else
+		memset(&resp.ans, 0, sizeof(resp.ans));
+	/* a client that went away, or doesn't read, doesn't hold us up */
+	sendto(sfd, &resp, sizeof(resp), MSG_DONTWAIT,
+			(const struct sockaddr *)to, tolen);
+}
+
+/* serve the stale answer of p at at, unless the query is done by then */
+static void stale_link(pending *p, int64_t at) {
+	p->staleat = at;
+	p->next = NULL;
+	p->prev = staletail;
+	if (staletail != NULL)
+		staletail->next = p;
+	else
+		stalehead = p;
+	staletail = p;
+}
+
+static void stale_unlink(pending *p) {
+	if (p->prev != NULL)
+		p->prev->next = p->next;
+	else
+		stalehead = p->next;
+	if (p->next != NULL)
+		p->next->prev = p->prev;
+	else
+		staletail = p->prev;
+	p->staleat = 0;
+}
+
+/* serve the stale answers of the refreshes that take too long, the
+ * list is in order since they all wait for stale-timeout */
+static void stale_expire(int64_t now) {
+	pending *p;
+	joiner **jp;
+	joiner *j;
+
+	while ((p = stalehead) != NULL && p->staleat <= now) {
+		stale_unlink(p);
+		/* the query goes on, an answer replaces the entry */
+		cache_stale(p->name, p->hash, p->gid);
+		if (p->fromlen != 0) {
+			stats_hit(p->sp, 1);
+			reply(&p->from, p->fromlen, p->id, p->staleerr, &p->stale);
+			p->fromlen = 0;
+		}
+		/* those that joined without a stale answer wait for the query */
+		for (jp = &p->joined; (j = *jp) != NULL; ) {
+			if (j->stale) {
+				*jp = j->next;
+				stats_hit(p->sp, 1);
+				reply(&j->from, j->fromlen, j->id, p->staleerr, &p->stale);
+				free(j);
+			} else {
+				jp = &j->next;
+			}
+		}
+	}
+}
+
+/* a query completed, its outcome is cached with the TTL clamped like
+ * store() in nss-dnspq.c does, and given to the client, if any */
+static void done(void *arg, int err, struct dnsq_answer *ans) {
+	pending *p = arg;
+	unsigned int cttl;
+	char stale = p->staleat != 0;
+	pending **fp;
+	joiner *j;
+
+	outstanding--;
+	if (stale)
+		stale_unlink(p);
+	for (fp = &flights[p->hash & (DAEMON_FLIGHTS - 1)]; *fp != NULL;
+			fp = &(*fp)->fnext)
+	{
+		if (*fp == p) {
+			*fp = p->fnext;
+			break;
+		}
+	}
+	if (ans != NULL) {
+		if (err == 0)
+			cttl = ans->ttl > opts.cache_maxttl ? opts.cache_maxttl : ans->ttl;
+		else
+			cttl = ans->ttl > opts.cache_negmaxttl ? opts.cache_negmaxttl : ans->ttl;
+		if (cttl < opts.cache_minttl)
+			cttl = opts.cache_minttl;
+		cache_insert(p->name, p->hash, p->gid, err == 0 ? ans : NULL,
+				cttl, (char)err);
+	}
+
+	if (p->fromlen != 0) {
+		if (ans == NULL && stale) {
+			cache_stale(p->name, p->hash, p->gid);
+			stats_hit(p->sp, 1);
+			reply(&p->from, p->fromlen, p->id, p->staleerr, &p->stale);
+		} else if (ans == NULL && stop) {
+			/* shutting down, let the client ask itself */
+			reply(&p->from, p->fromlen, p->id, -1, NULL);
+		} else {
+			stats_query(p->sp, err,
+					(unsigned int)(now_usec() - p->begin));
+			reply(&p->from, p->fromlen, p->id, err, ans);
+		}
+	}
+	while ((j = p->joined) != NULL) {
+		p->joined = j->next;
+		if (ans == NULL && j->stale) {
+			stats_hit(p->sp, 1);
+			reply(&j->from, j->fromlen, j->id, p->staleerr, &p->stale);
+		} else if (ans == NULL && stop) {
+			reply(&j->from, j->fromlen, j->id, -1, NULL);
+		} else {
+			stats_query(p->sp, err, (unsigned int)(now_usec() - j->begin));
+			reply(&j->from, j->fromlen, j->id, err, ans);
+		}
+		free(j);
+	}
+	free(p);
+}
+
+static void question(
+		const daemon_request *req,
+		size_t len,
+		const struct sockaddr_un *from,
+		socklen_t fromlen)
+{
+	struct sockaddr_in *servers[CONFIG_MAXSERVERS + 1];
+	struct dnsq_answer ans;
+	stats_pool *sp;
+	pending *p;
+	joiner *j;
+	uint32_t gid;
+	uint32_t hash;
+	char err;
+	int c;
+
+	/* clients without an address can't get an answer */
+	if (fromlen <= sizeof(sa_family_t) ||
+			len <= offsetof(daemon_request, name) ||
+			req->magic != DAEMON_MAGIC || req->name[0] == '\0' ||
+			memchr(req->name, '\0',
+				len - offsetof(daemon_request, name)) == NULL ||
+			req->qtypes == 0 ||
+			((req->qtypes & ~DNSQ_QTYPES) != 0 ||
+			 (req->qtypes & DNSQ_PTR && req->qtypes != DNSQ_PTR)))
+		return;
+
+	if (conf == NULL ||
+			!config_servers(conf, req->name, servers, &gid, &rrcnt))
+	{
+		reply(from, fromlen, req->id, 1, NULL);
+		return;
+	}
+	if ((sp = stats_pool_get(gid)) != NULL && sp->domain[0] == '\0')
+		stats_pool_name(sp, config_domain(conf, gid));
+
+	/* cached per set of query types, like the nss module does */
+	gid = (gid & ~(uint32_t)DNSQ_QTYPES) | req->qtypes;
+	hash = cache_hash(req->name);
+	/* negative entries only set the TTL, the rest goes out as well,
+	 * to anyone that can write the socket */
+	memset(&ans, 0, sizeof(ans));
+	c = cache_lookup(req->name, hash, gid, &ans, &err, opts.serve_stale);
+	if (c == CACHE_HIT || c == CACHE_REFRESH) {
+		stats_hit(sp, 0);
+		reply(from, fromlen, req->id, err, &ans);
+		if (c == CACHE_HIT)
+			return;
+	}
+
+	/* clients asking for the same name at the same time share a query,
+	 * they all wait for its answer at most as long as for their own, a
+	 * refresh of a name that is being asked for already is left to it,
+	 * those with a stale answer get it when the query takes too long */
+	for (p = flights[hash & (DAEMON_FLIGHTS - 1)]; p != NULL; p = p->fnext)
+		if (p->hash == hash && p->gid == gid &&
+				strcasecmp(p->name, req->name) == 0)
+			break;
+	if (p != NULL) {
+		if (c == CACHE_REFRESH)
+			return;
+		if ((j = malloc(sizeof(*j))) == NULL) {
+			if (c == CACHE_STALE) {
+				stats_hit(sp, 1);
+				reply(from, fromlen, req->id, err, &ans);
+			} else {
+				reply(from, fromlen, req->id, -1, NULL);
+			}
+			return;
+		}
+		memcpy(&j->from, from, fromlen);
+		j->fromlen = fromlen;
+		j->id = req->id;
+		j->begin = now_usec();
+		j->stale = c == CACHE_STALE;
+		j->next = p->joined;
+		p->joined = j;
+		if (j->stale && p->staleat == 0) {
+			p->stale = ans;
+			p->staleerr = err;
+			stale_link(p, j->begin + (int64_t)opts.stale_timeout * 1000);
+		}
+		return;
+	}
+
+	if ((p = malloc(sizeof(*p))) == NULL) {
+		if (c != CACHE_REFRESH)
+			reply(from, fromlen, req->id, -1, NULL);
+		return;
+	}
+	p->fromlen = 0;
+	if (c != CACHE_REFRESH) {
+		memcpy(&p->from, from, fromlen);
+		p->fromlen = fromlen;
+	}
+	p->id = req->id;
+	p->hash = hash;
+	p->gid = gid;
+	p->sp = sp;
+	p->begin = now_usec();
+	p->staleat = 0;
+	p->joined = NULL;
+	strcpy(p->name, req->name);
+
+	if (dnsq_async_submit(as, servers, p->name, req->qtypes, done, p) == 0) {
+		if (c == CACHE_STALE) {
+			stats_hit(sp, 1);
+			reply(from, fromlen, req->id, err, &ans);
+		} else if (c != CACHE_REFRESH) {
+			reply(from, fromlen, req->id, -1, NULL);
+		}
+		free(p);
+		return;
+	}
+	outstanding++;
+	p->fnext = flights[hash & (DAEMON_FLIGHTS - 1)];
+	flights[hash & (DAEMON_FLIGHTS - 1)] = p;
+
+	if (c == CACHE_STALE) {
+		p->stale = ans;
+		p->staleerr = err;
+		stale_link(p, p->begin + (int64_t)opts.stale_timeout * 1000);
+	}
+}
+
+/* all the questions that arrived, batch by batch */
+static void questions(void) {
+	daemon_request reqs[DAEMON_BATCH];
+	struct sockaddr_un froms[DAEMON_BATCH];
+	struct mmsghdr msgs[DAEMON_BATCH];
+	struct iovec iovs[DAEMON_BATCH];
+	int n;
+	int i;
+
+	do {
+		for (i = 0; i < DAEMON_BATCH; i++) {
+			iovs[i].iov_base = &reqs[i];
+			iovs[i].iov_len = sizeof(reqs[i]);
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_name = &froms[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(froms[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		if ((n = recvmmsg(sfd, msgs, DAEMON_BATCH, MSG_DONTWAIT, NULL)) <= 0)
+			break;
+		for (i = 0; i < n; i++)
+			question(&reqs[i], msgs[i].msg_len, &froms[i],
+					msgs[i].msg_hdr.msg_namelen);
+	} while (n == DAEMON_BATCH);
+}
+
+int main(int argc, char *argv[]) {
+	const char *path = NULL;
+	struct sockaddr_un sa;
+	struct pollfd pfds[2];
+	struct timeval tv;
+	struct timespec ts;
+	struct stat st;
+	int64_t now;
+	int64_t wake;
+	int64_t nextcheck;
+	long csize = -1;
+	int i;
+
+	while ((i = getopt(argc, argv, "s:c:")) != -1) {
+		switch (i) {
+			case 's':
+				path = optarg;
+				break;
+			case 'c':
+				csize = atol(optarg);
+				break;
+			default:
+				printf("DNS Parallel Query daemon v" VERSION
+						" (" GIT_VERSION ")\n");
+				printf("usage: dnspq-daemon [-s " DAEMON_SOCKET "] "
+						"[-c cache-size]\n");
+				return 1;
+		}
+	}
+
+	if ((conf = config_read()) == NULL) {
+		fprintf(stderr, "%s: cannot read config\n", RESOLV_CONF);
+		return 1;
+	}
+	config_options(conf, &opts);
+	if (csize >= 0)
+		cache_size = (size_t)csize;
+	if (path == NULL)
+		path = opts.daemon_path != NULL ? opts.daemon_path : DAEMON_SOCKET;
+
+	dnsq_set_timing(opts.timing);
+	dnsq_set_edns(opts.edns);
+	cache_init(cache_size, opts.refresh_ahead);
+	if (opts.stats_prefix != NULL && stats_open(opts.stats_prefix) != 0)
+		fprintf(stderr, "%s: cannot open stats segment\n", opts.stats_prefix);
+	if ((as = dnsq_async_new()) == NULL) {
+		fprintf(stderr, "cannot create socket: %s\n", strerror(errno));
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", path);
+		return 1;
+	}
+	strcpy(sa.sun_path, path);
+	/* the socket of a previous run, never anything else */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if ((sfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+					0)) == -1 ||
+			bind(sfd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+	{
+		fprintf(stderr, "%s: cannot bind: %s\n", path, strerror(errno));
+		return 1;
+	}
+	/* any process may resolve through the daemon */
+	chmod(path, 0666);
+
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+
+	pfds[0].fd = sfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = dnsq_async_fd(as);
+	pfds[1].events = POLLIN;
+	nextcheck = now_usec() + (int64_t)opts.reload_interval * 1000 * 1000;
+	while (!stop) {
+		now = now_usec();
+		wake = opts.reload_interval == 0 ? -1 : nextcheck;
+		if (dnsq_async_timeout(as, &tv) != NULL &&
+				(wake == -1 || now + tv.tv_sec * 1000 * 1000 +
+				 tv.tv_usec < wake))
+			wake = now + tv.tv_sec * 1000 * 1000 + tv.tv_usec;
+		if (stalehead != NULL && (wake == -1 || stalehead->staleat < wake))
+			wake = stalehead->staleat;
+		wake = wake == -1 ? -1 : wake > now ? wake - now : 0;
+		ts.tv_sec = wake / (1000 * 1000);
+		ts.tv_nsec = wake % (1000 * 1000) * 1000;
+		if (ppoll(pfds, 2, wake == -1 ? NULL : &ts, NULL) == -1 &&
+				errno != EINTR)
+			break;
+
+		if (outstanding > 0)
+			dnsq_async_process(as);
+		now = now_usec();
+		stale_expire(now);
+		if (pfds[0].revents & POLLIN)
+			questions();
+		if (opts.reload_interval != 0 && now >= nextcheck) {
+			reload();
+			nextcheck = now + (int64_t)opts.reload_interval * 1000 * 1000;
+		}
+	}
+
+	unlink(path);
+	dnsq_async_free(as);
+	close(sfd);
+	return 0;
+}
+#endif
@@ -0,0 +1,35 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DAEMON_SOCKET
+# define DAEMON_SOCKET  "/run/dnspq.sock"
+#endif
+/* ms to wait for an answer from the daemon, longer than its queries to
+ * the servers take, after which it is considered hung */
+#ifndef DAEMON_TIMEOUT
+# define DAEMON_TIMEOUT  1000
+#endif
+/* seconds the daemon isn't tried after it couldn't be reached */
+#ifndef DAEMON_RETRY
+# define DAEMON_RETRY  5
+#endif
+
+struct dnsq_answer;
+
+int daemon_query(const char *path, const char *name, int qtypes,
+		struct dnsq_answer *ans);
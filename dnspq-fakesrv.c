@@ -0,0 +1,639 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* fake DNS server for testing
+ *
+ * Answers A, AAAA and PTR questions on any number of UDP ports, each with
+ * its own latency distribution and fault injection, such that the
+ * fanout, retry and failover logic can be exercised without real
+ * servers.  Options apply to the ports following them, e.g.
+ *
+ *   dnspq-fakesrv -l 100-300 5301 -d 0.2 -s 0.1 5302
+ *
+ * runs a healthy server on port 5301, and one that additionally drops
+ * 20% of the questions and answers 10% with SERVFAIL on port 5302.
+ * Answers carry the addresses 10.<port/256>.<port%256>.<n> and
+ * fd00::<port>:<n>, PTR answers the names h<n>.p<port>, as many as
+ * there are A records.  All randomness comes from the seed, so runs are
+ * reproducible.  Statistics per port are printed on SIGINT/SIGTERM.
+ *
+ * Answers over UDP are truncated to 512 bytes, or the payload size of
+ * the EDNS0 OPT record in the question.  The same ports take questions
+ * over TCP, which are answered in full, right away, without faults. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dnspq.h"
+
+#define MAXPORTS    64
+#define MAXPENDING  65536  /* delayed answers, beyond this they're dropped */
+#define MAXCONNS    64     /* TCP connections, beyond this they're closed */
+#define MAXMSG      4096
+
+#define QTYPE_A      1
+#define QTYPE_CNAME  5
+#define QTYPE_SOA    6
+#define QTYPE_PTR    12
+#define QTYPE_AAAA   28
+#define QTYPE_OPT    41
+
+/* latency distributions, in usec */
+#define LAT_FIXED    0  /* lmin */
+#define LAT_UNIFORM  1  /* lmin to lmax */
+#define LAT_EXP      2  /* exponential with mean lmin */
+
+typedef struct _fakesrv {
+	int fd;
+	int lfd;             /* TCP listener */
+	int port;
+	/* behaviour */
+	char ltype;
+	double lmin;
+	double lmax;
+	double tailp;        /* chance of adding tail to the latency */
+	double tail;
+	double drop;
+	double servfail;
+	double refused;
+	double nxdomain;
+	double truncate;
+	double malformed;
+	int naddrs;
+	int naddrs6;
+	int cnames;          /* length of the CNAME chain before the records */
+	unsigned int ttl;
+	/* what happened */
+	unsigned long queries;
+	unsigned long answers;
+	unsigned long drops;
+	unsigned long rcodes;  /* SERVFAIL, REFUSED and NXDOMAIN */
+	unsigned long truncs;
+	unsigned long malforms;
+	unsigned long tcp;     /* questions over TCP */
+} fakesrv;
+
+typedef struct _pending {
+	int64_t due;
+	int srv;
+	struct sockaddr_in to;
+	size_t len;
+	unsigned char buf[MAXMSG];
+} pending;
+
+typedef struct _tcpconn {
+	int fd;
+	int srv;
+} tcpconn;
+
+static fakesrv srvs[MAXPORTS];
+static int nsrvs = 0;
+static pending *heap[MAXPENDING];
+static int nheap = 0;
+static tcpconn conns[MAXCONNS];
+static int nconns = 0;
+static uint64_t rng;
+static volatile sig_atomic_t stop = 0;
+
+static void onsignal(int sig) {
+	stop = 1;
+}
+
+static inline int64_t now_usec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, uniform in [0, 1) */
+static double rnd(void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (double)((rng * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+static int64_t latency(const fakesrv *s) {
+	double l;
+
+	switch (s->ltype) {
+		case LAT_UNIFORM:
+			l = s->lmin + (s->lmax - s->lmin) * rnd();
+			break;
+		case LAT_EXP:
+			l = -s->lmin * log(1.0 - rnd());
+			break;
+		default:
+			l = s->lmin;
+			break;
+	}
+	if (s->tailp > 0 && rnd() < s->tailp)
+		l += s->tail;
+	return (int64_t)l;
+}
+
+/* min-heap on due time */
+static void heap_push(pending *p) {
+	int i = nheap++;
+
+	for (; i > 0 && heap[(i - 1) / 2]->due > p->due; i = (i - 1) / 2)
+		heap[i] = heap[(i - 1) / 2];
+	heap[i] = p;
+}
+
+static pending *heap_pop(void) {
+	pending *top = heap[0];
+	pending *last = heap[--nheap];
+	int i = 0;
+	int c;
+
+	while ((c = 2 * i + 1) < nheap) {
+		if (c + 1 < nheap && heap[c + 1]->due < heap[c]->due)
+			c++;
+		if (last->due <= heap[c]->due)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	if (nheap > 0)
+		heap[i] = last;
+	return top;
+}
+
+static inline unsigned char *put16(unsigned char *p, uint16_t v) {
+	*p++ = v >> 8;
+	*p++ = v & 0xff;
+	return p;
+}
+
+static inline unsigned char *put32(unsigned char *p, uint32_t v) {
+	p = put16(p, v >> 16);
+	return put16(p, v & 0xffff);
+}
+
+static unsigned char *putrr(
+		unsigned char *p,
+		uint16_t owner,
+		uint16_t type,
+		uint32_t ttl,
+		uint16_t rdlen)
+{
+	p = put16(p, 0xc000 | owner);
+	p = put16(p, type);
+	p = put16(p, 1 /* IN */);
+	p = put32(p, ttl);
+	return put16(p, rdlen);
+}
+
+/* build the response to the question in q (qlen bytes) in r, which
+ * holds MAXMSG bytes, returns its length, or 0 to drop it; faults are
+ * only injected for UDP */
+static size_t respond(
+		fakesrv *s,
+		const unsigned char *q,
+		size_t qlen,
+		unsigned char *r,
+		char tcp)
+{
+	size_t off = 12;
+	size_t qend;
+	size_t max = tcp ? MAXMSG : 512;
+	uint16_t qtype;
+	uint16_t owner = 12;
+	uint16_t ancount = 0;
+	unsigned char *p;
+	unsigned char *last = NULL;  /* the last record in the answer */
+	char name[20];
+	int hl;
+	int pl;
+	double x;
+	int i;
+	int n;
+
+	if (qlen < 12 || (q[2] & 0x80) || ((q[4] << 8) | q[5]) != 1)
+		return 0;
+	while (off < qlen && q[off] != 0) {
+		if (q[off] > 63)
+			return 0;
+		off += q[off] + 1;
+	}
+	if (off + 5 > qlen)
+		return 0;
+	qend = off + 5;
+	qtype = (q[off + 1] << 8) | q[off + 2];
+	/* an OPT record right after the question raises the UDP limit */
+	if (!tcp && ((q[10] << 8) | q[11]) >= 1 && qend + 11 <= qlen &&
+			q[qend] == 0 && ((q[qend + 1] << 8) | q[qend + 2]) == QTYPE_OPT)
+	{
+		max = (q[qend + 3] << 8) | q[qend + 4];
+		max = max < 512 ? 512 : max > MAXMSG ? MAXMSG : max;
+	}
+
+	s->queries++;
+	if (tcp) {
+		s->tcp++;
+	} else if (s->drop > 0 && rnd() < s->drop) {
+		s->drops++;
+		return 0;
+	}
+
+	memcpy(r, q, qend);
+	r[2] = 0x80 | (q[2] & 0x01);  /* QR, RD copied */
+	r[3] = 0x80;                  /* RA */
+	memset(r + 6, 0, 6);
+	p = r + qend;
+
+	x = tcp ? 1.0 : rnd();
+	if (x < s->servfail) {
+		r[3] |= 2;
+		s->rcodes++;
+		return qend;
+	} else if ((x -= s->servfail) < s->refused) {
+		r[3] |= 5;
+		s->rcodes++;
+		return qend;
+	} else if ((x -= s->refused) < s->nxdomain) {
+		/* with a SOA, so there's a negative caching TTL */
+		r[3] |= 3;
+		p = putrr(p, 12, QTYPE_SOA, s->ttl, 22);
+		*p++ = 0;
+		*p++ = 0;
+		p = put32(p, 1);
+		p = put32(p, 3600);
+		p = put32(p, 600);
+		p = put32(p, 86400);
+		p = put32(p, s->ttl);
+		put16(r + 8, 1);
+		s->rcodes++;
+		return p - r;
+	}
+	if (!tcp && s->truncate > 0 && rnd() < s->truncate) {
+		r[2] |= 0x02;
+		s->truncs++;
+		return qend;
+	}
+
+	/* CNAME chain c1.<qname> -> c2.<qname> -> ... */
+	for (i = 1; i <= s->cnames && i < 10; i++) {
+		p = putrr(p, owner, QTYPE_CNAME, s->ttl, 5);
+		owner = p - r;
+		*p++ = 2;
+		*p++ = 'c';
+		*p++ = '0' + i;
+		p = put16(p, 0xc000 | 12);
+		ancount++;
+	}
+	n = qtype == QTYPE_A || qtype == QTYPE_PTR ? s->naddrs :
+		qtype == QTYPE_AAAA ? s->naddrs6 : 0;
+	for (i = 0; i < n && (size_t)(p - r) + 28 <= max; i++) {
+		last = p;
+		if (qtype == QTYPE_PTR) {
+			/* two labels, h<n> and p<port> */
+			hl = snprintf(name + 1, 8, "h%d", i + 1);
+			name[0] = (char)hl;
+			pl = snprintf(name + 2 + hl, 8, "p%d", s->port);
+			name[1 + hl] = (char)pl;
+			p = putrr(p, owner, QTYPE_PTR, s->ttl, hl + pl + 3);
+			memcpy(p, name, hl + pl + 2);
+			p += hl + pl + 2;
+			*p++ = 0;
+		} else if (qtype == QTYPE_A) {
+			p = putrr(p, owner, QTYPE_A, s->ttl, 4);
+			*p++ = 10;
+			*p++ = s->port >> 8;
+			*p++ = s->port & 0xff;
+			*p++ = i + 1;
+		} else {
+			p = putrr(p, owner, QTYPE_AAAA, s->ttl, 16);
+			*p++ = 0xfd;
+			memset(p, 0, 11);
+			p += 11;
+			p = put16(p, s->port);
+			p = put16(p, i + 1);
+		}
+		ancount++;
+	}
+	put16(r + 6, ancount);
+	if (i < n) {
+		/* the rest doesn't fit */
+		r[2] |= 0x02;
+		s->truncs++;
+	}
+
+	if (!tcp && s->malformed > 0 && rnd() < s->malformed) {
+		s->malforms++;
+		switch ((int)(rnd() * (last != NULL ? 4 : 3))) {
+			case 0:
+				/* cut short in the middle of the header */
+				return 7;
+			case 1:
+				/* claims more records than it has */
+				put16(r + 6, ancount + 3);
+				break;
+			case 2:
+				/* answers a different question, not just in another
+				 * case, which names compare equal in */
+				r[13] ^= 0x01;
+				break;
+			case 3:
+				/* the rdata of the last record is a byte short, after
+				 * the good ones before it */
+				last[11]--;
+				break;
+		}
+	}
+
+	s->answers++;
+	return p - r;
+}
+
+/* parse a latency spec: N, MIN-MAX or exp:MEAN, in usec */
+static int parselatency(fakesrv *s, const char *arg) {
+	char *end;
+
+	if (strncmp(arg, "exp:", 4) == 0) {
+		s->ltype = LAT_EXP;
+		s->lmin = strtod(arg + 4, &end);
+	} else {
+		s->lmin = strtod(arg, &end);
+		s->ltype = LAT_FIXED;
+		if (*end == '-') {
+			s->ltype = LAT_UNIFORM;
+			s->lmax = strtod(end + 1, &end);
+		}
+	}
+	return *end != '\0' || s->lmin < 0;
+}
+
+/* answer a question on TCP connection c, returns -1 when the
+ * connection is closed or broken */
+static int tcp_serve(tcpconn *c) {
+	unsigned char q[2 + MAXMSG];
+	unsigned char r[2 + MAXMSG];
+	size_t len;
+	size_t rlen;
+
+	/* clients send the whole question at once */
+	if (recv(c->fd, q, 2, MSG_WAITALL) != 2)
+		return -1;
+	if ((len = (q[0] << 8) | q[1]) > MAXMSG ||
+			recv(c->fd, q + 2, len, MSG_WAITALL) != (ssize_t)len)
+		return -1;
+	if ((rlen = respond(&srvs[c->srv], q + 2, len, r + 2, 1)) == 0)
+		return 0;
+	put16(r, (uint16_t)rlen);
+	return send(c->fd, r, rlen + 2, MSG_NOSIGNAL) == (ssize_t)rlen + 2 ?
+		0 : -1;
+}
+
+static void usage(void) {
+	printf("DNS Parallel Query fake server v" VERSION " (" GIT_VERSION ")\n");
+	printf("usage: dnspq-fakesrv [-b addr] [-S seed] [options] port [[options] port ...]\n");
+	printf("options apply to all ports following them:\n");
+	printf("  -l usec       latency: N, MIN-MAX (uniform) or exp:MEAN\n");
+	printf("  -T p:usec     add usec to the latency with chance p\n");
+	printf("  -d p          drop questions with chance p\n");
+	printf("  -s p          answer SERVFAIL with chance p\n");
+	printf("  -r p          answer REFUSED with chance p\n");
+	printf("  -n p          answer NXDOMAIN with chance p\n");
+	printf("  -t p          truncate answers with chance p\n");
+	printf("  -m p          send malformed answers with chance p\n");
+	printf("  -a n          A records per answer (default 1)\n");
+	printf("  -A n          AAAA records per answer (default 1)\n");
+	printf("  -c n          CNAMEs before the records (default 0)\n");
+	printf("  -L secs       TTL of the records (default 60)\n");
+}
+
+int main(int argc, char *argv[]) {
+	fakesrv cur;
+	struct sockaddr_in sin;
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	struct pollfd pfds[2 * MAXPORTS + MAXCONNS];
+	unsigned char q[MAXMSG];
+	int one = 1;
+	int fd;
+	pending *pd;
+	const char *bind_addr = "127.0.0.1";
+	const char *opt;
+	const char *arg;
+	char *end;
+	int64_t now;
+	int64_t wait;
+	struct timespec ts;
+	ssize_t len;
+	int rcvbuf = 4 << 20;
+	int i;
+	int j;
+
+	memset(&cur, 0, sizeof(cur));
+	cur.naddrs = 1;
+	cur.naddrs6 = 1;
+	cur.ttl = 60;
+	rng = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') {
+			if (nsrvs == MAXPORTS) {
+				fprintf(stderr, "too many ports\n");
+				return 1;
+			}
+			cur.port = (int)strtol(argv[i], &end, 10);
+			if (*end != '\0' || cur.port <= 0 || cur.port > 65535) {
+				fprintf(stderr, "invalid port: %s\n", argv[i]);
+				return 1;
+			}
+			srvs[nsrvs++] = cur;
+			continue;
+		}
+		opt = argv[i];
+		if (opt[1] == '\0' || opt[2] != '\0' || i + 1 == argc) {
+			usage();
+			return 1;
+		}
+		arg = argv[++i];
+		end = NULL;
+		switch (opt[1]) {
+			case 'b': bind_addr = arg; break;
+			case 'S': rng = strtoull(arg, &end, 10) | 1; break;
+			case 'l':
+				if (parselatency(&cur, arg) != 0) {
+					fprintf(stderr, "invalid latency: %s\n", arg);
+					return 1;
+				}
+				break;
+			case 'T':
+				cur.tailp = strtod(arg, &end);
+				if (*end == ':')
+					cur.tail = strtod(end + 1, &end);
+				break;
+			case 'd': cur.drop = strtod(arg, &end); break;
+			case 's': cur.servfail = strtod(arg, &end); break;
+			case 'r': cur.refused = strtod(arg, &end); break;
+			case 'n': cur.nxdomain = strtod(arg, &end); break;
+			case 't': cur.truncate = strtod(arg, &end); break;
+			case 'm': cur.malformed = strtod(arg, &end); break;
+			case 'a': cur.naddrs = (int)strtol(arg, &end, 10); break;
+			case 'A': cur.naddrs6 = (int)strtol(arg, &end, 10); break;
+			case 'c': cur.cnames = (int)strtol(arg, &end, 10); break;
+			case 'L': cur.ttl = (unsigned int)strtoul(arg, &end, 10); break;
+			default:
+				usage();
+				return 1;
+		}
+		if (end != NULL && *end != '\0') {
+			fprintf(stderr, "invalid value for %s: %s\n", opt, arg);
+			return 1;
+		}
+	}
+	if (nsrvs == 0) {
+		usage();
+		return 1;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	if (inet_pton(AF_INET, bind_addr, &sin.sin_addr) <= 0) {
+		fprintf(stderr, "invalid address: %s\n", bind_addr);
+		return 1;
+	}
+	for (i = 0; i < nsrvs; i++) {
+		sin.sin_port = htons(srvs[i].port);
+		if ((srvs[i].fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) == -1 ||
+				bind(srvs[i].fd, (struct sockaddr *)&sin, sizeof(sin)) != 0)
+		{
+			fprintf(stderr, "cannot bind to %s:%d: %s\n",
+					bind_addr, srvs[i].port, strerror(errno));
+			return 1;
+		}
+		setsockopt(srvs[i].fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		pfds[i].fd = srvs[i].fd;
+		pfds[i].events = POLLIN;
+		if ((srvs[i].lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1 ||
+				setsockopt(srvs[i].lfd, SOL_SOCKET, SO_REUSEADDR,
+					&one, sizeof(one)) != 0 ||
+				bind(srvs[i].lfd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+				listen(srvs[i].lfd, 64) != 0)
+		{
+			fprintf(stderr, "cannot listen on %s:%d: %s\n",
+					bind_addr, srvs[i].port, strerror(errno));
+			return 1;
+		}
+		pfds[nsrvs + i].fd = srvs[i].lfd;
+		pfds[nsrvs + i].events = POLLIN;
+	}
+
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+
+	while (!stop) {
+		/* answers that are due */
+		now = now_usec();
+		while (nheap > 0 && heap[0]->due <= now) {
+			pd = heap_pop();
+			sendto(srvs[pd->srv].fd, pd->buf, pd->len, 0,
+					(struct sockaddr *)&pd->to, sizeof(pd->to));
+			free(pd);
+		}
+
+		/* poll()'s milliseconds would delay every answer */
+		wait = nheap > 0 ? heap[0]->due - now : 1000 * 1000;
+		if (wait > 1000 * 1000)
+			wait = 1000 * 1000;
+		ts.tv_sec = wait / (1000 * 1000);
+		ts.tv_nsec = wait % (1000 * 1000) * 1000;
+		for (i = 0; i < nconns; i++) {
+			pfds[2 * nsrvs + i].fd = conns[i].fd;
+			pfds[2 * nsrvs + i].events = POLLIN;
+		}
+		if (ppoll(pfds, 2 * nsrvs + nconns, &ts, NULL) <= 0)
+			continue;
+
+		/* questions over TCP, the last connection takes the place of
+		 * the one that closed, after having been looked at */
+		for (i = nconns - 1; i >= 0; i--) {
+			if (pfds[2 * nsrvs + i].revents == 0 ||
+					tcp_serve(&conns[i]) == 0)
+				continue;
+			close(conns[i].fd);
+			conns[i] = conns[--nconns];
+		}
+		for (i = 0; i < nsrvs; i++) {
+			if (!(pfds[nsrvs + i].revents & POLLIN) ||
+					(fd = accept(srvs[i].lfd, NULL, NULL)) == -1)
+				continue;
+			if (nconns == MAXCONNS) {
+				close(fd);
+				continue;
+			}
+			conns[nconns].fd = fd;
+			conns[nconns++].srv = i;
+		}
+
+		now = now_usec();
+		for (i = 0; i < nsrvs; i++) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			for (j = 0; j < 64; j++) {
+				fromlen = sizeof(from);
+				if ((len = recvfrom(srvs[i].fd, q, sizeof(q), 0,
+								(struct sockaddr *)&from, &fromlen)) < 0)
+					break;
+				if (nheap == MAXPENDING || (pd = malloc(sizeof(*pd))) == NULL)
+					continue;
+				if ((pd->len = respond(&srvs[i], q, len, pd->buf, 0)) == 0) {
+					free(pd);
+					continue;
+				}
+				pd->srv = i;
+				pd->to = from;
+				pd->due = now + latency(&srvs[i]);
+				if (pd->due <= now) {
+					sendto(srvs[i].fd, pd->buf, pd->len, 0,
+							(struct sockaddr *)&from, fromlen);
+					free(pd);
+				} else {
+					heap_push(pd);
+				}
+			}
+		}
+	}
+
+	printf("%6s %10s %10s %10s %10s %10s %10s %10s\n",
+			"port", "queries", "answers", "drops", "rcodes", "truncated",
+			"malformed", "tcp");
+	for (i = 0; i < nsrvs; i++)
+		printf("%6d %10lu %10lu %10lu %10lu %10lu %10lu %10lu\n",
+				srvs[i].port, srvs[i].queries, srvs[i].answers,
+				srvs[i].drops, srvs[i].rcodes, srvs[i].truncs,
+				srvs[i].malforms, srvs[i].tcp);
+
+	return 0;
+}
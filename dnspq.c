@@ -15,26 +15,43 @@
  *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE  /* sendmmsg, recvmmsg, ppoll */
+
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <poll.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/uio.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/random.h>
 
 #ifdef LOGGING
 #include <syslog.h>
 #endif
 
 #include "dnspq.h"
+#include "health.h"
+#include "probes.h"
+
+PROBE_SEMAPHORE(query__start);
+PROBE_SEMAPHORE(query__send);
+PROBE_SEMAPHORE(query__retry);
+PROBE_SEMAPHORE(query__response);
+PROBE_SEMAPHORE(query__done);
 
 /* http://www.freesoft.org/CIE/RFC/1035/40.htm */
 
@@ -80,46 +97,749 @@
 # define RETRY_TIMEOUT  300 * 1000  /* 300ms, time to wait for answers */
 #endif
 
-static uint16_t cntr = 0;
+/* DNSQ_ADAPTIVE: the first retry goes out after ADAPT_RETRY_FACTOR
+ * times the p99 of the round trip times seen from the servers, with
+ * exponential backoff for the next ones, and the deadline is
+ * ADAPT_DEADLINE_FACTOR times the p99, neither exceeding the static
+ * values above; DNSQ_HEDGE: the fastest server gets the question
+ * first, the others only after the p95 elapsed without answer */
+#ifndef ADAPT_RETRY_FACTOR
+# define ADAPT_RETRY_FACTOR  3
+#endif
+#ifndef ADAPT_MIN_RETRY
+# define ADAPT_MIN_RETRY  1000  /* 1ms */
+#endif
+#ifndef ADAPT_MAX_RETRIES
+# define ADAPT_MAX_RETRIES  3
+#endif
+#ifndef ADAPT_DEADLINE_FACTOR
+# define ADAPT_DEADLINE_FACTOR  50
+#endif
+#ifndef ADAPT_MIN_DEADLINE
+# define ADAPT_MIN_DEADLINE  100 * 1000  /* 100ms */
+#endif
+#ifndef ADAPT_MIN_SAMPLES
+# define ADAPT_MIN_SAMPLES  32  /* fall back to static timing below */
+#endif
+#ifndef ADAPT_REFRESH
+# define ADAPT_REFRESH  64  /* queries between percentile updates */
+#endif
+#ifndef HEDGE_MIN_DELAY
+# define HEDGE_MIN_DELAY  500  /* 0.5ms */
+#endif
 
-#define timediff(X, Y) \
-	(Y.tv_sec > X.tv_sec ? (Y.tv_sec - X.tv_sec) * 1000 * 1000 + ((Y.tv_usec - X.tv_usec)) : Y.tv_usec - X.tv_usec)
+#define QTYPE_A     1
+#define QTYPE_CNAME 5
+#define QTYPE_PTR   12
+#define QTYPE_AAAA  28
+#define QTYPE_OPT   41
 
-int dnsq(
+/* EDNS0 (RFC 6891): the largest UDP payload size dnsq_set_edns() takes,
+ * which is what the receive buffers are sized for */
+#ifndef EDNS_MAX
+# define EDNS_MAX  4096
+#endif
+#define OPT_LEN  11
+
+#ifndef SOCKSETS
+# define SOCKSETS  4  /* sockets kept open per thread */
+#endif
+#ifndef SOCK_MAXUSES
+# define SOCK_MAXUSES  256  /* queries before moving to a new source port */
+#endif
+#ifndef BATCH_INFLIGHT
+# define BATCH_INFLIGHT  64  /* names in flight at once in dnsq_batch() */
+#endif
+#ifndef RECV_BATCH
+# define RECV_BATCH  8  /* responses taken per recvmmsg() */
+#endif
+#ifndef TCPCONNS
+# define TCPCONNS  4  /* TCP connections kept open per context */
+#endif
+#define TCP_MAXMSG  65535
+
+#define QUESTION_MAX  (512 - 12)
+
+/* queries outstanding per dnsq_async, at most 16 IDs per query have to
+ * fit in the ID space */
+#ifndef ASYNC_SLOT_BITS
+# define ASYNC_SLOT_BITS  12
+#endif
+#define ASYNC_MAXQUERIES  (1 << ASYNC_SLOT_BITS)
+#ifndef ASYNC_RCVBUF
+# define ASYNC_RCVBUF  (1 << 20)
+#endif
+/* channels for up to this many queries find them by scanning, rather
+ * than with a 64K table of IDs */
+#ifndef ASYNC_SMALL
+# define ASYNC_SMALL  64
+#endif
+
+/* timing of a query in usec, see timing_derive() */
+typedef struct _dnsq_timing {
+	int64_t retrywait;
+	int64_t deadline;
+	int64_t hedgewait;   /* 0 when not enough is known to hedge */
+} dnsq_timing;
+
+/* Sockets are kept open per context, for each set of servers queried
+ * (which typically is a domaingroup), to avoid socket() and close()
+ * calls on every query.  A set with a single server gets a connected
+ * socket, such that the kernel drops anything not coming from it.  To
+ * keep some source port randomisation, sockets are replaced after
+ * SOCK_MAXUSES queries, allowing the kernel to pick a new port. */
+typedef struct _sockset {
+	int fd;
+	char connected;
+	unsigned int gen;    /* sockgen at creation, 0 for unused */
+	unsigned int uses;
+	unsigned long lastuse;
+	int nservers;
+	struct sockaddr_in servers[MAXSERVERS];
+	/* a query whose unanswered servers are still awaited, see
+	 * sockset_track() */
+	uint16_t trackqid;   /* first ID used */
+	int tracknq;         /* number of IDs used */
+	unsigned int trackmask;  /* servers that didn't answer yet */
+	int64_t tracksend;
+	/* derived from the servers' round trip times, for DNSQ_ADAPTIVE
+	 * and DNSQ_HEDGE */
+	dnsq_timing timing;
+} sockset;
+
+/* The state of a single query, advanced by the query_* functions
+ * below.  These never do I/O themselves, they append the packets to
+ * send to an array of mmsghdrs, and are fed the responses received,
+ * such that a caller can drive any number of queries over its sockets
+ * using a handful of syscalls.  The questions to all servers only
+ * differ in their header, so each packet is a header of its own
+ * followed by the question section shared by all servers. */
+typedef struct _dnsq_query {
+	struct sockaddr_in servers[MAXSERVERS];  /* copied, the caller's
+	                                           * may go away */
+	int nums;
+	health_server *health[MAXSERVERS];
+	char use[MAXSERVERS];        /* servers not skipped due to failures */
+	char seen[MAXSERVERS];       /* servers that responded */
+	char resent[MAXSERVERS];     /* servers asked more than once */
+	int64_t sentat[MAXSERVERS];  /* last asked, -1 for never */
+	int fastest;                 /* server asked first when hedging */
+	char connected;              /* socket only talks to servers[0] */
+	struct dnsq_answer *ans;
+	uint16_t qid0;
+	uint16_t types[2];
+	char done[2];                /* 1 with records, 2 settled empty */
+	int ntypes;
+	int pending;                 /* types not done yet */
+	int sent;                    /* packets sent this round */
+	int recvd;                   /* responses received this round */
+	int retries;
+	char adaptive;
+	char finished;
+	char err;
+	char neg;
+	unsigned int nttl;
+	int64_t begin;
+	int64_t roundend;
+	int64_t hedgeat;             /* 0 when not (anymore) hedging */
+	int64_t deadline;
+	int64_t retrywait;
+	signed char tcp[2];          /* server to ask again over TCP, or -1 */
+	unsigned int tcpasked;       /* bit t * MAXSERVERS + i, see query_tcp() */
+	size_t qlen;                 /* length of the question section */
+	size_t optlen;               /* 0 without EDNS0 */
+	unsigned char question[2][QUESTION_MAX];
+	unsigned char opt[OPT_LEN];  /* the OPT record, in the additional section */
+	unsigned char hdr[2 * MAXSERVERS][12];
+	struct iovec iov[2 * MAXSERVERS][3];
+} dnsq_query;
+
+/* Answers that don't fit in a datagram are asked for again over TCP,
+ * see query_tcp().  Connections are kept open per context and server,
+ * servers close them when idle, so a kept connection that turns out to
+ * be closed is replaced once. */
+typedef struct _tcpconn {
+	int fd;
+	unsigned int gen;    /* sockgen at creation, 0 for unused */
+	unsigned long lastuse;
+	struct sockaddr_in server;
+} tcpconn;
+
+/* Everything a query needs that outlives it.  A context must only be
+ * used by one thread at a time, the library keeps one per thread for
+ * dnsq(), such that lookups share nothing writable between threads. */
+struct _dnsq_ctx {
+	sockset socks[SOCKSETS];
+	unsigned long sockclock;
+	unsigned int gen;    /* sockgen the rng was seeded for */
+	uint32_t rng;        /* xorshift32 state for query IDs */
+	dnsq_query q;
+	struct mmsghdr msgs[2 * MAXSERVERS];
+	struct mmsghdr rmsgs[RECV_BATCH];
+	struct iovec riov[RECV_BATCH];
+	struct sockaddr_in rfrom[RECV_BATCH];
+	unsigned char rbuf[RECV_BATCH][EDNS_MAX];
+	tcpconn tcp[TCPCONNS];
+	unsigned char *tbuf; /* TCP_MAXMSG, allocated on first use */
+};
+
+static unsigned int sockgen = 1;
+static int timing = 0;
+static unsigned int edns = EDNS_SIZE;
+static pthread_key_t ctxkey;
+static pthread_once_t ctxonce = PTHREAD_ONCE_INIT;
+static __thread dnsq_ctx *tctx = NULL;
+
+static inline void sockset_close(sockset *s) {
+	if (s->gen != 0)
+		close(s->fd);
+	s->gen = 0;
+}
+
+static inline void tcpconn_close(tcpconn *c) {
+	if (c->gen != 0)
+		close(c->fd);
+	c->gen = 0;
+}
+
+/* sockets inherited from the parent are shared with it, the child
+ * must not read answers meant for the parent and vice versa, nor
+ * should it pick the same query IDs */
+static void ctx_atfork_child(void) {
+	sockgen++;
+}
+
+static void ctx_init(void) {
+	pthread_key_create(&ctxkey, (void (*)(void *))dnsq_ctx_free);
+	pthread_atfork(NULL, NULL, ctx_atfork_child);
+}
+
+static void ctx_seed(dnsq_ctx *ctx) {
+	struct timeval tv;
+
+	if (getrandom(&ctx->rng, sizeof(ctx->rng), GRND_NONBLOCK) !=
+			sizeof(ctx->rng))
+	{
+		gettimeofday(&tv, NULL);
+		ctx->rng = (uint32_t)tv.tv_usec ^ (uint32_t)getpid() ^
+			(uint32_t)(uintptr_t)ctx;
+	}
+	if (ctx->rng == 0)  /* xorshift gets stuck on 0 */
+		ctx->rng = 1;
+	ctx->gen = sockgen;
+}
+
+/* next random number, xorshift32, good enough to make IDs unguessable
+ * without having to call into the kernel for each query */
+static inline uint32_t ctx_random(dnsq_ctx *ctx) {
+	uint32_t x = ctx->rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return ctx->rng = x;
+}
+
+dnsq_ctx *dnsq_ctx_new(void) {
+	dnsq_ctx *ctx;
+	int i;
+
+	pthread_once(&ctxonce, ctx_init);
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return NULL;
+	ctx_seed(ctx);
+	for (i = 0; i < RECV_BATCH; i++) {
+		ctx->riov[i].iov_base = ctx->rbuf[i];
+		ctx->riov[i].iov_len = sizeof(ctx->rbuf[i]);
+		ctx->rmsgs[i].msg_hdr.msg_iov = &ctx->riov[i];
+		ctx->rmsgs[i].msg_hdr.msg_iovlen = 1;
+		ctx->rmsgs[i].msg_hdr.msg_name = &ctx->rfrom[i];
+	}
+
+	return ctx;
+}
+
+void dnsq_ctx_free(dnsq_ctx *ctx) {
+	int i;
+
+	if (ctx == NULL)
+		return;
+	for (i = 0; i < SOCKSETS; i++)
+		sockset_close(&ctx->socks[i]);
+	for (i = 0; i < TCPCONNS; i++)
+		tcpconn_close(&ctx->tcp[i]);
+	free(ctx->tbuf);
+	free(ctx);
+}
+
+/* the context of the calling thread, freed when the thread exits */
+dnsq_ctx *dnsq_ctx_thread(void) {
+	if (tctx == NULL && (tctx = dnsq_ctx_new()) != NULL)
+		pthread_setspecific(ctxkey, tctx);
+	return tctx;
+}
+
+void dnsq_set_timing(int flags) {
+	timing = flags;
+}
+
+void dnsq_set_edns(unsigned int size) {
+	if (size != 0 && size < 512)
+		size = 512;
+	edns = size > EDNS_MAX ? EDNS_MAX : size;
+}
+
+/* get the socket for ctx to query dnsservers with */
+static sockset *getsock(dnsq_ctx *ctx, struct sockaddr_in* const dnsservers[]) {
+	sockset *s;
+	sockset *match = NULL;
+	sockset *lru = &ctx->socks[0];
+	struct timeval tv;
+	int n;
+	int i;
+	int j;
+
+	for (n = 0; n < MAXSERVERS && dnsservers[n] != NULL; n++)
+		;
+
+	for (i = 0; i < SOCKSETS; i++) {
+		s = &ctx->socks[i];
+		if (s->gen != 0 && s->nservers == n) {
+			for (j = 0; j < n; j++)
+				if (s->servers[j].sin_addr.s_addr !=
+						dnsservers[j]->sin_addr.s_addr ||
+						s->servers[j].sin_port != dnsservers[j]->sin_port)
+					break;
+			if (j == n) {
+				match = s;
+				break;
+			}
+		}
+		if (s->gen == 0 || (lru->gen != 0 && s->lastuse < lru->lastuse))
+			lru = s;
+	}
+
+	if (match == NULL || match->gen != sockgen || match->uses >= SOCK_MAXUSES) {
+		s = match != NULL ? match : lru;
+		sockset_close(s);
+		if ((s->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC,
+						IPPROTO_UDP)) == -1)
+			return NULL;
+		s->gen = sockgen;
+		s->uses = 0;
+		s->trackmask = 0;
+		s->nservers = n;
+		for (j = 0; j < n; j++)
+			s->servers[j] = *dnsservers[j];
+		/* wait at most half of RETRY_TIMOUT */
+		tv.tv_sec = 0;
+		tv.tv_usec = RETRY_TIMEOUT / 2;
+		setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		s->connected = n == 1 && connect(s->fd,
+				(struct sockaddr *)&s->servers[0],
+				sizeof(s->servers[0])) == 0;
+	} else {
+		s = match;
+	}
+
+	s->uses++;
+	s->lastuse = ++ctx->sockclock;
+	return s;
+}
+
+/* returns the offset just past the (possibly compressed) name starting
+ * at off, or 0 when the name runs beyond len */
+static size_t skipname(const unsigned char *buf, size_t len, size_t off) {
+	while (off < len) {
+		if ((buf[off] & 0xC0) == 0xC0)  /* compression pointer */
+			return off + 2 <= len ? off + 2 : 0;
+		if (buf[off] & 0xC0)  /* extended label types */
+			return 0;
+		if (buf[off] == 0)
+			return off + 1;
+		off += 1 + buf[off];
+	}
+	return 0;
+}
+
+/* negative caching TTL as per RFC 2308 section 5: the minimum of the
+ * TTL of the SOA record in the authority section and its MINIMUM
+ * field, or 0 if there is no SOA */
+static unsigned int negttl(const unsigned char *buf, size_t len, size_t qlen)
+{
+	size_t off = qlen;  /* header and question are what we sent */
+	int ancount = ANCOUNT(buf);
+	int n = ancount + NSCOUNT(buf);
+	unsigned int ttl;
+	unsigned int min;
+	uint16_t rdlen;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if ((off = skipname(buf, len, off)) == 0 || off + 10 > len)
+			return 0;
+		ttl = ntohl(*(uint32_t *)(buf + off + 4));
+		rdlen = ID(buf + off + 8);
+		if (off + 10 + rdlen > len)
+			return 0;
+		if (i >= ancount && ID(buf + off) == 6 /* SOA */ && rdlen >= 22) {
+			/* MINIMUM is the last field of the RDATA */
+			min = ntohl(*(uint32_t *)(buf + off + 10 + rdlen - 4));
+			return ttl < min ? ttl : min;
+		}
+		off += 10 + rdlen;
+	}
+
+	return 0;
+}
+
+/* compare the question section in the response to the one we sent,
+ * DNS names are case insensitive and servers may have changed the
+ * case, QTYPE and QCLASS must be the same */
+static int samequestion(
+		const unsigned char *buf,
+		const unsigned char *question,
+		size_t qlen)
+{
+	size_t off;
+
+	for (off = 0; off < qlen - 4; off++)
+		if (buf[off] != question[off] &&
+				tolower(buf[off]) != tolower(question[off]))
+			return 0;
+	return memcmp(buf + off, question + off, 4) == 0;
+}
+
+/* expand the (possibly compressed) name at off into name, dotted,
+ * without the trailing dot, returns the offset just past it, or 0 when
+ * it is malformed or doesn't fit in DNSQ_MAXNAME */
+static size_t getname(const unsigned char *buf, size_t len, size_t off, char *name) {
+	size_t end = 0;
+	size_t n = 0;
+	int hops = 0;
+
+	while (off < len) {
+		if ((buf[off] & 0xC0) == 0xC0) {
+			/* compression pointer, with a limit against loops */
+			if (off + 2 > len || ++hops > 32)
+				return 0;
+			if (end == 0)
+				end = off + 2;
+			off = (ID(buf + off)) & 0x3FFF;
+			continue;
+		}
+		if (buf[off] & 0xC0)  /* extended label types */
+			return 0;
+		if (buf[off] == 0) {
+			name[n] = '\0';
+			return end != 0 ? end : off + 1;
+		}
+		if (off + 1 + buf[off] > len ||
+				n + (n != 0) + buf[off] >= DNSQ_MAXNAME)
+			return 0;
+		if (n != 0)
+			name[n++] = '.';
+		memcpy(name + n, buf + off + 1, buf[off]);
+		n += buf[off];
+		off += 1 + buf[off];
+	}
+	return 0;
+}
+
+/* whether the owner of the record at off is name, which is the name
+ * asked for when chained is 0 */
+static int isowner(
+		const unsigned char *buf,
+		size_t len,
+		size_t off,
+		const char *name,
+		char chained)
+{
+	char owner[DNSQ_MAXNAME];
+
+	/* nearly all answers point at the question for the owner */
+	if (!chained && buf[off] == 0xC0 && buf[off + 1] == 12)
+		return 1;
+	return getname(buf, len, off, owner) != 0 &&
+		strcasecmp(owner, name) == 0;
+}
+
+/* follow the CNAME chain in the answer section of the response in buf,
+ * qlen being the length of header and question as we sent them, from
+ * the name asked for, chain[0], filling in the names it leads to, and
+ * cttl with the lowest TTL of its records; returns the number of links,
+ * or -1 when the answer section is malformed or the chain too long */
+static int followchain(
+		const unsigned char *buf,
+		size_t len,
+		size_t qlen,
+		char chain[][DNSQ_MAXNAME],
+		unsigned int *cttl)
+{
+	size_t off;
+	size_t pos = 0;
+	int n = ANCOUNT(buf);
+	unsigned int rttl;
+	uint16_t rdlen;
+	int links;
+	int i;
+
+	if (getname(buf, len, 12, chain[0]) == 0)
+		return -1;
+
+	/* the records of the chain may come in any order, look for the
+	 * next link from the start each time, chains are short */
+	*cttl = 0;
+	for (links = 0; links <= DNSQ_MAXCNAMES; links++) {
+		off = qlen;
+		for (i = 0; i < n; i++) {
+			if ((pos = skipname(buf, len, off)) == 0 || pos + 10 > len)
+				return -1;
+			rdlen = ID(buf + pos + 8);
+			if (pos + 10 + rdlen > len)
+				return -1;
+			if (ID(buf + pos) == QTYPE_CNAME &&
+					ID(buf + pos + 2) == 1 /* IN */ &&
+					isowner(buf, len, off, chain[links], links != 0))
+				break;
+			off = pos + 10 + rdlen;
+		}
+		if (i == n)
+			return links;
+		if (links == DNSQ_MAXCNAMES ||
+				getname(buf, len, pos + 10, chain[links + 1]) == 0)
+			return -1;  /* too long, a loop, or garbage */
+		rttl = ntohl(*(uint32_t *)(buf + pos + 4));
+		if (rttl > INT32_MAX)  /* RFC 2181 section 8 */
+			rttl = 0;
+		if (links == 0 || rttl < *cttl)
+			*cttl = rttl;
+	}
+	return -1;
+}
+
+/* collect the records of type qtype (A or AAAA) from the answer
+ * section of the response in buf, qlen being the length of header and
+ * question as we sent them, following the CNAME chain from the name
+ * asked for, ttl is set to the lowest TTL seen in the chain and the
+ * records; returns 12 when the chain leads to a name without records
+ * of the type; ans and ttl are only touched when the answer is good */
+static char parseanswer(
+		const unsigned char *buf,
+		size_t len,
+		size_t qlen,
+		uint16_t qtype,
+		struct dnsq_answer *ans,
+		unsigned int *ttl)
+{
+	size_t off;
+	int n = ANCOUNT(buf);
+	int naddrs = 0;
+	size_t alen = qtype == QTYPE_A ? 4 : 16;
+	char chain[DNSQ_MAXCNAMES + 1][DNSQ_MAXNAME];
+	unsigned int rttl;
+	unsigned int cttl;
+	unsigned int attl = 0;
+	uint16_t rdlen;
+	size_t clen;
+	size_t pos;
+	int links;
+	int i;
+
+	if ((links = followchain(buf, len, qlen, chain, &cttl)) < 0)
+		return 14;
+
+	off = qlen;
+	for (i = 0; i < n; i++) {
+		if ((pos = skipname(buf, len, off)) == 0)
+			return 14;
+		rttl = ntohl(*(uint32_t *)(buf + pos + 4));
+		rdlen = ID(buf + pos + 8);
+		if (ID(buf + pos) == qtype && ID(buf + pos + 2) == 1 /* IN */ &&
+				isowner(buf, len, off, chain[links], links != 0))
+		{
+			if (rdlen != alen)
+				return 15;
+			if (rttl > INT32_MAX)
+				rttl = 0;
+			if (naddrs == 0 || rttl < attl)
+				attl = rttl;
+			/* the slots of this type are unused until we succeed */
+			if (qtype == QTYPE_A && naddrs < DNSQ_MAXADDRS)
+				memcpy(&ans->addrs[naddrs++], buf + pos + 10, 4);
+			else if (qtype == QTYPE_AAAA && naddrs < DNSQ_MAXADDRS6)
+				memcpy(&ans->addrs6[naddrs++], buf + pos + 10, 16);
+		}
+		off = pos + 10 + rdlen;
+	}
+
+	if (naddrs == 0)
+		return links != 0 ? 12 : 16;
+	if (qtype == QTYPE_A)
+		ans->naddrs = naddrs;
+	else
+		ans->naddrs6 = naddrs;
+	*ttl = attl;
+	if (links != 0) {
+		if (cttl < *ttl)
+			*ttl = cttl;
+		/* both types lead to the same name, the first one tells */
+		if (ans->canon[0] == '\0') {
+			clen = strlen(chain[links]) + 1;
+			memcpy(ans->canon, chain[links], clen);
+			for (i = 1; i < links &&
+					clen + strlen(chain[i]) + 2 <= DNSQ_MAXNAME; i++)
+			{
+				memcpy(ans->canon + clen, chain[i], strlen(chain[i]) + 1);
+				clen += strlen(chain[i]) + 1;
+			}
+			ans->canon[clen] = '\0';
+		}
+	}
+	return 0;
+}
+
+/* collect the names of the PTR records from the answer section of the
+ * response in buf into ans->canon, like parseanswer(), CNAMEs are
+ * followed as for classless delegation (RFC 2317); ans and ttl are only
+ * touched when the answer is good */
+static char parseptr(
+		const unsigned char *buf,
+		size_t len,
+		size_t qlen,
+		struct dnsq_answer *ans,
+		unsigned int *ttl)
+{
+	size_t off;
+	int n = ANCOUNT(buf);
+	char chain[DNSQ_MAXCNAMES + 1][DNSQ_MAXNAME];
+	char name[DNSQ_MAXNAME];
+	char canon[DNSQ_MAXNAME];
+	unsigned int pttl = 0;
+	unsigned int rttl;
+	unsigned int cttl;
+	uint16_t rdlen;
+	size_t clen = 0;
+	size_t nlen;
+	size_t pos;
+	int nptrs = 0;
+	int links;
+	int i;
+
+	if ((links = followchain(buf, len, qlen, chain, &cttl)) < 0)
+		return 14;
+
+	off = qlen;
+	for (i = 0; i < n; i++) {
+		if ((pos = skipname(buf, len, off)) == 0)
+			return 14;
+		rttl = ntohl(*(uint32_t *)(buf + pos + 4));
+		rdlen = ID(buf + pos + 8);
+		if (ID(buf + pos) == QTYPE_PTR && ID(buf + pos + 2) == 1 /* IN */ &&
+				isowner(buf, len, off, chain[links], links != 0))
+		{
+			if (getname(buf, len, pos + 10, name) == 0)
+				return 15;
+			if (rttl > INT32_MAX)  /* RFC 2181 section 8 */
+				rttl = 0;
+			if (nptrs++ == 0 || rttl < pttl)
+				pttl = rttl;
+			/* as many as fit, the first always does */
+			if (clen + (nlen = strlen(name) + 1) < DNSQ_MAXNAME) {
+				memcpy(canon + clen, name, nlen);
+				clen += nlen;
+			}
+		}
+		off = pos + 10 + rdlen;
+	}
+
+	if (nptrs == 0)
+		return links != 0 ? 12 : 16;
+	canon[clen] = '\0';
+	memcpy(ans->canon, canon, clen + 1);
+	*ttl = links != 0 && cttl < pttl ? cttl : pttl;
+
+	return 0;
+}
+
+/* monotonic time in usec, immune to the wall clock being stepped */
+static inline int64_t now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
+/* derive the timing for the set of servers with health from the
+ * percentiles of their round trip times */
+static void timing_derive(
+		dnsq_timing *tm,
+		health_server *const health[],
+		int n)
+{
+	static const unsigned int permille[2] = { 950, 990 };
+	unsigned int pct[2];
+
+	tm->retrywait = RETRY_TIMEOUT;
+	tm->deadline = MAX_TIMEOUT;
+	tm->hedgewait = 0;
+	if (health_percentiles(health, n, permille, pct, 2) < ADAPT_MIN_SAMPLES)
+		return;
+
+	if ((int64_t)pct[1] * ADAPT_RETRY_FACTOR < tm->retrywait)
+		tm->retrywait = (int64_t)pct[1] * ADAPT_RETRY_FACTOR;
+	if (tm->retrywait < ADAPT_MIN_RETRY)
+		tm->retrywait = ADAPT_MIN_RETRY;
+	if ((int64_t)pct[1] * ADAPT_DEADLINE_FACTOR < tm->deadline)
+		tm->deadline = (int64_t)pct[1] * ADAPT_DEADLINE_FACTOR;
+	if (tm->deadline < ADAPT_MIN_DEADLINE)
+		tm->deadline = ADAPT_MIN_DEADLINE;
+	tm->hedgewait = pct[0] < HEDGE_MIN_DELAY ? HEDGE_MIN_DELAY : pct[0];
+	if (tm->hedgewait > tm->retrywait)
+		tm->hedgewait = tm->retrywait;
+}
+
+/* set up q to ask dnsservers for the qtypes records of a, using IDs
+ * qid0 up to qid0 + 2 * MAXSERVERS; returns 0, or 1 when a doesn't make
+ * a valid question */
+static int query_init(
+		dnsq_query *q,
 		struct sockaddr_in* const dnsservers[],
 		const char *a,
-		struct in_addr *ret,
-		unsigned int *ttl,
-		char *serverid)
+		int qtypes,
+		uint16_t qid0,
+		struct dnsq_answer *ans)
 {
-	unsigned char dnspkg[512];
-	unsigned char *p = dnspkg;
-	char *ap;
+	unsigned char *p = q->question[0];
+	/* leave room for the null label, QTYPE and QCLASS */
+	unsigned char *end = p + QUESTION_MAX - 5;
+	const char *name = a;
+	const char *ap;
 	size_t len;
-	int saddr_buf_len;
-	int fd;
-	struct timeval tv;
-	struct timeval begin, end;
+	int nuse = 0;
 	int i;
-	int nums = 0;
-	uint16_t qid;
-	char retries = MAX_RETRIES;
-	suseconds_t maxtime = MAX_TIMEOUT;
-	suseconds_t waittime = 0;
-	char err = 0;
 
-	if (++cntr == 0)  /* next sequence number, start at 1 (detect errs)  */
-		cntr++;
-	if (USHRT_MAX - MAXSERVERS < cntr)  /* avoid having to deal with overflow */
-		cntr = 1;
+	ans->ttl = 0;
+	ans->serverid = 0;
+	ans->naddrs = 0;
+	ans->naddrs6 = 0;
+	ans->canon[0] = '\0';
+	q->ans = ans;
 
-	/* header */
-	p += 12;
+	q->ntypes = 0;
+	if (qtypes == DNSQ_PTR)
+		q->types[q->ntypes++] = QTYPE_PTR;
+	if (qtypes & DNSQ_A)
+		q->types[q->ntypes++] = QTYPE_A;
+	if (qtypes & DNSQ_AAAA)
+		q->types[q->ntypes++] = QTYPE_AAAA;
+	if (q->ntypes == 0)
+		return 1;
 
 	/* question section */
 	while ((ap = strchr(a, '.')) != NULL) {
 		len = ap - a;
-		if (len > 255)  /* proto spec */
+		if (len > 63 || p + 1 + len > end)  /* proto spec */
 			return 1;
 		*p++ = (unsigned char)len;
 		memcpy(p, a, len);
@@ -127,186 +847,1293 @@ int dnsq(
 		a = ap + 1;
 	}
 	len = strlen(a);
-	*p++ = len;
-	memcpy(p, a, len + 1);  /* always fits: 512 - 12 > 255 */
+	if (len > 63 || p + 1 + len > end)
+		return 1;
+	*p++ = (unsigned char)len;
+	memcpy(p, a, len + 1);
 	p += len + 1;  /* including the trailing null label */
-	SET_ID(p, 1 /* QTYPE == A */);
+	SET_ID(p, q->types[0] /* QTYPE */);
 	p += 2;
 	SET_ID(p, 1 /* QCLASS == IN */);
 	p += 2;
+	q->qlen = p - q->question[0];
+	if (q->ntypes > 1) {
+		memcpy(q->question[1], q->question[0], q->qlen);
+		SET_ID(q->question[1] + q->qlen - 4, q->types[1]);
+	}
 
-	/* answer sections not necessary */
-	len = p - dnspkg;
+	/* OPT pseudo record: root owner, our payload size as CLASS, no
+	 * extended RCODE, version 0, no flags, no options */
+	q->optlen = 0;
+	if (edns != 0) {
+		memset(q->opt, 0, OPT_LEN);
+		SET_ID(q->opt + 1, QTYPE_OPT);
+		SET_ID(q->opt + 3, (uint16_t)edns);
+		q->optlen = OPT_LEN;
+	}
 
-	tv.tv_sec = 0;
-	gettimeofday(&begin, NULL);
-	end.tv_sec = begin.tv_sec;
-	end.tv_usec = begin.tv_usec;
-	do {
-		p = dnspkg;
-		memset(p, 0, 4); /* need zeros; macros below do or-ing due to bits */
-		/* SET_ID is done per server */
-		SET_QR(p, 0 /* query */);
-		SET_OPCODE(p, 0 /* standard query */);
-		SET_AA(p, 0);
-		SET_TC(p, 0);
-		SET_RD(p, 0);
-		SET_RA(p, 0);
-		SET_Z(p, 0);
-		SET_RCODE(p, 0);
-		SET_QDCOUNT(p, 1 /* one question */);
-		SET_ANCOUNT(p, 0);
-		SET_NSCOUNT(p, 0);
-		SET_ARCOUNT(p, 0);
-
-		if ((fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
-			return 1;
+	/* servers with an open circuit are skipped, unless all are */
+	for (i = 0; i < MAXSERVERS && dnsservers[i] != NULL; i++) {
+		q->servers[i] = *dnsservers[i];
+		q->health[i] = health_get(dnsservers[i]);
+		if ((q->use[i] = health_usable(q->health[i])) != 0)
+			nuse++;
+		q->seen[i] = 0;
+		q->resent[i] = 0;
+		q->sentat[i] = -1;
+	}
+	q->nums = i;
+	if (nuse == 0)
+		memset(q->use, 1, sizeof(q->use));
 
-		/* wait at most half of RETRY_TIMOUT */
-		tv.tv_usec = maxtime - timediff(begin, end);
-		if (tv.tv_usec > RETRY_TIMEOUT / 2)
-			tv.tv_usec = RETRY_TIMEOUT / 2;
-		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-		for (i = 0; i < MAXSERVERS && dnsservers[i] != NULL; i++) {
-			SET_ID(p, cntr + i);
-			if (sendto(fd, dnspkg, len, 0,
-						(struct sockaddr *)dnsservers[i],
-						sizeof(*dnsservers[i])) != len)
-				return 2;  /* TODO: fail only when all fail? */
+	q->qid0 = qid0;
+	q->done[0] = q->done[1] = 0;
+	q->tcp[0] = q->tcp[1] = -1;
+	q->tcpasked = 0;
+	q->pending = q->ntypes;
+	q->fastest = -1;
+	q->connected = 0;
+	q->retries = MAX_RETRIES;
+	q->adaptive = 0;
+	q->finished = 0;
+	q->err = 0;
+	q->neg = 0;
+	q->nttl = 0;
+	q->hedgeat = 0;
+	q->deadline = MAX_TIMEOUT;
+	q->retrywait = RETRY_TIMEOUT;
+
+	PROBE4(query__start, q, name, qtypes, q->nums);
+	return q->nums == 0;
+}
+
+/* apply the timing mode flags, using tm derived for the servers of q */
+static void query_timing(dnsq_query *q, int flags, const dnsq_timing *tm) {
+	unsigned int rtt;
+	int nuse = 0;
+	int i;
+
+	if (flags & DNSQ_ADAPTIVE) {
+		q->adaptive = 1;
+		q->retries = ADAPT_MAX_RETRIES;
+		q->deadline = tm->deadline;
+		q->retrywait = tm->retrywait;
+	}
+
+	/* only the fastest server gets the first round right away,
+	 * provided we know how fast they all are */
+	if (!(flags & DNSQ_HEDGE) || tm->hedgewait == 0)
+		return;
+	for (i = 0; i < q->nums; i++) {
+		if (!q->use[i])
+			continue;
+		nuse++;
+		if ((rtt = health_rtt(q->health[i])) == 0) {
+			q->fastest = -1;
+			return;
 		}
+		if (q->fastest == -1 || rtt < health_rtt(q->health[q->fastest]))
+			q->fastest = i;
+	}
+	if (nuse > 1)
+		q->hedgeat = tm->hedgewait;
+	else
+		q->fastest = -1;
+}
 
-		/* this can be off by RETRY_TIMOUT / 2 * i, but saves us a
-		 * gettimeofday() call */
-		waittime = timediff(begin, end) + RETRY_TIMEOUT;
-		if (waittime > maxtime)
-			waittime = maxtime;
-		nums = i;
-		i = 0;
-		do {
-			gettimeofday(&end, NULL);
-			tv.tv_usec = waittime - timediff(begin, end);
-			if (tv.tv_usec <= 0)
-				break;
-			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-			saddr_buf_len = recvfrom(fd, dnspkg, sizeof(dnspkg),
-					0, NULL, NULL);
+/* append the packets asking the types not done yet to the servers in
+ * mask to msgs, the question for type t to server i gets ID
+ * qid0 + t * nums + i; returns the number of packets */
+static int query_send(
+		dnsq_query *q,
+		const char mask[],
+		int64_t now,
+		struct mmsghdr *msgs)
+{
+	struct msghdr *m;
+	int n = 0;
+	int t;
+	int i;
+	int k;
 
-			if (saddr_buf_len < 0) {
-				err = 1;
-				if (errno == EINTR)
-					continue;
-				break;  /* read timeout, retry sending */
-			} else if (saddr_buf_len < 12) { /* must have header */
-				err = 4;
+	for (t = 0; t < q->ntypes; t++) {
+		if (q->done[t])
+			continue;
+		for (i = 0; i < q->nums; i++) {
+			if (!mask[i])
 				continue;
+			k = t * q->nums + i;
+			/* a standard query, no recursion desired */
+			memset(q->hdr[k], 0, 12);
+			SET_ID(q->hdr[k], (uint16_t)(q->qid0 + k));
+			SET_QDCOUNT(q->hdr[k], 1 /* one question */);
+			SET_ARCOUNT(q->hdr[k], q->optlen != 0);
+			q->iov[k][0].iov_base = q->hdr[k];
+			q->iov[k][0].iov_len = 12;
+			q->iov[k][1].iov_base = q->question[t];
+			q->iov[k][1].iov_len = q->qlen;
+			q->iov[k][2].iov_base = q->opt;
+			q->iov[k][2].iov_len = q->optlen;
+			m = &msgs[n++].msg_hdr;
+			memset(m, 0, sizeof(*m));
+			m->msg_iov = q->iov[k];
+			m->msg_iovlen = q->optlen != 0 ? 3 : 2;
+			if (!q->connected) {
+				m->msg_name = &q->servers[i];
+				m->msg_namelen = sizeof(q->servers[i]);
 			}
+			health_sent(q->health[i]);
+		}
+	}
+	for (i = 0; i < q->nums; i++) {
+		if (!mask[i])
+			continue;
+		if ((q->resent[i] = q->sentat[i] != -1))
+			health_retry(q->health[i]);
+		q->sentat[i] = now;
+	}
 
-			p = dnspkg;
-			qid = ID(p);
-			if (qid < cntr || qid > cntr + nums) {
-				err = 7; /* message not matching our request id */
-				continue;
-			}
-			/* ID matches, assume from a server we sent to */
-			i++;
-			*serverid = qid - cntr;
-			if (QR(p) != 1) {
-				err = 8; /* not a response */
+	PROBE2(query__send, q, n);
+	return n;
+}
+
+/* start a new round of questions, to the fastest server only when
+ * hedging, else to all of them */
+static int query_round(dnsq_query *q, int64_t now, struct mmsghdr *msgs) {
+	char mask[MAXSERVERS];
+
+	q->recvd = 0;
+	q->roundend = now + q->retrywait;
+	if (q->roundend > q->deadline)
+		q->roundend = q->deadline;
+	if (q->adaptive)
+		q->retrywait *= 2;
+	if (q->hedgeat != 0) {
+		memset(mask, 0, sizeof(mask));
+		mask[q->fastest] = 1;
+		return q->sent = query_send(q, mask, now, msgs);
+	}
+	return q->sent = query_send(q, q->use, now, msgs);
+}
+
+/* start q at now, over a socket that is connected to the only server
+ * or not; returns the number of packets appended to msgs */
+static int query_start(
+		dnsq_query *q,
+		char connected,
+		int64_t now,
+		struct mmsghdr *msgs)
+{
+	q->connected = connected;
+	q->begin = now;
+	q->deadline += now;
+	if (q->hedgeat != 0)
+		q->hedgeat += now;
+	return query_round(q, now, msgs);
+}
+
+/* the time at which q needs query_tick() */
+static inline int64_t query_next(const dnsq_query *q) {
+	return q->hedgeat != 0 && q->hedgeat < q->roundend ?
+		q->hedgeat : q->roundend;
+}
+
+/* advance q to now: ask the other servers when the fastest didn't
+ * answer in time, or start the next round when this one is over;
+ * returns the number of packets appended to msgs, or -1 when q is
+ * finished */
+static int query_tick(dnsq_query *q, int64_t now, struct mmsghdr *msgs) {
+	char mask[MAXSERVERS];
+	int n;
+	int i;
+
+	if (q->finished)
+		return -1;
+	if (q->hedgeat != 0 && now >= q->hedgeat) {
+		for (i = 0; i < q->nums; i++)
+			mask[i] = q->use[i] && i != q->fastest;
+		q->hedgeat = 0;
+		n = query_send(q, mask, now, msgs);
+		q->sent += n;
+		return n;
+	}
+	if (now < q->roundend)
+		return 0;
+	if (q->neg == 13 || q->retries-- <= 0 || now >= q->deadline) {
+		q->finished = 1;
+		return -1;
+	}
+	PROBE2(query__retry, q, q->retries);
+	return query_round(q, now, msgs);
+}
+
+/* feed the response in buf (at least a header) received from from to
+ * q, returns -1 when it isn't meant for q, 1 when q is finished, 0
+ * otherwise */
+static int query_input(
+		dnsq_query *q,
+		const unsigned char *buf,
+		size_t len,
+		const struct sockaddr_in *from,
+		int64_t now)
+{
+	const unsigned char *p = buf;
+	uint16_t qid = (uint16_t)(ID(p) - q->qid0);
+	size_t hlen = 12 + q->qlen;  /* header and question, as we sent */
+	unsigned int ttl = 0;
+	int t;
+
+	if (qid >= q->nums * q->ntypes) {
+		q->err = 7; /* message not matching our request id */
+		return -1;
+	}
+	t = qid / q->nums;
+	qid %= q->nums;
+	if (!q->connected &&
+			(from->sin_addr.s_addr != q->servers[qid].sin_addr.s_addr ||
+			 from->sin_port != q->servers[qid].sin_port))
+	{
+		q->err = 7; /* not from the server we sent this ID to */
+		return -1;
+	}
+	/* ID matches, from the server we sent to */
+	PROBE4(query__response, q, qid, RCODE(p),
+			(unsigned int)(now - q->sentat[qid]));
+	q->recvd++;
+	q->seen[qid] = 1;
+	if (q->finished || q->done[t])
+		return q->finished;  /* already have the answer for this type */
+
+	if (QR(p) != 1) {
+		q->err = 8; /* not a response */
+		goto bad;
+	}
+	if (OPCODE(p) != 0) {
+		q->err = 9; /* not a standard query */
+		goto bad;
+	}
+	switch (RCODE(p)) {
+		case 0: /* no error */
+			break;
+		case 1: /* format error */
+		case 2: /* server failure */
+		case 4: /* not implemented */
+		case 5: /* refused */
+			/* haproxy returns server failure for empty pools */
+			q->err = 10;
+			health_rcodefail(q->health[qid]);
+			goto out;
+		case 3: /* NXDOMAIN, handled below */
+			break;
+		default: /* reserved for future use */
+			q->err = 11;
+			health_rcodefail(q->health[qid]);
+			goto out;
+	}
+	if (QDCOUNT(p) != 1 || len < hlen ||
+			!samequestion(p + 12, q->question[t], q->qlen))
+	{
+		q->err = 14; /* not an answer to our question */
+		goto bad;
+	}
+	/* the round trip time is ambiguous for questions sent more than
+	 * once, so don't use it (Karn's algorithm) */
+	health_answer(q->health[qid], q->resent[qid] ? 0 :
+			(unsigned int)(now - q->sentat[qid]));
+	if (TC(p)) {
+		/* the answer didn't fit, the driver may ask again over TCP */
+		q->err = 17;
+		if (q->tcp[t] == -1 &&
+				!(q->tcpasked & (1U << (t * MAXSERVERS + qid))))
+			q->tcp[t] = (signed char)qid;
+		goto out;
+	}
+	if (RCODE(p) == 3) {
+		q->err = 13;
+		if (q->neg != 13)
+			q->nttl = negttl(p, len, hlen);
+		q->neg = 13;
+		goto out;
+	}
+	/* no records at all, or a CNAME chain leading to a name without
+	 * records of the type */
+	if (ANCOUNT(p) >= 1)
+		q->err = q->types[t] == QTYPE_PTR ?
+			parseptr(p, len, hlen, q->ans, &ttl) :
+			parseanswer(p, len, hlen, q->types[t], q->ans, &ttl);
+	if (ANCOUNT(p) < 1 || q->err == 12) {
+		q->err = 12;
+		if (q->neg == 0) {
+			q->nttl = negttl(p, len, hlen);
+			q->neg = 12;
+		}
+		/* when asking for both types, the absence of one is a valid
+		 * answer */
+		if (q->ntypes > 1) {
+			q->done[t] = 2;
+			q->pending--;
+		}
+		goto out;
+	}
+
+	if (q->err != 0) {
+		if (q->err != 16)
+			goto bad;
+		goto out;
+	}
+
+	if (q->done[0] != 1 && q->done[1] != 1) {
+		health_win(q->health[qid]);
+		q->ans->serverid = (char)qid;
+		q->ans->ttl = ttl;
+	} else if (ttl < q->ans->ttl) {
+		q->ans->ttl = ttl;
+	}
+	q->done[t] = 1;
+	q->pending--;
+	goto out;
+
+bad:
+	health_parseerr(q->health[qid]);
+out:
+	if (q->pending == 0) {
+		q->finished = 1;
+		return 1;
+	}
+	/* everyone asked responded, but not well, don't wait any longer */
+	if (q->recvd >= q->sent) {
+		if (q->hedgeat != 0)
+			q->hedgeat = now;
+		else
+			q->roundend = now;
+	}
+	return 0;
+}
+
+/* the result of the finished q, 0 when there are records for at least
+ * one type, else the negative answer, or the last error seen */
+static int query_finish(dnsq_query *q) {
+	int err;
+
+	if (q->done[0] == 1 || q->done[1] == 1) {
+		err = 0;
+	} else if (q->neg != 0) {
+		q->ans->ttl = q->nttl;
+		err = q->neg;
+	} else {
+		err = q->err != 0 ? q->err : 1;
+	}
+	if (PROBE_ENABLED(query__done))
+		PROBE3(query__done, q, err, (unsigned int)(now_usec() - q->begin));
+	return err;
+}
+
+/* send all n packets in msgs, returns 0, or -1 on error */
+static int sendpackets(int fd, struct mmsghdr *msgs, int n) {
+	int r;
+
+	while (n > 0) {
+		if ((r = sendmmsg(fd, msgs, n, 0)) < 0) {
+			if (errno == EINTR)
 				continue;
-			}
-			if (OPCODE(p) != 0) {
-				err = 9; /* not a standard query */
+			return -1;
+		}
+		msgs += r;
+		n -= r;
+	}
+	return 0;
+}
+
+/* a late answer to the query tracked on sock still says the server is
+ * alive, e.g. a probe losing the race, q is the current query, asking
+ * the same set of servers */
+static void sockset_late(
+		sockset *sock,
+		dnsq_query *q,
+		const unsigned char *p,
+		const struct sockaddr_in *from)
+{
+	uint16_t id = (uint16_t)(ID(p) - sock->trackqid);
+	int i = id % sock->nservers;
+
+	if (id >= sock->tracknq || !(sock->trackmask & (1U << i)) ||
+			QR(p) != 1 ||
+			(!sock->connected &&
+			 (from->sin_addr.s_addr != sock->servers[i].sin_addr.s_addr ||
+			  from->sin_port != sock->servers[i].sin_port)))
+		return;
+	sock->trackmask &= ~(1U << i);
+	if (RCODE(p) == 0 || RCODE(p) == 3)
+		health_answer(q->health[i], 0);
+	else
+		health_rcodefail(q->health[i]);
+}
+
+/* receive all responses queued on sock, and feed them to q, returns -1
+ * on socket errors */
+static int sockset_recv(dnsq_ctx *ctx, sockset *sock, dnsq_query *q, int64_t now) {
+	int r;
+	int i;
+
+	do {
+		for (i = 0; i < RECV_BATCH; i++)
+			ctx->rmsgs[i].msg_hdr.msg_namelen = sizeof(ctx->rfrom[i]);
+		if ((r = recvmmsg(sock->fd, ctx->rmsgs, RECV_BATCH,
+						MSG_DONTWAIT, NULL)) < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return 0;
+			q->err = 1;
+			return -1;  /* e.g. ECONNREFUSED */
+		}
+		for (i = 0; i < r; i++) {
+			if (ctx->rmsgs[i].msg_len < 12) { /* must have header */
+				q->err = 4;
 				continue;
 			}
-			switch (RCODE(p)) {
-				case 0: /* no error */
+			if (query_input(q, ctx->rbuf[i], ctx->rmsgs[i].msg_len,
+						&ctx->rfrom[i], now) == -1)
+				sockset_late(sock, q, ctx->rbuf[i], &ctx->rfrom[i]);
+		}
+	} while (r == RECV_BATCH);
+
+	return 0;
+}
+
+/* We stop listening as soon as we have an answer, so a server that is
+ * down isn't noticed by the query itself.  Instead, a query with
+ * unanswered servers is tracked on the socket, answers arriving during
+ * later queries are credited, and whoever didn't answer within
+ * RETRY_TIMEOUT is considered to have timed out. */
+static void sockset_track(sockset *sock, dnsq_query *q, int64_t now) {
+	int i;
+
+	/* nothing came back before the adaptive deadline, maybe the
+	 * servers got slower, use the static timing until the next
+	 * refresh, such that their answers are seen again */
+	for (i = 0; i < q->nums && !q->seen[i]; i++)
+		;
+	if (i == q->nums && q->adaptive) {
+		sock->timing.retrywait = RETRY_TIMEOUT;
+		sock->timing.deadline = MAX_TIMEOUT;
+	}
+
+	if (sock->trackmask != 0 && now - sock->tracksend >= RETRY_TIMEOUT) {
+		for (i = 0; i < q->nums; i++)
+			if (sock->trackmask & (1U << i))
+				health_timeout(q->health[i]);
+		sock->trackmask = 0;
+	}
+	if (sock->trackmask == 0) {
+		for (i = 0; i < q->nums; i++)
+			if (q->use[i] && !q->seen[i] && q->sentat[i] != -1)
+				sock->trackmask |= 1U << i;
+		sock->trackqid = q->qid0;
+		sock->tracknq = q->nums * q->ntypes;
+		sock->tracksend = q->begin;
+	}
+}
+
+/* wait for events on fd, returns 0 when something happened, -1 when
+ * deadline passed first or on errors */
+static int tcp_wait(int fd, short events, int64_t deadline) {
+	struct pollfd pfd;
+	struct timespec ts;
+	int64_t now;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	for (;;) {
+		if ((now = now_usec()) >= deadline)
+			return -1;
+		ts.tv_sec = (deadline - now) / (1000 * 1000);
+		ts.tv_nsec = (deadline - now) % (1000 * 1000) * 1000;
+		if ((r = ppoll(&pfd, 1, &ts, NULL)) > 0)
+			return 0;
+		if (r < 0 && errno != EINTR)
+			return -1;
+	}
+}
+
+/* get a connection of ctx to srv, a kept one if there is, in which
+ * case reused is set, else a new one, connected before deadline */
+static tcpconn *tcp_connect(
+		dnsq_ctx *ctx,
+		const struct sockaddr_in *srv,
+		int64_t deadline,
+		char *reused)
+{
+	tcpconn *c;
+	tcpconn *lru = &ctx->tcp[0];
+	socklen_t len = sizeof(int);
+	int err = 0;
+	int one = 1;
+	int i;
+
+	for (i = 0; i < TCPCONNS; i++) {
+		c = &ctx->tcp[i];
+		if (c->gen == sockgen &&
+				c->server.sin_addr.s_addr == srv->sin_addr.s_addr &&
+				c->server.sin_port == srv->sin_port)
+		{
+			*reused = 1;
+			c->lastuse = ++ctx->sockclock;
+			return c;
+		}
+		if (c->gen == 0 || (lru->gen != 0 && c->lastuse < lru->lastuse))
+			lru = c;
+	}
+
+	*reused = 0;
+	c = lru;
+	tcpconn_close(c);
+	if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+					IPPROTO_TCP)) == -1)
+		return NULL;
+	c->gen = sockgen;
+	c->server = *srv;
+	c->lastuse = ++ctx->sockclock;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, (const struct sockaddr *)srv, sizeof(*srv)) != 0 &&
+			(errno != EINPROGRESS ||
+			 tcp_wait(c->fd, POLLOUT, deadline) != 0 ||
+			 getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 ||
+			 err != 0))
+	{
+		tcpconn_close(c);
+		return NULL;
+	}
+	return c;
+}
+
+/* read len bytes from fd before deadline, returns the number of bytes
+ * read, which is less than len when the connection was closed, or -1
+ * on errors */
+static ssize_t tcp_read(int fd, unsigned char *buf, size_t len, int64_t deadline) {
+	size_t got = 0;
+	ssize_t r;
+
+	while (got < len) {
+		if ((r = recv(fd, buf + got, len - got, 0)) > 0)
+			got += r;
+		else if (r == 0)
+			break;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			r = tcp_wait(fd, POLLIN, deadline);
+		if (r < 0 && errno != EINTR)
+			return -1;
+	}
+	return got;
+}
+
+/* send the len bytes of msg over c and read the response into tbuf,
+ * returns its length, or -1 on errors */
+static ssize_t tcp_exchange(
+		tcpconn *c,
+		const unsigned char *msg,
+		size_t len,
+		unsigned char *tbuf,
+		int64_t deadline)
+{
+	unsigned char rlen[2];
+	size_t off = 0;
+	ssize_t r;
+
+	while (off < len) {
+		/* the server may have gone, don't die of SIGPIPE */
+		if ((r = send(c->fd, msg + off, len - off, MSG_NOSIGNAL)) >= 0)
+			off += r;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			r = tcp_wait(c->fd, POLLOUT, deadline);
+		if (r < 0 && errno != EINTR)
+			return -1;
+	}
+	if (tcp_read(c->fd, rlen, 2, deadline) != 2)
+		return -1;
+	len = ID(rlen);
+	if (tcp_read(c->fd, tbuf, len, deadline) != (ssize_t)len)
+		return -1;
+	return len;
+}
+
+/* ask the servers that answered truncated once more over TCP, and feed
+ * their responses to q, all within the deadline of q; one at a time,
+ * since another server's UDP answer may settle it meanwhile */
+static void query_tcp(dnsq_ctx *ctx, dnsq_query *q) {
+	unsigned char msg[2 + 12 + QUESTION_MAX + OPT_LEN];
+	tcpconn *c;
+	ssize_t len;
+	size_t mlen;
+	char reused;
+	int t;
+	int i;
+	int k;
+
+	if (ctx->tbuf == NULL && (ctx->tbuf = malloc(TCP_MAXMSG)) == NULL)
+		return;
+	for (t = 0; t < q->ntypes; t++) {
+		if ((i = q->tcp[t]) == -1)
+			continue;
+		q->tcp[t] = -1;
+		q->tcpasked |= 1U << (t * MAXSERVERS + i);
+		if (q->finished || q->done[t])
+			continue;
+
+		/* the question as sent over UDP, with the same ID */
+		k = t * q->nums + i;
+		mlen = 12 + q->qlen + q->optlen;
+		SET_ID(msg, (uint16_t)mlen);
+		memcpy(msg + 2, q->hdr[k], 12);
+		memcpy(msg + 2 + 12, q->question[t], q->qlen);
+		memcpy(msg + 2 + 12 + q->qlen, q->opt, q->optlen);
+		mlen += 2;
+
+		len = -1;
+		do {
+			if ((c = tcp_connect(ctx, &q->servers[i], q->deadline,
+							&reused)) == NULL)
+				break;
+			if ((len = tcp_exchange(c, msg, mlen, ctx->tbuf,
+							q->deadline)) < 0)
+				tcpconn_close(c);
+		} while (len < 0 && reused);
+		if (len < 12)
+			continue;
+
+		/* the round trip includes setting up the connection */
+		q->resent[i] = 1;
+		query_input(q, ctx->tbuf, len, &q->servers[i], now_usec());
+	}
+}
+
+int dnsq_ctx_query(
+		dnsq_ctx *ctx,
+		struct sockaddr_in* const dnsservers[],
+		const char *a,
+		int qtypes,
+		struct dnsq_answer *ans)
+{
+	dnsq_query *q = &ctx->q;
+	sockset *sock;
+	struct pollfd pfd;
+	struct timespec ts;
+	int64_t now;
+	int64_t next;
+	int err;
+	int n;
+
+	/* random ID for the first question, the others get the next ones */
+	if (ctx->gen != sockgen)
+		ctx_seed(ctx);
+	if (query_init(q, dnsservers, a, qtypes,
+				(uint16_t)ctx_random(ctx), ans) != 0)
+		return 1;
+
+	if ((sock = getsock(ctx, dnsservers)) == NULL)
+		return 1;
+	if (timing != 0) {
+		if (sock->uses % ADAPT_REFRESH == 1)
+			timing_derive(&sock->timing, q->health, q->nums);
+		query_timing(q, timing, &sock->timing);
+	}
+
+	now = now_usec();
+	n = query_start(q, sock->connected, now, ctx->msgs);
+	for (;;) {
+		if (n > 0 && sendpackets(sock->fd, ctx->msgs, n) != 0) {
+			sockset_close(sock);
+			return 2;  /* TODO: fail only when all fail? */
+		}
+		if ((next = query_next(q)) > now) {
+			pfd.fd = sock->fd;
+			pfd.events = POLLIN;
+			ts.tv_sec = (next - now) / (1000 * 1000);
+			ts.tv_nsec = (next - now) % (1000 * 1000) * 1000;
+			n = ppoll(&pfd, 1, &ts, NULL);
+			now = now_usec();
+			if (n > 0 && sockset_recv(ctx, sock, q, now) != 0) {
+				/* socket was closed due to an error, get a fresh one,
+				 * and retry right away */
+				sockset_close(sock);
+				if ((sock = getsock(ctx, dnsservers)) == NULL)
 					break;
-				case 1: /* format error */
-				case 2: /* server failure */
-				case 4: /* not implemented */
-				case 5: /* refused */
-					/* haproxy returns server failure for empty pools */
-#if LOGGING > 2
-					syslog(LOG_INFO, "serv fail: %d/%d, %x %x %x %x",
-							qid, i, p[0], p[1], p[2], p[3]);
-#endif
-					err = 10;
-					continue;
-				case 3:
-					/* NXDOMAIN */
-					err = 13;
-					continue;
-				default: /* reserved for future use */
-					err = 11;
-					continue;
+				q->connected = sock->connected;
+				q->roundend = now;
 			}
-			if (ANCOUNT(p) < 1) {
-				err = 12; /* we only support non-empty answers */
+		}
+		if (q->tcp[0] != -1 || q->tcp[1] != -1) {
+			query_tcp(ctx, q);
+			now = now_usec();
+		}
+		if ((n = query_tick(q, now, ctx->msgs)) < 0)
+			break;
+	}
+
+	if (sock != NULL)
+		sockset_track(sock, q, now);
+
+	err = query_finish(q);
+#ifdef LOGGING
+	if (err != 0)
+		syslog(LOG_INFO, "error while resolving %s, code %d", a, err);
+#endif
+
+	return err;
+}
+
+/* claim a random range of IDs for q that's entirely free in ids, a
+ * table indexed by ID, marking them with val; there are far more IDs
+ * than are ever in flight, returns 1 when none could be found */
+static int idtab_claim(uint16_t *ids, dnsq_ctx *ctx, dnsq_query *q, uint16_t val)
+{
+	uint16_t qid0;
+	int tries;
+	int k;
+
+	for (tries = 0; tries < 16; tries++) {
+		qid0 = (uint16_t)ctx_random(ctx);
+		for (k = 0; k < q->nums * q->ntypes; k++)
+			if (ids[(uint16_t)(qid0 + k)] != 0)
+				break;
+		if (k == q->nums * q->ntypes)
+			break;
+	}
+	if (tries == 16)
+		return 1;
+	q->qid0 = qid0;
+	for (k = 0; k < q->nums * q->ntypes; k++)
+		ids[(uint16_t)(qid0 + k)] = val;
+	return 0;
+}
+
+static void idtab_release(uint16_t *ids, dnsq_query *q) {
+	int k;
+
+	for (k = 0; k < q->nums * q->ntypes; k++)
+		ids[(uint16_t)(q->qid0 + k)] = 0;
+}
+
+/* for drivers that don't await late answers: servers that didn't
+ * respond when q ran out of time count as timed out */
+static void query_timeouts(dnsq_query *q) {
+	int i;
+
+	if (q->pending > 0 && q->neg != 13)
+		for (i = 0; i < q->nums; i++)
+			if (q->sentat[i] != -1 && !q->seen[i])
+				health_timeout(q->health[i]);
+}
+
+/* the timing mode of the process applied to q, for drivers without a
+ * sockset to keep the derived timing in */
+static void query_timing_mode(dnsq_query *q) {
+	dnsq_timing tm;
+
+	if (timing != 0) {
+		timing_derive(&tm, q->health, q->nums);
+		query_timing(q, timing, &tm);
+	}
+}
+
+/* The questions of all names in flight go out over a single
+ * unconnected socket.  Responses are matched to their query through a
+ * table indexed by ID, each query getting a random range of IDs not in
+ * use by any other. */
+typedef struct _dnsq_batch_state {
+	dnsq_query *qs;
+	int *req;                /* request index per query slot, -1 if free */
+	uint16_t *ids;           /* query slot + 1 per ID, 0 if free */
+	struct mmsghdr *msgs;
+	int window;
+} dnsq_batch_state;
+
+static void batch_release(dnsq_batch_state *b, int slot) {
+	idtab_release(b->ids, &b->qs[slot]);
+	b->req[slot] = -1;
+}
+
+static void batch_finish(
+		dnsq_batch_state *b,
+		int slot,
+		struct dnsq_request reqs[])
+{
+	query_timeouts(&b->qs[slot]);
+	reqs[b->req[slot]].err = query_finish(&b->qs[slot]);
+	batch_release(b, slot);
+}
+
+/* set up the query for reqs[r] in slot, returns 0 or an error */
+static int batch_init(
+		dnsq_batch_state *b,
+		dnsq_ctx *ctx,
+		int slot,
+		struct dnsq_request *req,
+		int64_t left)
+{
+	dnsq_query *q = &b->qs[slot];
+
+	if (req->dnsservers == NULL ||
+			query_init(q, req->dnsservers, req->name, req->qtypes,
+				0, &req->ans) != 0 ||
+			idtab_claim(b->ids, ctx, q, (uint16_t)(slot + 1)) != 0)
+		return 1;
+
+	query_timing_mode(q);
+	if (q->deadline > left)
+		q->deadline = left;
+
+	return 0;
+}
+
+int dnsq_batch(struct dnsq_request reqs[], int n, unsigned int timeout) {
+	dnsq_ctx *ctx;
+	dnsq_batch_state b;
+	struct pollfd pfd;
+	struct timespec ts;
+	int fd;
+	int64_t now;
+	int64_t deadline;
+	int64_t wake;
+	int nmsgs;
+	int active = 0;
+	int next = 0;
+	int slot;
+	int ok = 0;
+	int r;
+	int i;
+
+	if (n <= 0)
+		return 0;
+	if ((ctx = dnsq_ctx_thread()) == NULL)
+		return -1;
+	if (ctx->gen != sockgen)
+		ctx_seed(ctx);
+
+	b.window = n < BATCH_INFLIGHT ? n : BATCH_INFLIGHT;
+	b.qs = malloc(sizeof(dnsq_query) * b.window);
+	b.req = malloc(sizeof(int) * b.window);
+	b.ids = calloc(65536, sizeof(uint16_t));
+	b.msgs = malloc(sizeof(struct mmsghdr) * 2 * MAXSERVERS * b.window);
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (b.qs == NULL || b.req == NULL || b.ids == NULL || b.msgs == NULL ||
+			fd == -1)
+	{
+		free(b.qs);
+		free(b.req);
+		free(b.ids);
+		free(b.msgs);
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	for (slot = 0; slot < b.window; slot++)
+		b.req[slot] = -1;
+
+	now = now_usec();
+	deadline = now + (timeout != 0 ? (int64_t)timeout * 1000 : MAX_TIMEOUT);
+	for (;;) {
+		nmsgs = 0;
+
+		/* fill up the window with the next names */
+		for (slot = 0; slot < b.window && next < n && now < deadline; slot++) {
+			if (b.req[slot] != -1)
+				continue;
+			if ((reqs[next].err = batch_init(&b, ctx, slot, &reqs[next],
+							deadline - now)) != 0)
+			{
+				next++;
+				slot--;  /* try this slot again with the next name */
 				continue;
 			}
+			b.req[slot] = next++;
+			active++;
+			nmsgs += query_start(&b.qs[slot], 0, now, b.msgs + nmsgs);
+		}
 
-			if (saddr_buf_len <= len) {
-				err = 14;
+		/* retries, hedges and the queries that ran out of time */
+		for (slot = 0; slot < b.window; slot++) {
+			if (b.req[slot] == -1 || query_next(&b.qs[slot]) > now)
 				continue;
+			if ((r = query_tick(&b.qs[slot], now, b.msgs + nmsgs)) < 0) {
+				batch_finish(&b, slot, reqs);
+				active--;
+			} else {
+				nmsgs += r;
 			}
+		}
 
-			/* skip header + request */
-			p += len;
+		if (nmsgs > 0 && sendpackets(fd, b.msgs, nmsgs) != 0) {
+			for (slot = 0; slot < b.window; slot++)
+				if (b.req[slot] != -1) {
+					reqs[b.req[slot]].err = 2;
+					batch_release(&b, slot);
+				}
+			active = 0;
+			next = n;
+		}
+		if (active == 0 && (next == n || now >= deadline))
+			break;
 
-			if ((*p | 3 << 6) == 3 << 6) {
-				/* compression pointer, skip two octets */
-				p += 2;
-			} else {
-				/* read labels */
-				while (*p != 0)
-					p += 1 + *p;
-				p++;
-			}
-			if (ID(p) != 1 /* QTYPE == A */) {
-				err = 16;
-				continue;
-			}
-			p += 2;
-			if (ID(p) != 1 /* QCLASS == IN */) {
-				err = 14;
-				continue;
+		wake = deadline;
+		for (slot = 0; slot < b.window; slot++)
+			if (b.req[slot] != -1 && query_next(&b.qs[slot]) < wake)
+				wake = query_next(&b.qs[slot]);
+		if (wake > now) {
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			ts.tv_sec = (wake - now) / (1000 * 1000);
+			ts.tv_nsec = (wake - now) % (1000 * 1000) * 1000;
+			r = ppoll(&pfd, 1, &ts, NULL);
+			now = now_usec();
+		} else {
+			r = 0;
+		}
+
+		while (r > 0) {
+			for (i = 0; i < RECV_BATCH; i++)
+				ctx->rmsgs[i].msg_hdr.msg_namelen = sizeof(ctx->rfrom[i]);
+			if ((r = recvmmsg(fd, ctx->rmsgs, RECV_BATCH,
+							MSG_DONTWAIT, NULL)) <= 0)
+				break;
+			for (i = 0; i < r; i++) {
+				if (ctx->rmsgs[i].msg_len < 12 ||
+						(slot = b.ids[ID(ctx->rbuf[i])] - 1) < 0)
+					continue;
+				if (query_input(&b.qs[slot], ctx->rbuf[i],
+							ctx->rmsgs[i].msg_len, &ctx->rfrom[i], now) == 1)
+				{
+					batch_finish(&b, slot, reqs);
+					active--;
+				}
 			}
-			p += 2;
-			*ttl = ntohs(*(uint32_t*)p);
-			p += 4;
-			if (ID(p) != 4) {
-				err = 15;
+			if (r < RECV_BATCH)
+				break;
+		}
+	}
+
+	/* whatever didn't get its turn before the deadline */
+	for (; next < n; next++)
+		reqs[next].err = 1;
+	for (i = 0; i < n; i++)
+		if (reqs[i].err == 0)
+			ok++;
+
+	close(fd);
+	free(b.qs);
+	free(b.req);
+	free(b.ids);
+	free(b.msgs);
+
+	return ok;
+}
+
+/* The asynchronous interface keeps its queries in flight over a single
+ * unconnected socket, like dnsq_batch(), but leaves the waiting to the
+ * caller's event loop.  Query slots are allocated as they're needed, a
+ * handle is the slot number with a sequence number on top, such that a
+ * stale handle never cancels a newer query in the same slot. */
+typedef struct _dnsq_aquery {
+	dnsq_query q;
+	struct dnsq_answer ans;
+	dnsq_callback cb;
+	void *arg;
+	unsigned int handle;  /* 0 while the slot is free */
+} dnsq_aquery;
+
+struct _dnsq_async {
+	int fd;
+	dnsq_ctx *ctx;        /* for the rng and receive buffers */
+	char ownctx;          /* ctx is freed with the channel */
+	int maxqueries;
+	dnsq_aquery **qs;     /* maxqueries */
+	int nslots;           /* slots allocated */
+	int *freeslots;       /* maxqueries */
+	int nfree;
+	int active;
+	unsigned int seq;
+	uint16_t *ids;        /* query slot + 1 per ID, 0 if free, NULL for
+	                       * small channels */
+	struct mmsghdr msgs[2 * MAXSERVERS];
+};
+
+dnsq_async *dnsq_async_new(void) {
+	return dnsq_async_new_ctx(NULL, ASYNC_MAXQUERIES);
+}
+
+dnsq_async *dnsq_async_new_ctx(dnsq_ctx *ctx, int maxqueries) {
+	dnsq_async *as;
+	int rcvbuf = ASYNC_RCVBUF;
+	char big = maxqueries > ASYNC_SMALL;
+
+	if (maxqueries < 1 || maxqueries > ASYNC_MAXQUERIES)
+		return NULL;
+	/* the slot arrays and ID table come right after the channel */
+	if ((as = calloc(1, sizeof(dnsq_async) +
+					maxqueries * (sizeof(dnsq_aquery *) + sizeof(int)) +
+					(big ? 65536 * sizeof(uint16_t) : 0))) == NULL)
+		return NULL;
+	as->maxqueries = maxqueries;
+	as->qs = (dnsq_aquery **)(as + 1);
+	as->freeslots = (int *)(as->qs + maxqueries);
+	if (big)
+		as->ids = (uint16_t *)(as->freeslots + maxqueries);
+	as->ownctx = ctx == NULL;
+	if ((as->ctx = ctx != NULL ? ctx : dnsq_ctx_new()) == NULL) {
+		free(as);
+		return NULL;
+	}
+	as->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			IPPROTO_UDP);
+	if (as->fd == -1) {
+		if (as->ownctx)
+			dnsq_ctx_free(as->ctx);
+		free(as);
+		return NULL;
+	}
+	/* thousands of queries fan out to a few servers each, make room
+	 * for the answers arriving in between two calls to process; this
+	 * is capped by net.core.rmem_max, best effort is fine */
+	if (big)
+		setsockopt(as->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (as->ownctx)
+		ctx_seed(as->ctx);
+
+	return as;
+}
+
+/* claim a range of IDs for the query in slot, small channels check
+ * the ranges of the others instead of using the table */
+static int async_claim(dnsq_async *as, int slot) {
+	dnsq_query *q = &as->qs[slot]->q;
+	dnsq_query *o;
+	int n = q->nums * q->ntypes;
+	int tries;
+	int i;
+
+	if (as->ids != NULL)
+		return idtab_claim(as->ids, as->ctx, q, (uint16_t)(slot + 1));
+
+	for (tries = 0; tries < 16; tries++) {
+		q->qid0 = (uint16_t)ctx_random(as->ctx);
+		for (i = 0; i < as->nslots; i++) {
+			if (i == slot || as->qs[i]->handle == 0)
 				continue;
-			}
-			p += 2;
+			o = &as->qs[i]->q;
+			if ((uint16_t)(q->qid0 - o->qid0) < o->nums * o->ntypes ||
+					(uint16_t)(o->qid0 - q->qid0) < n)
+				break;
+		}
+		if (i == as->nslots)
+			return 0;
+	}
+	return 1;
+}
+
+static void async_release(dnsq_async *as, int slot) {
+	if (as->ids != NULL)
+		idtab_release(as->ids, &as->qs[slot]->q);
+}
+
+/* the slot of the query that used id, or -1 */
+static int async_slot(dnsq_async *as, uint16_t id) {
+	dnsq_query *q;
+	int slot;
+
+	if (as->ids != NULL)
+		return as->ids[id] - 1;
+	for (slot = 0; slot < as->nslots; slot++) {
+		q = &as->qs[slot]->q;
+		if (as->qs[slot]->handle != 0 &&
+				(uint16_t)(id - q->qid0) < q->nums * q->ntypes)
+			return slot;
+	}
+	return -1;
+}
+
+/* end the query in slot, and tell its owner */
+static void async_complete(dnsq_async *as, int slot, int err) {
+	dnsq_aquery *aq = as->qs[slot];
+
+	async_release(as, slot);
+	aq->handle = 0;
+	as->active--;
+	/* the callback may submit new queries, the slot is only given back
+	 * after it returned, or the next submit would reuse it, and its
+	 * answer, while the callback still reads it */
+	aq->cb(aq->arg, err, err == 0 || err == 12 || err == 13 ? &aq->ans : NULL);
+	as->freeslots[as->nfree++] = slot;
+}
+
+void dnsq_async_free(dnsq_async *as) {
+	int slot;
+
+	if (as == NULL)
+		return;
+
+	for (slot = 0; slot < as->nslots; slot++)
+		if (as->qs[slot]->handle != 0)
+			async_complete(as, slot, 1);
+	for (slot = 0; slot < as->nslots; slot++)
+		free(as->qs[slot]);
+	close(as->fd);
+	if (as->ownctx)
+		dnsq_ctx_free(as->ctx);
+	free(as);
+}
+
+int dnsq_async_fd(dnsq_async *as) {
+	return as->fd;
+}
+
+unsigned int dnsq_async_submit(
+		dnsq_async *as,
+		struct sockaddr_in* const dnsservers[],
+		const char *a,
+		int qtypes,
+		dnsq_callback cb,
+		void *arg)
+{
+	dnsq_aquery *aq;
+	int64_t now;
+	int slot;
+	int n;
+
+	if (as->ctx->gen != sockgen)
+		ctx_seed(as->ctx);
 
-			err = 0;
-			memcpy(ret, p, 4);
+	if (as->nfree > 0) {
+		slot = as->freeslots[--as->nfree];
+	} else if (as->nslots < as->maxqueries &&
+			(as->qs[as->nslots] = malloc(sizeof(dnsq_aquery))) != NULL)
+	{
+		slot = as->nslots++;
+	} else {
+		return 0;
+	}
+	aq = as->qs[slot];
+
+	if (dnsservers == NULL ||
+			query_init(&aq->q, dnsservers, a, qtypes, 0, &aq->ans) != 0 ||
+			async_claim(as, slot) != 0)
+	{
+		as->freeslots[as->nfree++] = slot;
+		return 0;
+	}
+	query_timing_mode(&aq->q);
+
+	now = now_usec();
+	n = query_start(&aq->q, 0, now, as->msgs);
+	if (sendpackets(as->fd, as->msgs, n) != 0) {
+		async_release(as, slot);
+		as->freeslots[as->nfree++] = slot;
+		return 0;
+	}
+
+	aq->cb = cb;
+	aq->arg = arg;
+	if (++as->seq >= (1U << (32 - ASYNC_SLOT_BITS)))
+		as->seq = 1;
+	aq->handle = as->seq << ASYNC_SLOT_BITS | (unsigned int)slot;
+	as->active++;
+
+	return aq->handle;
+}
+
+int dnsq_async_cancel(dnsq_async *as, unsigned int handle) {
+	int slot = (int)(handle & (ASYNC_MAXQUERIES - 1));
+	dnsq_aquery *aq;
+
+	if (handle == 0 || slot >= as->nslots ||
+			(aq = as->qs[slot])->handle != handle)
+		return 1;
+
+	async_release(as, slot);
+	aq->handle = 0;
+	as->freeslots[as->nfree++] = slot;
+	as->active--;
 
+	return 0;
+}
+
+struct timeval *dnsq_async_timeout(dnsq_async *as, struct timeval *tv) {
+	int64_t wake = -1;
+	int64_t now;
+	int slot;
+
+	if (as->active == 0)
+		return NULL;
+
+	for (slot = 0; slot < as->nslots; slot++)
+		if (as->qs[slot]->handle != 0 &&
+				(wake == -1 || query_next(&as->qs[slot]->q) < wake))
+			wake = query_next(&as->qs[slot]->q);
+	now = now_usec();
+	wake = wake > now ? wake - now : 0;
+	tv->tv_sec = wake / (1000 * 1000);
+	tv->tv_usec = wake % (1000 * 1000);
+
+	return tv;
+}
+
+int dnsq_async_process(dnsq_async *as) {
+	dnsq_ctx *ctx = as->ctx;
+	int64_t now;
+	int slot;
+	int r;
+	int i;
+
+	now = now_usec();
+
+	/* everything that arrived */
+	do {
+		for (i = 0; i < RECV_BATCH; i++)
+			ctx->rmsgs[i].msg_hdr.msg_namelen = sizeof(ctx->rfrom[i]);
+		if ((r = recvmmsg(as->fd, ctx->rmsgs, RECV_BATCH,
+						MSG_DONTWAIT, NULL)) <= 0)
 			break;
-		} while (err != 0 && i < nums);
-#if LOGGING > 2
-		if (err != 0) {
-			gettimeofday(&end, NULL);
-			syslog(LOG_INFO, "retrying due to error, code %d, time spent: %zd, time left: %zd, nums: %d, i: %d, retries: %d, tv: %zd %zd, %zd %zd",
-					err, timediff(begin, end), maxtime - timediff(begin, end),
-					nums, i, retries,
-					begin.tv_sec, begin.tv_usec,
-					end.tv_sec, end.tv_usec);
+		for (i = 0; i < r; i++) {
+			if (ctx->rmsgs[i].msg_len < 12 ||
+					(slot = async_slot(as, ID(ctx->rbuf[i]))) < 0)
+				continue;
+			if (query_input(&as->qs[slot]->q, ctx->rbuf[i],
+						ctx->rmsgs[i].msg_len, &ctx->rfrom[i], now) == 1)
+				async_complete(as, slot, query_finish(&as->qs[slot]->q));
 		}
-#endif
-		close(fd);
-	} while (err != 0 && err != 13 &&
-	 		retries-- > 0 &&
-			gettimeofday(&end, NULL) == 0 &&
-			maxtime - timediff(begin, end) > 0);
+	} while (r == RECV_BATCH);
 
-#ifdef LOGGING
-	if (err != 0)
-		syslog(LOG_INFO, "error while resolving %s, code %d", a, err);
-#endif
+	/* retries, hedges and the queries that ran out of time */
+	for (slot = 0; slot < as->nslots; slot++) {
+		if (as->qs[slot]->handle == 0 || query_next(&as->qs[slot]->q) > now)
+			continue;
+		if ((r = query_tick(&as->qs[slot]->q, now, as->msgs)) < 0) {
+			query_timeouts(&as->qs[slot]->q);
+			async_complete(as, slot, query_finish(&as->qs[slot]->q));
+		} else if (r > 0 && sendpackets(as->fd, as->msgs, r) != 0) {
+			async_complete(as, slot, 2);
+		}
+	}
 
+	return as->active;
+}
+
+int dnsq(
+		struct sockaddr_in* const dnsservers[],
+		const char *a,
+		struct in_addr *ret,
+		unsigned int *ttl,
+		char *serverid)
+{
+	dnsq_ctx *ctx;
+	struct dnsq_answer ans;
+	int err;
+
+	if ((ctx = dnsq_ctx_thread()) == NULL)
+		return 1;
+	if ((err = dnsq_ctx_query(ctx, dnsservers, a, DNSQ_A, &ans)) == 0)
+		*ret = ans.addrs[0];
+	*ttl = ans.ttl;
+	*serverid = ans.serverid;
 	return err;
 }
 
@@ -324,13 +2151,49 @@ int main(int argc, char *argv[]) {
 	struct sockaddr_in *dnsservers[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 	struct sockaddr_in *dnsserver;
 	int dnsi = 0;
+	const char *conf = "/etc/resolv.conf";
+	int count = 1;
+	char verbose = 0;
+	int flags = 0;
+	unsigned int ednssize = EDNS_SIZE;
+	int n;
+	struct dnsq_request *reqs;
+	int64_t begin;
+	int64_t end;
+	struct dnsq_server_stats st;
 
-	if (argc == 1) {
+	while ((i = getopt(argc, argv, "f:c:e:vaH")) != -1) {
+		switch (i) {
+			case 'f':
+				conf = optarg;
+				break;
+			case 'c':
+				count = atoi(optarg);
+				break;
+			case 'e':
+				ednssize = (unsigned int)atoi(optarg);
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'a':
+				flags |= DNSQ_ADAPTIVE;
+				break;
+			case 'H':
+				flags |= DNSQ_HEDGE;
+				break;
+			default:
+				return 1;
+		}
+	}
+
+	if (optind == argc) {
 		printf("DNS Parallel Query v" VERSION " (" GIT_VERSION ")  <fabian.groffen@booking.com>\n");
+		printf("usage: dnspq [-f resolv.conf] [-c count] [-e edns-size] [-v] [-a] [-H] name ...\n");
 		return 0;
 	}
 
-	if ((resolvconf = fopen("/etc/resolv.conf" /* FIXME */, "r")) == NULL)
+	if ((resolvconf = fopen(conf, "r")) == NULL)
 		return 1;
 	for (i = 0; i < 24 && fgets(buf, sizeof(buf), resolvconf) != NULL; i++)
 		if (
@@ -357,10 +2220,56 @@ int main(int argc, char *argv[]) {
 		}
 	fclose(resolvconf);
 
-	if ((ret = dnsq(dnsservers, argv[1], &ip, &ttl, &serverid)) == 0) {
+	dnsq_set_timing(flags);
+	dnsq_set_edns(ednssize);
+
+	if (argc - optind > 1) {
+		/* multiple names are resolved at once */
+		n = argc - optind;
+		if ((reqs = calloc(n, sizeof(*reqs))) == NULL)
+			return 1;
+		for (i = 0; i < n; i++) {
+			reqs[i].dnsservers = dnsservers;
+			reqs[i].name = argv[optind + i];
+			reqs[i].qtypes = DNSQ_A;
+		}
+		begin = now_usec();
+		ret = dnsq_batch(reqs, n, 0);
+		end = now_usec();
+		for (i = 0; i < n; i++) {
+			if (reqs[i].err == 0)
+				printf("%s: %s (%us/%d)\n", reqs[i].name,
+						inet_ntoa(reqs[i].ans.addrs[0]),
+						reqs[i].ans.ttl, reqs[i].ans.serverid);
+			else
+				printf("%s: error %d\n", reqs[i].name, reqs[i].err);
+		}
+		printf("%d of %d names in %.1fus\n", ret, n, (double)(end - begin));
+		free(reqs);
+		count = 0;
+	} else {
+		/* with a count, repeat the query, e.g. to benchmark */
+		begin = now_usec();
+		for (i = 0; i < count; i++)
+			if ((ret = dnsq(dnsservers, argv[optind],
+							&ip, &ttl, &serverid)) != 0)
+				return ret;
+		end = now_usec();
+
 		printf("%s (%us/%d)\n", inet_ntoa(ip), ttl, serverid);
-		return 0;
 	}
-	return ret;
+	if (count > 1)
+		printf("%d queries, %.1fus per query\n", count,
+				(double)(end - begin) / count);
+	/* what we learnt about the servers */
+	for (i = 0; verbose && dnsservers[i] != NULL; i++)
+		if (dnsq_server_stats(dnsservers[i], &st) == 0)
+			printf("%s: %lu queries, %lu retries, %lu answers, %lu used, "
+					"%lu failures, %lu bad, %lu timeouts, rtt %uus%s\n",
+					inet_ntoa(dnsservers[i]->sin_addr), st.queries,
+					st.retries, st.answers, st.wins, st.rcodefails,
+					st.parseerrs, st.timeouts, st.rtt,
+					st.open ? ", skipped" : "");
+	return 0;
 }
 #endif
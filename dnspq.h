@@ -18,9 +18,160 @@
 
 #define VERSION "1.2"
 
+#define DNSQ_MAXADDRS   32
+#define DNSQ_MAXADDRS6  16
+#define DNSQ_MAXNAME    256  /* a dotted name, null terminated */
+#define DNSQ_MAXCNAMES  8    /* CNAMEs followed in an answer */
+
+/* query types for dnsq_ctx_query(), DNSQ_PTR can't be combined */
+#define DNSQ_A     (1 << 0)
+#define DNSQ_AAAA  (1 << 1)
+#define DNSQ_PTR   (1 << 2)
+#define DNSQ_QTYPES  (DNSQ_A | DNSQ_AAAA | DNSQ_PTR)
+
+struct dnsq_answer {
+	unsigned int ttl;    /* lowest TTL of the records */
+	char serverid;       /* index of the server that answered first */
+	int naddrs;
+	struct in_addr addrs[DNSQ_MAXADDRS];
+	int naddrs6;
+	struct in6_addr addrs6[DNSQ_MAXADDRS6];
+	/* when the name is an alias, the canonical name the CNAME chain in
+	 * the answer led to, followed by the names in between, as far as
+	 * they fit, each null terminated, ending with an empty one; empty
+	 * when the records are those of the name itself; for DNSQ_PTR the
+	 * names of the PTR records, in the same form */
+	char canon[DNSQ_MAXNAME];
+};
+
+/* resolver state (sockets, query ID space, buffers), a context may
+ * only be used by one thread at a time */
+typedef struct _dnsq_ctx dnsq_ctx;
+
+dnsq_ctx *dnsq_ctx_new(void);
+void dnsq_ctx_free(dnsq_ctx *ctx);
+dnsq_ctx *dnsq_ctx_thread(void);
+
+/* query the A and/or AAAA records (qtypes) for a, the questions for
+ * both types go out in the same round, or the PTR records of a reverse
+ * name; returns 0 and fills in ans with all records from the answers
+ * (up to DNSQ_MAXADDRS and DNSQ_MAXADDRS6, or the PTR names that fit in
+ * ans->canon) when there are records of at least one type, an error code
+ * otherwise; for NXDOMAIN (13) and empty answers (12) ans->ttl holds
+ * the negative caching TTL from the SOA, or 0 if there was none;
+ * truncated answers are asked for again over TCP, error 17 means that
+ * didn't work out */
+int dnsq_ctx_query(
+		dnsq_ctx *ctx,
+		struct sockaddr_in* const dnsservers[],
+		const char *a,
+		int qtypes,
+		struct dnsq_answer *ans);
+
+/* dnsq_ctx_query() using the context of the calling thread, returning
+ * only the first address */
 int dnsq(
 		struct sockaddr_in* const dnsservers[],
 		const char *a,
 		struct in_addr *ret,
 		unsigned int *ttl,
 		char *serverid);
+
+/* a single name to resolve with dnsq_batch() */
+struct dnsq_request {
+	struct sockaddr_in* const *dnsservers;  /* NULL terminated */
+	const char *name;
+	int qtypes;
+	int err;                 /* set by dnsq_batch(), like dnsq_ctx_query() */
+	struct dnsq_answer ans;  /* set by dnsq_batch() */
+};
+
+/* resolve all n names in reqs at once, keeping up to a few dozen of
+ * them in flight over a single socket, such that the whole batch takes
+ * about as long as the slowest name; all are done within timeout
+ * milliseconds (0 for the timeout of a single query), names that
+ * couldn't be asked in time get error 1, those with only truncated
+ * answers error 17, there's no TCP fallback; returns the number of names
+ * resolved, or -1 when no socket could be made */
+int dnsq_batch(struct dnsq_request reqs[], int n, unsigned int timeout);
+
+/* Asynchronous queries for event loops.  Queries are submitted
+ * without blocking, the caller waits for dnsq_async_fd() to become
+ * readable or for dnsq_async_timeout() to pass, whichever comes first,
+ * and then calls dnsq_async_process(), which invokes the callbacks of
+ * the queries that completed.  Queries behave like dnsq_ctx_query(),
+ * except that truncated answers aren't asked for over TCP, and an async
+ * channel may only be used by one thread at a time. */
+typedef struct _dnsq_async dnsq_async;
+struct timeval;
+
+/* err and ans like dnsq_ctx_query(), ans is NULL when there's neither
+ * records nor a negative answer, and is only valid during the call */
+typedef void (*dnsq_callback)(void *arg, int err, struct dnsq_answer *ans);
+
+dnsq_async *dnsq_async_new(void);
+/* a channel for maxqueries outstanding queries at most, using ctx for
+ * its buffers when not NULL, which must outlive it and be used by the
+ * same thread only, for callers with a few queries in the background */
+dnsq_async *dnsq_async_new_ctx(dnsq_ctx *ctx, int maxqueries);
+/* outstanding queries complete with error 1 */
+void dnsq_async_free(dnsq_async *as);
+
+/* start resolving a, returns a handle, or 0 when the query couldn't
+ * be started, in which case cb isn't called */
+unsigned int dnsq_async_submit(
+		dnsq_async *as,
+		struct sockaddr_in* const dnsservers[],
+		const char *a,
+		int qtypes,
+		dnsq_callback cb,
+		void *arg);
+
+/* forget a query without calling its callback, returns 1 if it
+ * already completed */
+int dnsq_async_cancel(dnsq_async *as, unsigned int handle);
+
+/* the socket to poll for reading */
+int dnsq_async_fd(dnsq_async *as);
+
+/* fills in tv with the time until dnsq_async_process() must be called
+ * at the latest and returns it, or NULL when nothing is outstanding */
+struct timeval *dnsq_async_timeout(dnsq_async *as, struct timeval *tv);
+
+/* handles responses, retries and expiry, returns the number of queries
+ * still outstanding */
+int dnsq_async_process(dnsq_async *as);
+
+/* timing modes for dnsq_set_timing() */
+#define DNSQ_ADAPTIVE  (1 << 0)  /* retry and deadline from observed RTTs */
+#define DNSQ_HEDGE     (1 << 1)  /* fastest server first, others later */
+
+/* set the timing mode for all queries of the process, 0 for the
+ * static timeouts */
+void dnsq_set_timing(int flags);
+
+/* set the UDP payload size advertised with EDNS0 for all queries of the
+ * process, from 512 up to 4096, 0 to send plain queries */
+#ifndef EDNS_SIZE
+# define EDNS_SIZE  1232  /* the default, fits in any path's MTU */
+#endif
+void dnsq_set_edns(unsigned int size);
+
+/* what the library has seen from a server, across all queries made by
+ * the process */
+struct dnsq_server_stats {
+	unsigned long queries;
+	unsigned long answers;     /* valid responses, including NXDOMAIN */
+	unsigned long wins;        /* answers that were used */
+	unsigned long retries;     /* questions sent again */
+	unsigned long parseerrs;   /* responses that didn't make sense */
+	unsigned long rcodefails;  /* SERVFAIL, REFUSED and the like */
+	unsigned long timeouts;
+	unsigned int rtt;          /* smoothed round trip time in usec */
+	char open;                 /* server is skipped due to failures */
+};
+
+/* returns 0 and fills in st, or 1 when srv was never queried */
+int dnsq_server_stats(
+		const struct sockaddr_in *srv,
+		struct dnsq_server_stats *st);
@@ -15,35 +15,718 @@
  *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+/* load generator
+ *
+ * Resolves names from a set with a number of threads, either as fast
+ * as possible (closed loop), or at a fixed rate (open loop), through
+ * one of three paths: the query engine (dnsq_ctx_query()), the nss
+ * functions of the module linked in, or getaddrinfo() of the libc,
+ * which uses whatever nsswitch.conf says.  Latencies go into a
+ * log-linear histogram per thread, like HdrHistogram, with 64 buckets
+ * per power of 2, so about 1.5% precision.  In open loop mode the
+ * latency is taken from when the lookup was due, not when it started,
+ * such that a stall counts for all the lookups it delays.
+ *
+ * Syscalls are counted by wrapping the libc functions the module uses,
+ * for the thread doing a lookup only.  For the libc path the module
+ * must be loaded by the libc, and resolve these symbols to ours, which
+ * it does, since they are exported. */
+
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <nss.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dnspq.h"
+#include "config.h"
+
+#define MODE_DNSQ  0
+#define MODE_NSS   1
+#define MODE_LIBC  2
 
-const char *pools[] = {
-    "xxxx",
-    "yyyy",
-    "zzzz"
+/* histogram of nanoseconds: values below 64 exact, then 64 buckets for
+ * each power of 2 up to 2^40 (18 minutes) */
+#define HIST_SUB     64
+#define HIST_BITS    6
+#define HIST_MAXLOG  40
+#define HIST_SIZE    ((HIST_MAXLOG - HIST_BITS + 1) * HIST_SUB)
+
+#define MAXERRS      32
+
+enum nss_status _nss_dnspq_gethostbyname3_r(const char *name, int af,
+		struct hostent *host, char *buf, size_t buflen,
+		int *errnop, int *h_errnop, int32_t *ttlp, char **canonp);
+enum nss_status _nss_dnspq_gethostbyname4_r(const char *name,
+		struct gaih_addrtuple **pat, char *buffer, size_t buflen,
+		int *errnop, int *h_errnop, int32_t *ttlp);
+enum nss_status _nss_dnspq_gethostbyaddr2_r(const void *addr, socklen_t len,
+		int af, struct hostent *host, char *buffer, size_t buflen,
+		int *errnop, int *h_errnop, int32_t *ttlp);
+
+/* syscalls wrapped, counted while a lookup is running */
+enum {
+	SC_SOCKET, SC_BIND, SC_CONNECT, SC_CLOSE, SC_SETSOCKOPT, SC_SENDMMSG,
+	SC_RECVMMSG, SC_SEND, SC_RECV, SC_POLL, SC_PPOLL, SC_GETPID,
+	SC_GETRANDOM, SC_OPEN, SC_STAT, SC_FSTAT, SC_MMAP, SC_MUNMAP,
+	SC_FLOCK, SC_COUNT
 };
-const char domain[] = ".some-pool";
-const size_t poolsnr = sizeof(pools) / sizeof(*pools);
+static const char *scnames[SC_COUNT] = {
+	"socket", "bind", "connect", "close", "setsockopt", "sendmmsg",
+	"recvmmsg", "send", "recv", "poll", "ppoll", "getpid",
+	"getrandom", "open", "stat", "fstat", "mmap", "munmap",
+	"flock"
+};
+
+typedef struct _worker {
+	pthread_t tid;
+	int idx;
+	uint64_t rng;
+	uint64_t lookups;
+	uint64_t errs[MAXERRS];
+	uint64_t syscalls[SC_COUNT];
+	uint64_t hist[HIST_SIZE];
+	uint64_t max;
+	double sum;
+} worker;
+
+static int mode = MODE_NSS;
+static int qtypes = DNSQ_A | DNSQ_AAAA;
+static char reverse = 0;         /* names are addresses, looked up by PTR */
+static char verbose = 0;         /* print the outcome of each lookup */
+static int nthreads = 1;
+static double rate = 0;          /* lookups per second, 0 for closed loop */
+static double duration = 10;     /* seconds */
+static uint64_t count = 0;       /* lookups per thread, instead of duration */
+static char **names = NULL;
+static size_t nnames = 0;
+static dnspq_config *conf = NULL;
+static struct sockaddr_in servers[CONFIG_MAXSERVERS];
+static struct sockaddr_in *fixedservers[CONFIG_MAXSERVERS + 1];
+static int64_t start;
+static int64_t stop;
+
+static __thread uint64_t *counting = NULL;
+
+#define WRAP(sc, ret, name, args, call) \
+	ret name args { \
+		static ret (*fn) args = NULL; \
+		if (fn == NULL) \
+			fn = (ret (*) args)dlsym(RTLD_NEXT, #name); \
+		if (counting != NULL) \
+			counting[sc]++; \
+		return fn call; \
+	}
+
+WRAP(SC_SOCKET, int, socket, (int d, int t, int p), (d, t, p))
+WRAP(SC_BIND, int, bind,
+		(int fd, const struct sockaddr *a, socklen_t l), (fd, a, l))
+WRAP(SC_CONNECT, int, connect,
+		(int fd, const struct sockaddr *a, socklen_t l), (fd, a, l))
+WRAP(SC_CLOSE, int, close, (int fd), (fd))
+WRAP(SC_SETSOCKOPT, int, setsockopt,
+		(int fd, int l, int o, const void *v, socklen_t len),
+		(fd, l, o, v, len))
+WRAP(SC_SENDMMSG, int, sendmmsg,
+		(int fd, struct mmsghdr *m, unsigned int n, int f), (fd, m, n, f))
+WRAP(SC_RECVMMSG, int, recvmmsg,
+		(int fd, struct mmsghdr *m, unsigned int n, int f, struct timespec *t),
+		(fd, m, n, f, t))
+WRAP(SC_SEND, ssize_t, send,
+		(int fd, const void *b, size_t l, int f), (fd, b, l, f))
+WRAP(SC_RECV, ssize_t, recv, (int fd, void *b, size_t l, int f), (fd, b, l, f))
+WRAP(SC_POLL, int, poll, (struct pollfd *p, nfds_t n, int t), (p, n, t))
+WRAP(SC_PPOLL, int, ppoll,
+		(struct pollfd *p, nfds_t n, const struct timespec *t,
+		 const sigset_t *s), (p, n, t, s))
+WRAP(SC_GETPID, pid_t, getpid, (void), ())
+WRAP(SC_GETRANDOM, ssize_t, getrandom,
+		(void *b, size_t l, unsigned int f), (b, l, f))
+WRAP(SC_STAT, int, stat, (const char *p, struct stat *s), (p, s))
+WRAP(SC_FSTAT, int, fstat, (int fd, struct stat *s), (fd, s))
+WRAP(SC_MMAP, void *, mmap,
+		(void *a, size_t l, int p, int f, int fd, off_t o),
+		(a, l, p, f, fd, o))
+WRAP(SC_MUNMAP, int, munmap, (void *a, size_t l), (a, l))
+WRAP(SC_FLOCK, int, flock, (int fd, int op), (fd, op))
+
+int open(const char *path, int flags, ...) {
+	static int (*fn)(const char *, int, ...) = NULL;
+	va_list ap;
+	mode_t m = 0;
+
+	if (fn == NULL)
+		fn = (int (*)(const char *, int, ...))dlsym(RTLD_NEXT, "open");
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		m = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	if (counting != NULL)
+		counting[SC_OPEN]++;
+	return fn(path, flags, m);
+}
+
+static inline int64_t now_nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static inline uint64_t rnd(uint64_t *s) {
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 2685821657736338717ULL;
+}
+
+static inline int hist_index(uint64_t v) {
+	int lg;
+
+	if (v < HIST_SUB)
+		return (int)v;
+	lg = 63 - __builtin_clzll(v);
+	if (lg > HIST_MAXLOG)
+		return HIST_SIZE - 1;
+	return (lg - HIST_BITS + 1) * HIST_SUB +
+		(int)((v >> (lg - HIST_BITS)) & (HIST_SUB - 1));
+}
+
+/* the highest value that lands in bucket i */
+static uint64_t hist_value(int i) {
+	int lg;
+
+	if (i < HIST_SUB)
+		return i;
+	lg = i / HIST_SUB + HIST_BITS - 1;
+	return (((uint64_t)HIST_SUB + i % HIST_SUB + 1) << (lg - HIST_BITS)) - 1;
+}
+
+/* the value below which pct percent of the n samples in hist are */
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t n, double pct) {
+	uint64_t want = (uint64_t)(n * pct / 100.0 + 0.5);
+	uint64_t seen = 0;
+	int i;
+
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < HIST_SIZE; i++)
+		if ((seen += hist[i]) >= want)
+			return hist_value(i);
+	return hist_value(HIST_SIZE - 1);
+}
+
+static const char *errname(int e);
 
-int main() {
-	struct hostent *he;
-	char pool[256];
-	int last_addr = 0;
+/* append to the outcome of a lookup of -v, as far as it fits */
+static void addf(char *out, size_t len, const char *fmt, ...) {
+	size_t n = strlen(out);
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(out + n, len - n, fmt, ap);
+	va_end(ap);
+}
+
+/* the TTL, addresses and names of ans, in out */
+static void showanswer(
+		char *out,
+		size_t len,
+		int qt,
+		int err,
+		const struct dnsq_answer *ans)
+{
+	char a[INET6_ADDRSTRLEN];
+	const char *p;
 	int i;
-	size_t dups = 0;
-
-	for (i = 0; i < 100000; i++) {
-		snprintf(pool, sizeof(pool), "%s%s", pools[i % poolsnr], domain);
-		if ((he = gethostbyname(pool)) != NULL) {
-			if (*((int *)he->h_addr) == last_addr)
-				dups++;
-			last_addr = *((int *)he->h_addr);
+
+	if (err != 0 && err != 12 && err != 13)
+		return;
+	addf(out, len, " ttl %u", ans->ttl);
+	if (err != 0)
+		return;
+	for (i = 0; i < ans->naddrs; i++)
+		addf(out, len, " %s", inet_ntop(AF_INET, &ans->addrs[i], a, sizeof(a)));
+	for (i = 0; i < ans->naddrs6; i++)
+		addf(out, len, " %s",
+				inet_ntop(AF_INET6, &ans->addrs6[i], a, sizeof(a)));
+	if (qt == DNSQ_PTR)
+		for (p = ans->canon; *p != '\0'; p += strlen(p) + 1)
+			addf(out, len, " %s", p);
+	else if (ans->canon[0] != '\0')
+		addf(out, len, " canon %s", ans->canon);
+}
+
+/* the same for the outcome of the nss functions */
+static void showhost(
+		char *out,
+		size_t len,
+		const char *name,
+		enum nss_status st,
+		int32_t ttl,
+		const struct hostent *host,
+		const struct gaih_addrtuple *pat)
+{
+	char a[INET6_ADDRSTRLEN];
+	const char *canon = NULL;
+	char **p;
+
+	if (ttl >= 0)
+		addf(out, len, " ttl %d", (int)ttl);
+	if (st != NSS_STATUS_SUCCESS)
+		return;
+	if (reverse) {
+		addf(out, len, " %s", host->h_name);
+		for (p = host->h_aliases; *p != NULL; p++)
+			addf(out, len, " %s", *p);
+		return;
+	}
+	if (host != NULL) {
+		for (p = host->h_addr_list; *p != NULL; p++)
+			addf(out, len, " %s",
+					inet_ntop(host->h_addrtype, *p, a, sizeof(a)));
+		canon = host->h_name;
+	}
+	for (; pat != NULL; pat = pat->next) {
+		addf(out, len, " %s", inet_ntop(pat->family, pat->addr, a, sizeof(a)));
+		if (pat->name != NULL)
+			canon = pat->name;
+	}
+	if (canon != NULL && strcasecmp(canon, name) != 0)
+		addf(out, len, " canon %s", canon);
+}
+
+/* a single lookup of name, returns the error class */
+static int resolve(const char *name) {
+	static __thread unsigned int rr = 0;
+	struct sockaddr_in *srvs[CONFIG_MAXSERVERS + 1];
+	struct sockaddr_in **dnsservers = fixedservers;
+	struct dnsq_answer ans;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct hostent host;
+	struct gaih_addrtuple *pat = NULL;
+	unsigned char addr[16];
+	char rname[DNSQ_MAXNAME];
+	char out[1024];
+	char buf[4096];
+	const char *qname = name;
+	enum nss_status st;
+	uint32_t gid;
+	int32_t ttl = -1;
+	int af = AF_INET;
+	int qt = qtypes;
+	int errnop;
+	int herrnop;
+	int err;
+
+	out[0] = '\0';
+	if (reverse) {
+		/* checked to be an address on startup */
+		af = strchr(name, ':') != NULL ? AF_INET6 : AF_INET;
+		inet_pton(af, name, addr);
+		config_revname(af, addr, af == AF_INET ? 32 : 128, rname);
+		qname = rname;
+		qt = DNSQ_PTR;
+	}
+
+	switch (mode) {
+		case MODE_DNSQ:
+			if (conf != NULL) {
+				if (!config_servers(conf, qname, srvs, &gid, &rr)) {
+					err = 1;
+					break;
+				}
+				dnsservers = srvs;
+			}
+			err = dnsq_ctx_query(dnsq_ctx_thread(), dnsservers, qname,
+					qt, &ans);
+			if (verbose)
+				showanswer(out, sizeof(out), qt, err, &ans);
+			err = err < MAXERRS ? err : MAXERRS - 1;
+			break;
+		case MODE_NSS:
+			if (reverse) {
+				st = _nss_dnspq_gethostbyaddr2_r(addr,
+						af == AF_INET ? 4 : 16, af, &host, buf, sizeof(buf),
+						&errnop, &herrnop, &ttl);
+			} else if (qtypes == (DNSQ_A | DNSQ_AAAA)) {
+				st = _nss_dnspq_gethostbyname4_r(name, &pat, buf, sizeof(buf),
+						&errnop, &herrnop, &ttl);
+			} else {
+				st = _nss_dnspq_gethostbyname3_r(name,
+						qtypes == DNSQ_A ? AF_INET : AF_INET6, &host,
+						buf, sizeof(buf), &errnop, &herrnop, &ttl, NULL);
+			}
+			if (verbose)
+				showhost(out, sizeof(out), name, st, ttl,
+						reverse || qtypes != (DNSQ_A | DNSQ_AAAA) ?
+						&host : NULL, pat);
+			switch (st) {
+				case NSS_STATUS_SUCCESS:
+					err = 0;
+					break;
+				case NSS_STATUS_NOTFOUND:
+					err = herrnop == NO_DATA ? 1 : 2;
+					break;
+				case NSS_STATUS_TRYAGAIN:
+					err = 3;
+					break;
+				default:
+					err = 4;
+					break;
+			}
+			break;
+		default:
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = qtypes == (DNSQ_A | DNSQ_AAAA) ? AF_UNSPEC :
+				qtypes == DNSQ_A ? AF_INET : AF_INET6;
+			hints.ai_socktype = SOCK_DGRAM;
+			if ((err = getaddrinfo(name, NULL, &hints, &res)) == 0)
+				freeaddrinfo(res);
+			/* EAI_* are small negative numbers */
+			err = -err < MAXERRS ? -err : MAXERRS - 1;
+			break;
+	}
+
+	if (verbose)
+		printf("%s: %s%s\n", name, errname(err), out);
+	return err;
+}
+
+static const char *errname(int e) {
+	static const char *dnsqerrs[] = {
+		"ok", "timeout", "send failed", NULL, "short answer", NULL, NULL,
+		"wrong id", "not a response", "not a query", "servfail/refused",
+		"bad rcode", "no data", "nxdomain", "malformed", "bad rdata",
+		"no records", "truncated"
+	};
+	static const char *nsserrs[] = {
+		"ok", "no data", "not found", "tryagain", "unavail"
+	};
+
+	if (mode == MODE_DNSQ)
+		return e >= 0 && (size_t)e < sizeof(dnsqerrs) / sizeof(dnsqerrs[0]) &&
+			dnsqerrs[e] != NULL ? dnsqerrs[e] : "other";
+	if (mode == MODE_NSS)
+		return e >= 0 && (size_t)e < sizeof(nsserrs) / sizeof(nsserrs[0]) ?
+			nsserrs[e] : "other";
+	return e == 0 ? "ok" : gai_strerror(-e);
+}
+
+static void *run(void *arg) {
+	worker *w = arg;
+	int64_t interval = rate > 0 ? (int64_t)(1e9 * nthreads / rate) : 0;
+	int64_t due;
+	int64_t now;
+	uint64_t lat;
+	struct timespec ts;
+	const char *name;
+
+	/* spread the threads over the interval, after all of them started,
+	 * which is what the throughput is taken from */
+	due = start + interval * w->idx / nthreads;
+	ts.tv_sec = due / 1000000000;
+	ts.tv_nsec = due % 1000000000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	for (;;) {
+		now = now_nsec();
+		if (count != 0 ? w->lookups >= count : now >= stop)
+			break;
+		if (interval > 0) {
+			if (due > now) {
+				ts.tv_sec = due / 1000000000;
+				ts.tv_nsec = due % 1000000000;
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			}
+		} else {
+			due = now;
+		}
+		name = names[rnd(&w->rng) % nnames];
+
+		counting = w->syscalls;
+		w->errs[resolve(name)]++;
+		counting = NULL;
+
+		lat = now_nsec() - due;
+		w->hist[hist_index(lat)]++;
+		w->sum += lat;
+		if (lat > w->max)
+			w->max = lat;
+		w->lookups++;
+		due += interval;
+	}
+	return NULL;
+}
+
+/* names from file, one per line, or expanded from a pattern with a %d
+ * in it into n names */
+static int addnames(const char *arg, const char *file, size_t n) {
+	char buf[256];
+	char **nn;
+	FILE *f = NULL;
+	size_t i;
+
+	if (file != NULL && (f = fopen(file, "r")) == NULL)
+		return 1;
+	if (f == NULL && strstr(arg, "%d") == NULL)
+		n = 1;
+	for (i = 0; f != NULL || i < n; i++) {
+		if (f != NULL) {
+			if (fgets(buf, sizeof(buf), f) == NULL)
+				break;
+			buf[strcspn(buf, " \t\r\n")] = '\0';
+			if (buf[0] == '\0' || buf[0] == '#')
+				continue;
 		} else {
-			printf("error resolving %s\n", pool);
+			snprintf(buf, sizeof(buf), arg, (int)i);
+		}
+		if ((nnames & (nnames + 1)) == 0) {
+			if ((nn = realloc(names, sizeof(char *) * (nnames + 1) * 2)) == NULL)
+				break;
+			names = nn;
+		}
+		names[nnames++] = strdup(buf);
+	}
+	if (f != NULL)
+		fclose(f);
+	return 0;
+}
+
+static int parseservers(char *arg) {
+	char *p;
+	char *port;
+	int n = 0;
+
+	for (p = strtok(arg, ","); p != NULL && n < CONFIG_MAXSERVERS;
+			p = strtok(NULL, ","))
+	{
+		memset(&servers[n], 0, sizeof(servers[n]));
+		servers[n].sin_family = AF_INET;
+		servers[n].sin_port = htons(53);
+		if ((port = strchr(p, ':')) != NULL) {
+			*port++ = '\0';
+			servers[n].sin_port = htons(atoi(port));
+		}
+		if (inet_pton(AF_INET, p, &servers[n].sin_addr) <= 0)
+			return 1;
+		fixedservers[n] = &servers[n];
+		n++;
+	}
+	fixedservers[n] = NULL;
+	return n == 0;
+}
+
+static void usage(void) {
+	printf("DNS Parallel Query load generator v" VERSION " (" GIT_VERSION ")\n");
+	printf("usage: dnstest [options] name ...\n");
+	printf("  -m mode       dnsq, nss (default) or libc\n");
+	printf("  -t threads    number of threads (default 1)\n");
+	printf("  -r rate       lookups per second over all threads (open loop),\n"
+	       "                default as fast as possible (closed loop)\n");
+	printf("  -d secs       duration (default 10)\n");
+	printf("  -c count      lookups per thread, instead of a duration\n");
+	printf("  -4, -6        only ask for A or AAAA (default both)\n");
+	printf("  -x            names are addresses, look up their names\n");
+	printf("  -n count      names per name with a %%d in it (default 1000)\n");
+	printf("  -N file       read names from file\n");
+	printf("  -f conf       pools for dnsq mode (default " RESOLV_CONF ")\n");
+	printf("  -s ip:port,.. servers for dnsq mode, instead of pools\n");
+	printf("  -v            print the outcome of each lookup\n");
+	printf("  -H            print the latency distribution\n");
+}
+
+int main(int argc, char *argv[]) {
+	worker *ws;
+	worker total;
+	const char *conffile = RESOLV_CONF;
+	const char *namefile = NULL;
+	size_t perpattern = 1000;
+	char hist = 0;
+	double secs;
+	uint64_t seen;
+	uint64_t calls;
+	int64_t end;
+	unsigned char buf[16];
+	size_t n;
+	int i;
+	int j;
+
+	while ((i = getopt(argc, argv, "m:t:r:d:c:46xn:N:f:s:vH")) != -1) {
+		switch (i) {
+			case 'm':
+				if (strcmp(optarg, "dnsq") == 0)
+					mode = MODE_DNSQ;
+				else if (strcmp(optarg, "nss") == 0)
+					mode = MODE_NSS;
+				else if (strcmp(optarg, "libc") == 0)
+					mode = MODE_LIBC;
+				else {
+					usage();
+					return 1;
+				}
+				break;
+			case 't': nthreads = atoi(optarg); break;
+			case 'r': rate = atof(optarg); break;
+			case 'd': duration = atof(optarg); break;
+			case 'c': count = strtoull(optarg, NULL, 10); break;
+			case '4': qtypes = DNSQ_A; break;
+			case '6': qtypes = DNSQ_AAAA; break;
+			case 'x': reverse = 1; break;
+			case 'n': perpattern = (size_t)atol(optarg); break;
+			case 'N': namefile = optarg; break;
+			case 'f': conffile = optarg; break;
+			case 's':
+				if (parseservers(optarg) != 0) {
+					fprintf(stderr, "invalid servers: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'v': verbose = 1; break;
+			case 'H': hist = 1; break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if (namefile != NULL && addnames(NULL, namefile, 0) != 0) {
+		fprintf(stderr, "%s: cannot read names\n", namefile);
+		return 1;
+	}
+	for (i = optind; i < argc; i++)
+		addnames(argv[i], NULL, perpattern);
+	if (nnames == 0 || nthreads <= 0 || (reverse && mode == MODE_LIBC)) {
+		usage();
+		return 1;
+	}
+	for (n = 0; reverse && n < nnames; n++) {
+		if (inet_pton(strchr(names[n], ':') != NULL ? AF_INET6 : AF_INET,
+					names[n], buf) <= 0)
+		{
+			fprintf(stderr, "not an address: %s\n", names[n]);
+			return 1;
+		}
+	}
+	if (mode == MODE_DNSQ && fixedservers[0] == NULL &&
+			(conf = config_map(RESOLV_CONF_BIN)) == NULL &&
+			(conf = config_load(conffile)) == NULL)
+	{
+		fprintf(stderr, "%s: cannot read config\n", conffile);
+		return 1;
+	}
+
+	if ((ws = calloc(nthreads, sizeof(worker))) == NULL)
+		return 1;
+	start = now_nsec() + 1000 * 1000;
+	stop = start + (int64_t)(duration * 1e9);
+	for (i = 0; i < nthreads; i++) {
+		ws[i].idx = i;
+		ws[i].rng = (uint64_t)start ^ ((uint64_t)(i + 1) << 32) ^ 0x9e3779b97f4a7c15ULL;
+		if (pthread_create(&ws[i].tid, NULL, run, &ws[i]) != 0) {
+			fprintf(stderr, "cannot start thread %d\n", i);
+			return 1;
+		}
+	}
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(ws[i].tid, NULL);
+		total.lookups += ws[i].lookups;
+		total.sum += ws[i].sum;
+		if (ws[i].max > total.max)
+			total.max = ws[i].max;
+		for (j = 0; j < MAXERRS; j++)
+			total.errs[j] += ws[i].errs[j];
+		for (j = 0; j < SC_COUNT; j++)
+			total.syscalls[j] += ws[i].syscalls[j];
+		for (j = 0; j < HIST_SIZE; j++)
+			total.hist[j] += ws[i].hist[j];
+	}
+	end = now_nsec();
+	if (total.lookups == 0)
+		return 1;
+
+	secs = (end - start) / 1e9;
+	printf("%s, %d thread%s, %s, %zu name%s\n",
+			mode == MODE_DNSQ ? "dnsq" : mode == MODE_NSS ? "nss" : "libc",
+			nthreads, nthreads == 1 ? "" : "s",
+			rate > 0 ? "open loop" : "closed loop",
+			nnames, nnames == 1 ? "" : "s");
+	if (rate > 0)
+		printf("lookups:   %llu in %.2fs, %.1f/s (target %.1f/s)\n",
+				(unsigned long long)total.lookups, secs,
+				total.lookups / secs, rate);
+	else
+		printf("lookups:   %llu in %.2fs, %.1f/s\n",
+				(unsigned long long)total.lookups, secs,
+				total.lookups / secs);
+	printf("latency:   mean %.1fus p50 %.1fus p90 %.1fus p99 %.1fus "
+			"p99.9 %.1fus max %.1fus\n",
+			total.sum / total.lookups / 1e3,
+			hist_percentile(total.hist, total.lookups, 50) / 1e3,
+			hist_percentile(total.hist, total.lookups, 90) / 1e3,
+			hist_percentile(total.hist, total.lookups, 99) / 1e3,
+			hist_percentile(total.hist, total.lookups, 99.9) / 1e3,
+			total.max / 1e3);
+	printf("results:  ");
+	for (j = 0; j < MAXERRS; j++)
+		if (total.errs[j] > 0)
+			printf(" %s %llu (%.2f%%)", errname(j),
+					(unsigned long long)total.errs[j],
+					100.0 * total.errs[j] / total.lookups);
+	printf("\n");
+	for (calls = 0, j = 0; j < SC_COUNT; j++)
+		calls += total.syscalls[j];
+	printf("syscalls:  %.2f per lookup", (double)calls / total.lookups);
+	for (j = 0; j < SC_COUNT; j++)
+		if (total.syscalls[j] > 0)
+			printf(", %s %.3g", scnames[j],
+					(double)total.syscalls[j] / total.lookups);
+	printf("\n");
+
+	if (hist) {
+		/* in the format of HdrHistogram's percentile distribution */
+		printf("\n%12s %14s %10s %14s\n\n",
+				"Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+		for (seen = 0, j = 0; j < HIST_SIZE; j++) {
+			if (total.hist[j] == 0)
+				continue;
+			seen += total.hist[j];
+			if (seen < total.lookups)
+				printf("%12.3f %14.12f %10llu %14.2f\n",
+						hist_value(j) / 1e3, (double)seen / total.lookups,
+						(unsigned long long)seen,
+						1.0 / (1.0 - (double)seen / total.lookups));
+			else
+				printf("%12.3f %14.12f %10llu\n",
+						hist_value(j) / 1e3, 1.0, (unsigned long long)seen);
 		}
+		printf("#[Mean    = %12.3f, Max     = %12.3f]\n",
+				total.sum / total.lookups / 1e3, total.max / 1e3);
+		printf("#[Total count    = %12llu]\n",
+				(unsigned long long)total.lookups);
+		printf("# values in usec\n");
 	}
-	printf("dups: %zd\n", dups);
 
 	return 0;
 }
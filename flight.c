@@ -0,0 +1,195 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* coalescing of concurrent lookups
+ *
+ * When many threads look up the same name at once, e.g. when a hot name
+ * expires, only the first (the leader) queries the servers, the others
+ * wait for its outcome, each no longer than its own query could have
+ * taken.  Queries in flight are keyed by name and group id (pool and
+ * query types), in shards guarded by a mutex and a condition each, the
+ * leader wakes all waiters of its shard when it lands.  A flight is
+ * freed by whoever is last to let go of it. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "dnspq.h"
+#include "flight.h"
+
+#ifndef FLIGHT_SHARD_BITS
+# define FLIGHT_SHARD_BITS  4
+#endif
+#define FLIGHT_SHARDS  (1 << FLIGHT_SHARD_BITS)
+#define FLIGHT_SHARD(hash)  (&flights[(hash) >> (32 - FLIGHT_SHARD_BITS)])
+
+struct _flight {
+	uint32_t hash;
+	uint32_t gid;
+	int refs;            /* the leader and the waiters */
+	char landed;
+	int err;
+	struct dnsq_answer ans;
+	struct _flight *next;
+	char name[256];
+};
+
+typedef struct _flight_shard {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	flight *head;        /* the flights that didn't land yet */
+} flight_shard;
+
+static flight_shard flights[FLIGHT_SHARDS];
+static pthread_once_t flightonce = PTHREAD_ONCE_INIT;
+
+static void flight_shards(void) {
+	pthread_condattr_t ca;
+	int i;
+
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	for (i = 0; i < FLIGHT_SHARDS; i++) {
+		pthread_mutex_init(&flights[i].lock, NULL);
+		pthread_cond_init(&flights[i].cond, &ca);
+		flights[i].head = NULL;
+	}
+	pthread_condattr_destroy(&ca);
+}
+
+/* the threads running the flights don't exist in a forked child, nor
+ * may the locks they held */
+static void flight_child(void) {
+	flight_shards();
+}
+
+static void flight_init(void) {
+	flight_shards();
+	pthread_atfork(NULL, NULL, flight_child);
+}
+
+static void flight_release(flight *f) {
+	if (--f->refs == 0)
+		free(f);
+}
+
+/* the flight for name (hash is cache_hash(name)) in group gid, joined
+ * when there is one, or else started, with leader set; the leader must
+ * query the servers and flight_land() the outcome, the others
+ * flight_wait() for it; NULL with leader unset when out of memory */
+flight *flight_join(
+		const char *name,
+		uint32_t hash,
+		uint32_t gid,
+		char *leader)
+{
+	flight_shard *s;
+	flight *f;
+	size_t len;
+
+	*leader = 0;
+	if ((len = strlen(name)) >= sizeof(f->name))
+		return NULL;
+	pthread_once(&flightonce, flight_init);
+	s = FLIGHT_SHARD(hash);
+
+	pthread_mutex_lock(&s->lock);
+	for (f = s->head; f != NULL; f = f->next) {
+		if (f->hash == hash && f->gid == gid &&
+				strcasecmp(f->name, name) == 0)
+		{
+			f->refs++;
+			pthread_mutex_unlock(&s->lock);
+			*leader = 0;
+			return f;
+		}
+	}
+	if ((f = malloc(sizeof(*f))) != NULL) {
+		f->hash = hash;
+		f->gid = gid;
+		f->refs = 1;
+		f->landed = 0;
+		memcpy(f->name, name, len + 1);
+		f->next = s->head;
+		s->head = f;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	/* without a flight the caller queries on its own, landing nothing */
+	*leader = f != NULL;
+	return f;
+}
+
+/* the leader hands out the outcome of its query, err and ans like
+ * dnsq_ctx_query(), lookups starting from now on start a new flight */
+void flight_land(flight *f, int err, const struct dnsq_answer *ans) {
+	flight_shard *s;
+	flight **fp;
+
+	if (f == NULL)
+		return;
+	s = FLIGHT_SHARD(f->hash);
+	pthread_mutex_lock(&s->lock);
+	for (fp = &s->head; *fp != NULL; fp = &(*fp)->next) {
+		if (*fp == f) {
+			*fp = f->next;
+			break;
+		}
+	}
+	f->err = err;
+	f->ans = *ans;
+	f->landed = 1;
+	if (f->refs > 1)
+		pthread_cond_broadcast(&s->cond);
+	flight_release(f);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* wait ms milliseconds at most for the leader of f, returns the error
+ * it got, filling in ans, or -1 when it didn't land in time */
+int flight_wait(flight *f, unsigned int ms, struct dnsq_answer *ans) {
+	flight_shard *s = FLIGHT_SHARD(f->hash);
+	struct timespec end;
+	int err = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += ms / 1000;
+	end.tv_nsec += (long)(ms % 1000) * 1000 * 1000;
+	if (end.tv_nsec >= 1000 * 1000 * 1000) {
+		end.tv_sec++;
+		end.tv_nsec -= 1000 * 1000 * 1000;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	while (!f->landed &&
+			pthread_cond_timedwait(&s->cond, &s->lock, &end) != ETIMEDOUT)
+		;
+	if (f->landed) {
+		err = f->err;
+		*ans = f->ans;
+	}
+	flight_release(f);
+	pthread_mutex_unlock(&s->lock);
+
+	return err;
+}
@@ -0,0 +1,33 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+
+/* ms a lookup waits at most for the query of another one, as long as
+ * its own query could have taken */
+#ifndef FLIGHT_TIMEOUT
+# define FLIGHT_TIMEOUT  500
+#endif
+
+struct dnsq_answer;
+typedef struct _flight flight;
+
+flight *flight_join(const char *name, uint32_t hash, uint32_t gid,
+		char *leader);
+void flight_land(flight *f, int err, const struct dnsq_answer *ans);
+int flight_wait(flight *f, unsigned int ms, struct dnsq_answer *ans);
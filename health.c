@@ -0,0 +1,259 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* per-server health tracking
+ *
+ * Every server queried gets a slot in a process-wide table, keyed by
+ * its address, holding counters and a smoothed round trip time.  After
+ * HEALTH_FAILS consecutive failures (error responses or timeouts) the
+ * circuit for the server opens, and it is no longer sent queries.  Each
+ * HEALTH_OPEN_TIME one query is let through as a probe, an answer to it
+ * closes the circuit again.  Round trip times are also kept in a
+ * histogram with buckets growing by a factor sqrt(2), which is halved
+ * every HEALTH_RTT_WINDOW samples, such that percentiles follow the
+ * recent behaviour of the server.  Slots are claimed lock-free and never
+ * released, all updates are relaxed atomics, the numbers are
+ * statistics and need not be exact. */
+
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "dnspq.h"
+#include "health.h"
+
+#ifndef HEALTH_FAILS
+# define HEALTH_FAILS  3  /* consecutive failures opening the circuit */
+#endif
+#ifndef HEALTH_OPEN_TIME
+# define HEALTH_OPEN_TIME  2000  /* 2s, time between probes of open circuits */
+#endif
+#ifndef HEALTH_RTT_WINDOW
+# define HEALTH_RTT_WINDOW  1024  /* samples before the histogram decays */
+#endif
+
+/* moved into the stats segment by health_table(), if there is one */
+static health_server healthbuf[HEALTH_SLOTS];
+static health_server *healthtab = healthbuf;
+
+/* milliseconds, coarse is good enough for circuits open for seconds */
+static inline int64_t health_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t health_key(const struct sockaddr_in *srv) {
+	return (1ULL << 48) |
+		((uint64_t)srv->sin_addr.s_addr << 16) | srv->sin_port;
+}
+
+/* keep the table in tab from now on, copying what was seen so far,
+ * must be called before any queries are in flight */
+void health_table(health_server *tab) {
+	memcpy(tab, healthtab, sizeof(health_server) * HEALTH_SLOTS);
+	healthtab = tab;
+}
+
+/* the slot for srv, claiming a free one for servers not seen before,
+ * NULL when the table is full */
+health_server *health_get(const struct sockaddr_in *srv) {
+	uint64_t key = health_key(srv);
+	uint64_t cur;
+	health_server *h;
+	unsigned int i;
+	unsigned int slot = (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+
+	for (i = 0; i < HEALTH_SLOTS; i++) {
+		h = &healthtab[(slot + i) & (HEALTH_SLOTS - 1)];
+		cur = __atomic_load_n(&h->key, __ATOMIC_ACQUIRE);
+		if (cur == 0 && __atomic_compare_exchange_n(&h->key, &cur, key,
+					0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return h;
+		if (cur == key)
+			return h;
+	}
+	return NULL;
+}
+
+/* whether a query should be sent to the server, an open circuit lets a
+ * single caller through as probe every HEALTH_OPEN_TIME */
+int health_usable(health_server *h) {
+	int64_t open;
+	int64_t now;
+
+	if (h == NULL ||
+			(open = __atomic_load_n(&h->openuntil, __ATOMIC_RELAXED)) == 0)
+		return 1;
+	if ((now = health_now()) < open)
+		return 0;
+	return __atomic_compare_exchange_n(&h->openuntil, &open,
+			now + HEALTH_OPEN_TIME, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void health_rtt_sample(health_server *h, unsigned int rtt) {
+	int b;
+
+	__atomic_add_fetch(&h->rtthist[health_bucket(rtt)], 1, __ATOMIC_RELAXED);
+	if (__atomic_add_fetch(&h->rttsamples, 1, __ATOMIC_RELAXED) !=
+			HEALTH_RTT_WINDOW)
+		return;
+	/* only the one hitting the window decays, samples coming in
+	 * meanwhile may get halved or not, it doesn't matter */
+	for (b = 0; b < HEALTH_RTT_BUCKETS; b++)
+		__atomic_store_n(&h->rtthist[b],
+				__atomic_load_n(&h->rtthist[b], __ATOMIC_RELAXED) / 2,
+				__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&h->rttsamples, HEALTH_RTT_WINDOW, __ATOMIC_RELAXED);
+}
+
+/* the round trip time percentiles (in permille) over the servers in hs
+ * combined, out is set to the upper bound of the bucket holding each,
+ * returns the number of samples they are based on */
+unsigned int health_percentiles(
+		health_server *const hs[],
+		int n,
+		const unsigned int permille[],
+		unsigned int out[],
+		int cnt)
+{
+	unsigned int hist[HEALTH_RTT_BUCKETS];
+	unsigned int total = 0;
+	unsigned int sum;
+	int b;
+	int i;
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < n; i++) {
+		if (hs[i] == NULL)
+			continue;
+		for (b = 0; b < HEALTH_RTT_BUCKETS; b++)
+			hist[b] += __atomic_load_n(&hs[i]->rtthist[b], __ATOMIC_RELAXED);
+	}
+	for (b = 0; b < HEALTH_RTT_BUCKETS; b++)
+		total += hist[b];
+
+	for (i = 0; i < cnt; i++) {
+		out[i] = 0;
+		if (total == 0)
+			continue;
+		for (b = 0, sum = 0; b < HEALTH_RTT_BUCKETS - 1; b++)
+			if ((sum += hist[b]) * 1000ULL >= (unsigned long long)total *
+					permille[i])
+				break;
+		out[i] = health_bucket_max(b);
+	}
+
+	return total;
+}
+
+/* smoothed round trip time in usec, 0 when unknown */
+unsigned int health_rtt(health_server *h) {
+	return h == NULL ? 0 : __atomic_load_n(&h->rtt, __ATOMIC_RELAXED);
+}
+
+void health_sent(health_server *h) {
+	if (h != NULL)
+		__atomic_add_fetch(&h->queries, 1, __ATOMIC_RELAXED);
+}
+
+/* a question sent again, after the server didn't answer in time */
+void health_retry(health_server *h) {
+	if (h != NULL)
+		__atomic_add_fetch(&h->retries, 1, __ATOMIC_RELAXED);
+}
+
+/* the answer of the server is the one used */
+void health_win(health_server *h) {
+	if (h != NULL)
+		__atomic_add_fetch(&h->wins, 1, __ATOMIC_RELAXED);
+}
+
+/* a response that isn't a proper answer to the question */
+void health_parseerr(health_server *h) {
+	if (h != NULL)
+		__atomic_add_fetch(&h->parseerrs, 1, __ATOMIC_RELAXED);
+}
+
+/* a valid response, rtt in usec, 0 when unknown */
+void health_answer(health_server *h, unsigned int rtt) {
+	unsigned int cur;
+
+	if (h == NULL)
+		return;
+	__atomic_add_fetch(&h->answers, 1, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&h->fails, __ATOMIC_RELAXED) != 0)
+		__atomic_store_n(&h->fails, 0, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&h->openuntil, __ATOMIC_RELAXED) != 0)
+		__atomic_store_n(&h->openuntil, 0, __ATOMIC_RELAXED);
+	if (rtt != 0) {
+		/* gain of 1/8, like TCP's SRTT */
+		cur = __atomic_load_n(&h->rtt, __ATOMIC_RELAXED);
+		cur = cur == 0 ? rtt : cur - (cur >> 3) + (rtt >> 3);
+		__atomic_store_n(&h->rtt, cur, __ATOMIC_RELAXED);
+		health_rtt_sample(h, rtt);
+	}
+}
+
+static void health_fail(health_server *h) {
+	if (__atomic_add_fetch(&h->fails, 1, __ATOMIC_RELAXED) >= HEALTH_FAILS)
+		__atomic_store_n(&h->openuntil, health_now() + HEALTH_OPEN_TIME,
+				__ATOMIC_RELAXED);
+}
+
+/* a response with an error RCODE (SERVFAIL, REFUSED, ...) */
+void health_rcodefail(health_server *h) {
+	if (h == NULL)
+		return;
+	__atomic_add_fetch(&h->rcodefails, 1, __ATOMIC_RELAXED);
+	health_fail(h);
+}
+
+/* no response within the time we were waiting for one */
+void health_timeout(health_server *h) {
+	if (h == NULL)
+		return;
+	__atomic_add_fetch(&h->timeouts, 1, __ATOMIC_RELAXED);
+	health_fail(h);
+}
+
+int dnsq_server_stats(
+		const struct sockaddr_in *srv,
+		struct dnsq_server_stats *st)
+{
+	health_server *h;
+	uint64_t key = health_key(srv);
+	int i;
+
+	for (i = 0; i < HEALTH_SLOTS; i++) {
+		h = &healthtab[i];
+		if (__atomic_load_n(&h->key, __ATOMIC_ACQUIRE) != key)
+			continue;
+		st->queries = __atomic_load_n(&h->queries, __ATOMIC_RELAXED);
+		st->answers = __atomic_load_n(&h->answers, __ATOMIC_RELAXED);
+		st->wins = __atomic_load_n(&h->wins, __ATOMIC_RELAXED);
+		st->retries = __atomic_load_n(&h->retries, __ATOMIC_RELAXED);
+		st->parseerrs = __atomic_load_n(&h->parseerrs, __ATOMIC_RELAXED);
+		st->rcodefails = __atomic_load_n(&h->rcodefails, __ATOMIC_RELAXED);
+		st->timeouts = __atomic_load_n(&h->timeouts, __ATOMIC_RELAXED);
+		st->rtt = __atomic_load_n(&h->rtt, __ATOMIC_RELAXED);
+		st->open = __atomic_load_n(&h->openuntil, __ATOMIC_RELAXED) != 0;
+		return 0;
+	}
+	return 1;
+}
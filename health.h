@@ -0,0 +1,69 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+
+#ifndef HEALTH_SLOTS
+# define HEALTH_SLOTS  64  /* servers tracked, must be a power of 2 */
+#endif
+#define HEALTH_RTT_BUCKETS  40  /* up to 2^20us, ~1s */
+
+struct sockaddr_in;
+
+/* public such that dnspq-stats can read the table in a stats segment */
+typedef struct _health_server {
+	uint64_t key;            /* address and port, 0 for unused */
+	unsigned long queries;
+	unsigned long answers;
+	unsigned long wins;      /* answers that were used */
+	unsigned long retries;   /* questions sent again */
+	unsigned long rcodefails;
+	unsigned long parseerrs; /* responses not making sense */
+	unsigned long timeouts;
+	unsigned int rtt;        /* EWMA of the round trip time in usec */
+	unsigned int fails;      /* consecutive failures */
+	int64_t openuntil;       /* ms, circuit is open until then, 0 if closed */
+	unsigned int rttsamples; /* since the last decay */
+	unsigned int rtthist[HEALTH_RTT_BUCKETS];
+} health_server;
+
+/* bucket b holds [2^(b/2), 1.5 * 2^(b/2)) for even b, and
+ * [1.5 * 2^(b/2), 2^(b/2 + 1)) for odd b */
+static inline int health_bucket(unsigned int v) {
+	int l = 31 - __builtin_clz(v | 1);
+	int b = 2 * l + (l > 0 ? (v >> (l - 1)) & 1 : 0);
+	return b < HEALTH_RTT_BUCKETS ? b : HEALTH_RTT_BUCKETS - 1;
+}
+
+static inline unsigned int health_bucket_max(int b) {
+	return b & 1 ? 1U << (b / 2 + 1) : 3U << (b / 2) >> 1;
+}
+
+void health_table(health_server *tab);
+health_server *health_get(const struct sockaddr_in *srv);
+int health_usable(health_server *h);
+unsigned int health_rtt(health_server *h);
+unsigned int health_percentiles(health_server *const hs[], int n,
+		const unsigned int permille[], unsigned int out[], int cnt);
+void health_sent(health_server *h);
+void health_retry(health_server *h);
+void health_win(health_server *h);
+void health_parseerr(health_server *h);
+void health_answer(health_server *h, unsigned int rtt);
+void health_rcodefail(health_server *h);
+void health_timeout(health_server *h);
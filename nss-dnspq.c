@@ -22,9 +22,16 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <errno.h>
 #include <nss.h>
 #include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 
 #ifdef LOGGING
@@ -32,270 +39,582 @@
 #endif
 
 #include "dnspq.h"
+#include "cache.h"
+#include "shmcache.h"
+#include "config.h"
+#include "stats.h"
+#include "daemon.h"
+#include "flight.h"
+#include "probes.h"
 
-#ifndef RESOLV_CONF
-#define RESOLV_CONF "/etc/resolv-dnspq.conf"
+PROBE_SEMAPHORE(pool);
+PROBE_SEMAPHORE(cache__hit);
+PROBE_SEMAPHORE(lookup__start);
+PROBE_SEMAPHORE(lookup__done);
+
+/* seconds a replaced config is kept around, lookups using it must have
+ * finished by then, they take MAX_TIMEOUT plus stale-timeout at most */
+#ifndef RELOAD_GRACE
+#define RELOAD_GRACE 60
+#endif
+/* refreshes a thread has outstanding at most, more are skipped */
+#ifndef REFRESH_MAX
+#define REFRESH_MAX 16
 #endif
 
-typedef struct _domaingroup {
-	char *domain;
-	struct _domaingroup *next;
-	size_t poolcount;
-	struct sockaddr_in **dnsservers;
-} domaingroup;
+/* The config in use.  A reload builds a new one and swaps it in, such
+ * that lookups never take a lock and never see a partial one.  The old
+ * one is freed once no lookup can be using it anymore, the pointers
+ * into it are only used for the duration of a query. */
+static dnspq_config *pools = NULL;
+static dnspq_config *retiredpools = NULL;
+static pthread_once_t configonce = PTHREAD_ONCE_INIT;
+static time_t nextcheck = 0;
+static char reloading = 0;
 
-static domaingroup *rpool = NULL;
+static dnspq_options opts;
 
-#ifdef DEBUG
-void debugconfig(void) {
-	domaingroup *walk;
-	struct sockaddr_in *swalk;
-	int i;
+/* library init, on the first lookup, such that processes that never
+ * resolve anything don't pay for it */
+static void readconfig(void) {
+#ifdef LOGGING
+	openlog("dnspq", LOG_PID, LOG_USER);
+	syslog(LOG_INFO, "nss-dnspq.so.2 v" VERSION " (" GIT_VERSION ") has been invoked");
+#endif
 
-	for (walk = rpool; walk != NULL; walk = walk->next) {
-		printf("\"%s\": %zd\n",
-				walk->domain ? walk->domain : "(cont)", walk->poolcount);
-		for (i = 0, swalk = walk->dnsservers[i]; swalk != NULL; swalk = walk->dnsservers[++i]) {
-			printf("    %s:%d\n", inet_ntoa(swalk->sin_addr), htons(swalk->sin_port));
-		}
+	pools = config_read();
+	config_options(pools, &opts);
+
+	dnsq_set_timing(opts.timing);
+	dnsq_set_edns(opts.edns);
+	cache_init(opts.cache_size, opts.refresh_ahead);
+	if (opts.shm_cache != NULL &&
+			shmcache_open(opts.shm_cache, opts.shm_cache_size) != 0)
+	{
+#ifdef LOGGING
+		syslog(LOG_INFO, "failed to open shared cache %s", opts.shm_cache);
+#endif
 	}
-}
+	if (opts.stats_prefix != NULL && stats_open(opts.stats_prefix) != 0) {
+#ifdef LOGGING
+		syslog(LOG_INFO, "failed to open stats segment %s", opts.stats_prefix);
 #endif
+	}
+}
 
-/* library init */
-/* read the config file and build up the structure per domain */
-#ifndef DEBUG
-__attribute__((constructor))
-#endif
-void readconfig(void) {
-	FILE *resolvconf = NULL;
-	int j, k;
-	char buf[1024];
-	domaingroup *tdg = NULL;
-	domaingroup *ndg = NULL;
-	char *p = NULL;
-	struct sockaddr_in *dnsservers[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-	struct sockaddr_in *dnsserver = NULL;
-	int dnsi = 0;
-	char *fps[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-	int port;
+/* the pools in use, once every reload-interval seconds one lookup
+ * checks whether the config file changed, and if so, loads it; only
+ * the pools are reloaded, the options are taken at startup */
+static dnspq_config *getpools(void) {
+	dnspq_config *t;
+	dnspq_config *nt;
+	dnspq_config **rp;
+	struct timespec ts;
+	struct stat st;
+	time_t next;
+
+	pthread_once(&configonce, readconfig);
+	t = __atomic_load_n(&pools, __ATOMIC_ACQUIRE);
+	if (opts.reload_interval == 0)
+		return t;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	next = __atomic_load_n(&nextcheck, __ATOMIC_RELAXED);
+	if (ts.tv_sec < next ||
+			!__atomic_compare_exchange_n(&nextcheck, &next,
+				ts.tv_sec + opts.reload_interval, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+			__atomic_exchange_n(&reloading, 1, __ATOMIC_ACQUIRE) != 0)
+		return t;
 
+	/* a rename over the file changes the inode, an edit in place the
+	 * mtime, or at least the size; the compiled file takes precedence
+	 * unless the text one is newer */
+	if (config_pick(&st) != NULL &&
+			(t == NULL || !config_from(t, &st)) &&
+			(nt = config_read()) != NULL)
+	{
 #ifdef LOGGING
-	openlog("dnspq", LOG_PID, LOG_USER);
-	syslog(LOG_INFO, "nss-dnspq.so.2 v" VERSION " (" GIT_VERSION ") has been invoked");
+		syslog(LOG_INFO, "reloaded " RESOLV_CONF);
 #endif
-
-	/* don't use time to avoid same sequence when multiple processes
-	 * start at the same time */
-	srand(getpid());
-
-	/* .domain ip:port ip:port ...
-	 * or
-	 * nameserver ip 
-	 *
-	 * The first form creates a group of DNS servers to query for the
-	 * domain.  The leading . is mandatory here (to distinguish easily).
-	 * The second form is to facilitate traditional /etc/resolv.conf
-	 * files.  Interleaving both forms is NOT supported.
-	 */
-
-	if ((resolvconf = fopen(RESOLV_CONF, "r")) == NULL)
-		return;
-	while (fgets(buf, sizeof(buf), resolvconf) != NULL)
-		if (
-				buf[0] == 'n' &&
-				buf[1] == 'a' &&
-				buf[2] == 'm' &&
-				buf[3] == 'e' &&
-				buf[4] == 's' &&
-				buf[5] == 'e' &&
-				buf[6] == 'r' &&
-				buf[7] == 'v' &&
-				buf[8] == 'e' &&
-				buf[9] == 'r' &&
-				buf[10] == ' ')
-		{ /* traditional /etc/resolv.conf mode */
-			if (dnsi == sizeof(dnsservers) - 1)
-				continue;
-			if ((p = strchr(buf + 11, '\n')) != NULL)
-				*p = '\0';
-			dnsserver = dnsservers[dnsi++] = malloc(sizeof(*dnsserver));
-			if (inet_pton(AF_INET, buf + 11, &(dnsserver->sin_addr)) <= 0) {
-				free(dnsserver);
-				dnsserver = dnsservers[dnsi--] = NULL;
-				continue;
-			}
-			dnsserver->sin_family = AF_INET;
-			dnsserver->sin_port = htons(53);
-		} else if (buf[0] == '.') { /* group mode */
-			p = buf + 1;
-			dnsi = 0;
-			while (dnsi < sizeof(fps) && (p = strchr(p, ' ')) != NULL) {
-				*p++ = '\0';
-				fps[dnsi] = p;
-				dnsi++;
-			}
-			if (dnsi == 0)
-				continue;
-			if ((p = strchr(fps[dnsi - 1], '\n')) != NULL)
-				*p = '\0';
-			k = -1;
-			if (rpool == NULL) {
-				tdg = rpool = malloc(sizeof(domaingroup));
-				tdg->next = NULL;
-			} else {
-				ndg = NULL;
-				for (tdg = rpool; ; tdg = tdg->next) {
-					if (tdg->domain != NULL &&
-							strcmp(tdg->domain, buf + 1) == 0)
-					{
-						/* randomise insertion */
-						tdg->poolcount++;
-						k = rand() % tdg->poolcount;
-						if (k == 0) {
-							tdg = ndg;
-						} else {
-							for (j = 1; j < k; j++)
-								tdg = tdg->next;
-						}
-						break;
-					}
-					if (tdg->next == NULL)
-						break;
-					ndg = tdg;
-				}
-				ndg = malloc(sizeof(domaingroup));
-				if (tdg == NULL) {
-					ndg->next = rpool;
-					tdg = rpool = ndg;
-				} else {
-					ndg->next = tdg->next;
-					tdg = tdg->next = ndg;
-				}
-			}
-			if (k == -1) {
-				tdg->domain = strdup(buf + 1);
-				tdg->poolcount = 1;
-			} else if (k == 0) {
-				tdg->domain = tdg->next->domain;
-				tdg->poolcount = tdg->next->poolcount;
-				tdg->next->domain = NULL;
-				tdg->next->poolcount = 0;
-			} else {
-				tdg->domain = NULL;
-				tdg->poolcount = 0;
-			}
-			tdg->dnsservers = malloc(sizeof(*dnsserver) * (dnsi + 1));
-			for (j = 0, k = 0; j < dnsi; j++) {
-				dnsserver = tdg->dnsservers[k++] = malloc(sizeof(*dnsserver));
-				port = 0;
-				if ((p = strchr(fps[j], ':')) != NULL) {
-					*p++ = '\0';
-					port = atoi(p);
-				}
-				if (inet_pton(AF_INET, fps[j], &(dnsserver->sin_addr)) <= 0) {
-					free(dnsserver);
-					dnsserver = tdg->dnsservers[--k] = NULL;
-					continue;
-				}
-				dnsserver->sin_family = AF_INET;
-				dnsserver->sin_port = htons(port == 0 ? 53 : port);
-			}
-			tdg->dnsservers[k] = NULL;
-			dnsi = 0;
+		__atomic_store_n(&pools, nt, __ATOMIC_RELEASE);
+		if (t != NULL) {
+			t->retired = ts.tv_sec;
+			t->nextretired = retiredpools;
+			retiredpools = t;
 		}
-	fclose(resolvconf);
+		t = nt;
+	}
 
-	if (dnsi > 0) {
-		/* create fallback group for traditional mode */
-		if (rpool == NULL) {
-			tdg = rpool = malloc(sizeof(domaingroup));
+	/* tables retired long enough ago can't be in use anymore */
+	for (rp = &retiredpools; *rp != NULL; ) {
+		if ((*rp)->retired + RELOAD_GRACE <= ts.tv_sec) {
+			nt = *rp;
+			*rp = nt->nextretired;
+			config_free(nt);
 		} else {
-			for (tdg = rpool; tdg->next != NULL; tdg = tdg->next)
-				;
-			tdg = tdg->next = malloc(sizeof(domaingroup));
+			rp = &(*rp)->nextretired;
 		}
-		tdg->domain = NULL;
-		tdg->next = NULL;
-		tdg->dnsservers = malloc(sizeof(*dnsserver) * (dnsi + 1));
-		memcpy(tdg->dnsservers, dnsservers, sizeof(*dnsserver) * (dnsi + 1));
 	}
+
+	__atomic_store_n(&reloading, 0, __ATOMIC_RELEASE);
+	return t;
 }
 
-/* strcmp at the tail of a string, either start, or from a dot */
-static inline int tailcmp(const char *haystack, const char *needle) {
-	size_t nl = strlen(needle);
-	size_t hl = strlen(haystack);
-	const char *p;
-	if (nl < hl) {
-		p = haystack + hl - nl - 1;
-		if (*p++ == '.') {
-			for (; *p != '\0' && *p == *needle; p++, needle++)
-				;
-			if (*p == '\0')
-				return 0;
-		}
+/* providers are rotated using a per thread counter, such that threads
+ * don't contend on a shared one, each starting at a random provider */
+static __thread unsigned int rrcnt = 0;
+static __thread unsigned int shufseed = 0;
+
+/* helper function to locate the set of nameservers for the given
+ * domain, see config_servers(), and the counters of its pool */
+static inline char get_dnss_for_domain(
+		struct sockaddr_in *dnsservers[],
+		uint32_t *gid,
+		stats_pool **sp,
+		const char *name)
+{
+	dnspq_config *c = getpools();
+
+	int n;
+
+	if (c == NULL || !config_servers(c, name, dnsservers, gid, &rrcnt))
+		return 0;
+	if (PROBE_ENABLED(pool)) {
+		for (n = 0; dnsservers[n] != NULL; n++)
+			;
+		PROBE3(pool, name, *gid, n);
 	}
+	if ((*sp = stats_pool_get(*gid)) != NULL &&
+			__atomic_load_n(&(*sp)->domain[0], __ATOMIC_ACQUIRE) == '\0')
+		stats_pool_name(*sp, config_domain(c, *gid));
 	return 1;
 }
 
-/* helper function to locate the set of nameservers for the given domain */
-static inline char get_dnss_for_domain(
-		struct sockaddr_in ***dnsservers,
-		const char *name)
+/* store the outcome of a query in the caches, for records (err 0) and
+ * negative answers (dnsq errors 12 and 13) */
+static void store(
+		const char *name,
+		uint32_t hash,
+		uint32_t gid,
+		char err,
+		const struct dnsq_answer *ans)
+{
+	unsigned int cttl;
+
+	if (err == 0)
+		cttl = ans->ttl > opts.cache_maxttl ? opts.cache_maxttl : ans->ttl;
+	else
+		cttl = ans->ttl > opts.cache_negmaxttl ? opts.cache_negmaxttl : ans->ttl;
+	if (cttl < opts.cache_minttl)
+		cttl = opts.cache_minttl;
+	cache_insert(name, hash, gid, err == 0 ? ans : NULL, cttl, err);
+	shmcache_insert(name, hash, gid, err == 0 ? ans : NULL, cttl, err);
+}
+
+/* Refreshes of cache entries run in the background, on an async
+ * channel per thread, such that no thread ever waits for another.  The
+ * channel is only looked at by lookups of the same thread, answers
+ * arriving in between are simply buffered by the kernel until then.  A
+ * lookup of a stale entry waits for the refresh for stale-timeout at
+ * most, and serves the stale answer when it takes longer or fails, as
+ * do the lookups of the same name waiting for it. */
+typedef struct _refresh_wait {
+	char done;
+	int err;
+	struct dnsq_answer *ans;
+} refresh_wait;
+
+typedef struct _refresh {
+	uint32_t hash;
+	uint32_t gid;
+	refresh_wait *wait;  /* the lookup awaiting the answer, if any */
+	char name[256];
+} refresh;
+
+static pthread_key_t refreshkey;
+static pthread_once_t refreshonce = PTHREAD_ONCE_INIT;
+static __thread dnsq_async *refresher = NULL;
+static __thread unsigned int refreshergen = 0;
+static __thread int refreshing = 0;  /* refreshes outstanding */
+static unsigned int refreshgen = 1;  /* bumped in the child of a fork */
+
+static void refresh_key_free(void *as) {
+	dnsq_async_free(as);
+}
+
+static void refresh_atfork_child(void) {
+	refreshgen++;
+}
+
+static void refresh_init(void) {
+	pthread_key_create(&refreshkey, refresh_key_free);
+	pthread_atfork(NULL, NULL, refresh_atfork_child);
+}
+
+static void refresh_done(void *arg, int err, struct dnsq_answer *ans) {
+	refresh *r = arg;
+
+	refreshing--;
+	if (ans != NULL)
+		store(r->name, r->hash, r->gid, (char)err, ans);
+	if (r->wait != NULL) {
+		if (ans != NULL)
+			*r->wait->ans = *ans;
+		r->wait->err = err;
+		r->wait->done = 1;
+	}
+	free(r);
+}
+
+/* the async channel of this thread, sharing the buffers of its query
+ * context, after a fork the child must not pick up the answers for the
+ * parent */
+static dnsq_async *refresh_channel(void) {
+	dnsq_ctx *ctx;
+
+	pthread_once(&refreshonce, refresh_init);
+	if (refresher != NULL && refreshergen != refreshgen) {
+		dnsq_async_free(refresher);
+		refresher = NULL;
+	}
+	if (refresher == NULL) {
+		if ((ctx = dnsq_ctx_thread()) == NULL ||
+				(refresher = dnsq_async_new_ctx(ctx, REFRESH_MAX)) == NULL)
+			return NULL;
+		refreshergen = refreshgen;
+		pthread_setspecific(refreshkey, refresher);
+	}
+	return refresher;
+}
+
+static refresh *refresh_start(
+		struct sockaddr_in **dnsservers,
+		uint32_t hash,
+		uint32_t gid,
+		const char *name,
+		refresh_wait *wait)
+{
+	dnsq_async *as;
+	refresh *r;
+	size_t len;
+
+	if ((as = refresh_channel()) == NULL ||
+			(len = strlen(name)) >= sizeof(r->name) ||
+			(r = malloc(sizeof(*r))) == NULL)
+		return NULL;
+	r->hash = hash;
+	r->gid = gid;
+	r->wait = wait;
+	memcpy(r->name, name, len + 1);
+	if (dnsq_async_submit(as, dnsservers, r->name,
+				gid & DNSQ_QTYPES, refresh_done, r) == 0)
+	{
+		free(r);
+		return NULL;
+	}
+	refreshing++;
+
+	return r;
+}
+
+/* wait for the refresh r for ms milliseconds at most, returns whether
+ * it completed */
+static int refresh_await(refresh *r, unsigned int ms) {
+	refresh_wait *w = r->wait;
+	struct pollfd pfd;
+	struct timeval tv;
+	struct timespec now;
+	int64_t end;
+	int64_t left;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	end = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + ms;
+	pfd.fd = dnsq_async_fd(refresher);
+	pfd.events = POLLIN;
+	while (!w->done &&
+			dnsq_async_timeout(refresher, &tv) != NULL)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((left = end - ((int64_t)now.tv_sec * 1000 +
+						now.tv_nsec / 1000000)) <= 0)
+			break;
+		if ((int64_t)tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000 < left)
+			left = (int64_t)tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		poll(&pfd, 1, (int)left);
+		dnsq_async_process(refresher);
+	}
+	if (!w->done)
+		r->wait = NULL;  /* it completes later on, without us */
+	return w->done;
+}
+
+/* resolve the records of qtypes (DNSQ_A and/or DNSQ_AAAA) for name,
+ * from the caches if possible, querying the servers if not, the
+ * in-process cache is consulted first, then the shared one, then the
+ * daemon, which refreshes and serves stale answers on its own;
+ * negative answers (dnsq errors 12 and 13) are cached too; concurrent
+ * lookups of the same name share the query of the first */
+static int lookup(
+		struct sockaddr_in **dnsservers,
+		uint32_t gid,
+		stats_pool *sp,
+		int qtypes,
+		const char *name,
+		struct dnsq_answer *ans)
+{
+	dnsq_ctx *ctx;
+	char err;
+	uint32_t hash;
+	struct dnsq_answer stale;
+	char staleerr = 0;
+	refresh_wait w;
+	refresh *r;
+	flight *f = NULL;
+	char leader = 0;
+	struct timespec begin;
+	struct timespec end;
+	int derr;
+	int c;
+
+	/* pick up the refreshes that completed since the last lookup */
+	if (refreshing > 0 && refreshergen == refreshgen)
+		dnsq_async_process(refresher);
+
+	/* answers for different sets of query types are cached separately,
+	 * the low bits of the group id hold the set */
+	gid = (gid & ~(uint32_t)DNSQ_QTYPES) | qtypes;
+	hash = cache_hash(name);
+	switch (c = cache_lookup(name, hash, gid, ans, &err, opts.serve_stale)) {
+		case CACHE_HIT:
+			PROBE2(cache__hit, name, c);
+			stats_hit(sp, 0);
+			return err;
+		case CACHE_REFRESH:
+			PROBE2(cache__hit, name, c);
+			stats_hit(sp, 0);
+			if (opts.daemon_path == NULL)
+				refresh_start(dnsservers, hash, gid, name, NULL);
+			return err;
+		case CACHE_STALE:
+			stale = *ans;
+			staleerr = err;
+			break;
+	}
+
+	if (shmcache_lookup(name, hash, gid, ans, &err)) {
+		PROBE2(cache__hit, name, 0);
+		stats_hit(sp, 0);
+		cache_insert(name, hash, gid, err == 0 ? ans : NULL, ans->ttl, err);
+		return err;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	if ((f = flight_join(name, hash, gid, &leader)) != NULL && !leader) {
+		derr = flight_wait(f, c == CACHE_STALE ? opts.stale_timeout :
+				opts.daemon_path != NULL ? DAEMON_TIMEOUT : FLIGHT_TIMEOUT, ans);
+		err = derr == -1 ? 1 : (char)derr;
+		goto out;
+	}
+
+	/* the daemon doesn't fall back to TCP for truncated answers, we
+	 * do that ourselves */
+	if (opts.daemon_path != NULL &&
+			(derr = daemon_query(opts.daemon_path, name, qtypes, ans)) != -1 &&
+			derr != 17)
+	{
+		err = (char)derr;
+		if (err == 0 || err == 12 || err == 13)
+			store(name, hash, gid, err, ans);
+		goto out;
+	}
+
+	/* the servers get stale-timeout to answer, the refresh goes on in
+	 * the background when they take longer */
+	if (c == CACHE_STALE) {
+		w.done = 0;
+		w.ans = ans;
+		if ((r = refresh_start(dnsservers, hash, gid, name, &w)) != NULL) {
+			err = refresh_await(r, opts.stale_timeout) ? (char)w.err : 1;
+			goto out;
+		}
+	}
+
+	if ((ctx = dnsq_ctx_thread()) == NULL) {
+		err = 1;
+		goto out;
+	}
+
+	switch (err = dnsq_ctx_query(ctx, dnsservers, name, qtypes, ans)) {
+		case 0:
+		case 12:
+		case 13:
+			store(name, hash, gid, err, ans);
+			break;
+	}
+
+out:
+	if (c == CACHE_STALE && err != 0 && err != 12 && err != 13) {
+		/* the servers failed us, the stale answer is served to all
+		 * lookups for a while, without asking them again */
+		if (f == NULL || leader)
+			cache_stale(name, hash, gid);
+		PROBE2(cache__hit, name, c);
+		stats_hit(sp, 1);
+		*ans = stale;
+		err = staleerr;
+		if (leader)
+			flight_land(f, err, ans);
+		return err;
+	}
+	if (leader)
+		flight_land(f, err, ans);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats_query(sp, err, (unsigned int)((end.tv_sec - begin.tv_sec) * 1000000 +
+				(end.tv_nsec - begin.tv_nsec) / 1000));
+	return err;
+}
+
+/* put the addresses of family af from ans in host, using buf for
+ * storage, returns ERANGE when buf is too small to hold them all; for
+ * an alias, the canonical name becomes h_name, and the name asked for
+ * and the CNAMEs in between h_aliases */
+static int fill_hostent(
+		struct hostent *host,
+		int af,
+		char *buf,
+		size_t buflen,
+		const char *name,
+		size_t nlen,
+		const struct dnsq_answer *ans)
 {
-	domaingroup *w = rpool;
+	size_t pad = -(uintptr_t)buf & (sizeof(char *) - 1);
+	int naddrs = af == AF_INET ? ans->naddrs : ans->naddrs6;
+	size_t alen = af == AF_INET ?
+		sizeof(struct in_addr) : sizeof(struct in6_addr);
+	const char *canon = name;
+	size_t clen = nlen;
+	const char *p;
+	size_t len;
+	int naliases = 0;
+	char *addrs;
+	char *s;
 	int i;
 
-	while (w != NULL) {
-		if (w->domain == NULL) {
-			*dnsservers = w->dnsservers;
-			return 1;
-		} else if (tailcmp(name, w->domain) == 0) {
-			if (w->poolcount > 1) {
-				i = w->next->poolcount;
-				w->next->poolcount = (w->next->poolcount + 1) % w->poolcount;
-				for (; i > 0; i--)
-					w = w->next;
-			}
-			*dnsservers = w->dnsservers;
-			return 1;
-		} else {
-			/* skip over entire pool */
-			for (i = w->poolcount; i > 0; i--)
-				w = w->next;
+	/* the name asked for counts as the first alias, with its length */
+	if (ans->canon[0] != '\0') {
+		canon = ans->canon;
+		clen = strlen(canon);
+		naliases = 1;
+		for (p = canon + clen + 1; *p != '\0'; p += strlen(p) + 1) {
+			naliases++;
+			nlen += strlen(p) + 1;
 		}
 	}
+
+	/* addr pointers, NULL, alias pointers, NULL, addrs, names */
+	if (buflen < pad + (naddrs + naliases + 2) * sizeof(char *) +
+			naddrs * alen + clen + 1 + (naliases != 0 ? nlen + 1 : 0))
+		return ERANGE;
+
+	host->h_addrtype = af;
+	host->h_length = alen;
+	host->h_addr_list = (char **)(buf + pad);
+	host->h_aliases = &host->h_addr_list[naddrs + 1];
+	addrs = (char *)&host->h_aliases[naliases + 1];
+	if (af == AF_INET)
+		memcpy(addrs, ans->addrs, naddrs * alen);
+	else
+		memcpy(addrs, ans->addrs6, naddrs * alen);
+	for (i = 0; i < naddrs; i++)
+		host->h_addr_list[i] = addrs + i * alen;
+	host->h_addr_list[i] = NULL;
+	host->h_name = s = addrs + naddrs * alen;
+	memcpy(s, canon, clen + 1);
+	s += clen + 1;
+	for (i = 0, p = name; i < naliases; i++) {
+		len = strlen(p) + 1;
+		host->h_aliases[i] = memcpy(s, p, len);
+		s += len;
+		p = i == 0 ? canon + clen + 1 : p + len;
+	}
+	host->h_aliases[i] = NULL;
+
 	return 0;
+}
+
+/* Fisher-Yates shuffle of the addresses, for the rotate option */
+static void shuffle(struct dnsq_answer *ans) {
+	struct in_addr t;
+	struct in6_addr t6;
+	int i;
+	int j;
 
+	if (shufseed == 0)
+		shufseed = config_seed() | 1;
+	for (i = ans->naddrs - 1; i > 0; i--) {
+		j = rand_r(&shufseed) % (i + 1);
+		t = ans->addrs[i];
+		ans->addrs[i] = ans->addrs[j];
+		ans->addrs[j] = t;
+	}
+	for (i = ans->naddrs6 - 1; i > 0; i--) {
+		j = rand_r(&shufseed) % (i + 1);
+		t6 = ans->addrs6[i];
+		ans->addrs6[i] = ans->addrs6[j];
+		ans->addrs6[j] = t6;
+	}
 }
 
-enum nss_status _nss_dnspq_gethostbyname3_r(const char *name, int af,
+/* maps a dnsq error from lookup() to the nss return values */
+static enum nss_status lookup_status(
+		int err,
+		const struct dnsq_answer *ans,
+		int *errnop,
+		int *h_errnop,
+		int32_t *ttlp)
+{
+	if (err == 12 || err == 13) {
+		/* the name doesn't exist, or has no records of the type */
+		if (ttlp != NULL)
+			*ttlp = (int32_t)ans->ttl;
+		*errnop = ENOENT;
+		*h_errnop = err == 13 ? HOST_NOT_FOUND : NO_DATA;
+		return NSS_STATUS_NOTFOUND;
+	}
+
+	*errnop = EINVAL;
+	*h_errnop = NO_RECOVERY;
+	return NSS_STATUS_UNAVAIL;
+}
+
+static enum nss_status gethostbyname3(const char *name, int af,
 		struct hostent *host, char *buf, size_t buflen,
 		int *errnop, int *h_errnop, int32_t *ttlp, char **canonp)
 {
-	unsigned int ttl;
-	char sid;
-	struct sockaddr_in **dnsservers = NULL;
+	struct dnsq_answer ans;
+	struct sockaddr_in *dnsservers[CONFIG_MAXSERVERS + 1];
+	stats_pool *sp = NULL;
+	uint32_t gid = 0;
 	size_t nlen = 0;
+	int err = -1;
 
-	if (af == AF_INET &&
+	if ((af == AF_INET || af == AF_INET6) &&
 			(nlen = strlen(name)) > 0 &&
-			buflen >= nlen + 1 + 2 * sizeof(void *) + sizeof(struct in_addr) + sizeof(void *) &&
-			get_dnss_for_domain(&dnsservers, name) &&
-			dnsq(dnsservers, name, (struct in_addr *)buf, &ttl, &sid) == 0)
+			get_dnss_for_domain(dnsservers, &gid, &sp, name) &&
+			(err = lookup(dnsservers, gid, sp,
+					af == AF_INET ? DNSQ_A : DNSQ_AAAA, name, &ans)) == 0)
 	{
-		host->h_addrtype = af;
-		host->h_length = sizeof(struct in_addr);
-		host->h_addr_list = (char **)buf + sizeof(struct in_addr);
-		host->h_addr_list[0] = buf;
-		host->h_addr_list[1] = NULL;
-		host->h_aliases = (char **)&host->h_addr_list[2];
-		host->h_aliases[0] = NULL;
-		host->h_name = (char *)&host->h_aliases[1];
-		memcpy(host->h_name, name, nlen + 1);
+		if (opts.rotate)
+			shuffle(&ans);
+		if (fill_hostent(host, af, buf, buflen, name, nlen, &ans) != 0) {
+			/* glibc retries with a larger buffer */
+			*errnop = ERANGE;
+			*h_errnop = NETDB_INTERNAL;
+			return NSS_STATUS_TRYAGAIN;
+		}
 		if (ttlp != NULL)
-			*ttlp = (int32_t)ttl;
+			*ttlp = (int32_t)ans.ttl;
 		if (canonp != NULL)
 			*canonp = host->h_name;
 
@@ -304,9 +623,206 @@ enum nss_status _nss_dnspq_gethostbyname3_r(const char *name, int af,
 		return NSS_STATUS_SUCCESS;
 	}
 
-	*errnop = EINVAL;
-	*h_errnop = NO_RECOVERY;
-	return NSS_STATUS_UNAVAIL;
+	return lookup_status(err, &ans, errnop, h_errnop, ttlp);
+}
+
+/* used by getaddrinfo(), the A and AAAA questions are asked at once,
+ * the result is a list of tuples in buffer, the first one possibly
+ * preallocated by the caller in *pat */
+static enum nss_status gethostbyname4(const char *name,
+		struct gaih_addrtuple **pat, char *buffer, size_t buflen,
+		int *errnop, int *h_errnop, int32_t *ttlp)
+{
+	struct dnsq_answer ans;
+	struct sockaddr_in *dnsservers[CONFIG_MAXSERVERS + 1];
+	struct gaih_addrtuple *tuples;
+	struct gaih_addrtuple *first = *pat;
+	stats_pool *sp = NULL;
+	uint32_t gid = 0;
+	size_t nlen = 0;
+	size_t pad = -(uintptr_t)buffer & (sizeof(void *) - 1);
+	const char *canon;
+	char *hname;
+	int n;
+	int i;
+	int err = -1;
+
+	if ((nlen = strlen(name)) > 0 &&
+			get_dnss_for_domain(dnsservers, &gid, &sp, name) &&
+			(err = lookup(dnsservers, gid, sp, DNSQ_A | DNSQ_AAAA,
+					name, &ans)) == 0)
+	{
+		if (opts.rotate)
+			shuffle(&ans);
+		/* tuples, name, the canonical one for aliases, as glibc takes
+		 * the name of the first tuple for AI_CANONNAME */
+		n = ans.naddrs + ans.naddrs6;
+		canon = name;
+		if (ans.canon[0] != '\0') {
+			canon = ans.canon;
+			nlen = strlen(canon);
+		}
+		if (buflen < pad + (n - (first != NULL)) *
+				sizeof(struct gaih_addrtuple) + nlen + 1)
+		{
+			*errnop = ERANGE;
+			*h_errnop = NETDB_INTERNAL;
+			return NSS_STATUS_TRYAGAIN;
+		}
+		tuples = (struct gaih_addrtuple *)(buffer + pad);
+		hname = (char *)(tuples + n - (first != NULL));
+		memcpy(hname, canon, nlen + 1);
+		if (first == NULL)
+			first = tuples++;
+		*pat = first;
+		for (i = 0; i < n; i++) {
+			memset(first, 0, sizeof(*first));
+			first->name = i == 0 ? hname : NULL;
+			if (i < ans.naddrs) {
+				first->family = AF_INET;
+				memcpy(first->addr, &ans.addrs[i], sizeof(struct in_addr));
+			} else {
+				first->family = AF_INET6;
+				memcpy(first->addr, &ans.addrs6[i - ans.naddrs],
+						sizeof(struct in6_addr));
+			}
+			if (i + 1 < n)
+				first->next = tuples++;
+			first = first->next;
+		}
+		if (ttlp != NULL)
+			*ttlp = (int32_t)ans.ttl;
+
+		*errnop = 0;
+		*h_errnop = 0;
+		return NSS_STATUS_SUCCESS;
+	}
+
+	return lookup_status(err, &ans, errnop, h_errnop, ttlp);
+}
+
+/* put the names of the PTR records in ans in host, the first as h_name,
+ * the others as h_aliases, with addr as the only address, returns
+ * ERANGE when buf is too small */
+static int fill_ptrhostent(
+		struct hostent *host,
+		int af,
+		const void *addr,
+		socklen_t alen,
+		char *buf,
+		size_t buflen,
+		const struct dnsq_answer *ans)
+{
+	size_t pad = -(uintptr_t)buf & (sizeof(char *) - 1);
+	size_t nlen = 0;
+	int nnames = 0;
+	const char *p;
+	size_t len;
+	char *s;
+	int i;
+
+	for (p = ans->canon; *p != '\0'; p += len) {
+		len = strlen(p) + 1;
+		nlen += len;
+		nnames++;
+	}
+
+	/* addr pointer, NULL, alias pointers, NULL, addr, names */
+	if (buflen < pad + (nnames + 2) * sizeof(char *) + alen + nlen)
+		return ERANGE;
+
+	host->h_addrtype = af;
+	host->h_length = alen;
+	host->h_addr_list = (char **)(buf + pad);
+	host->h_aliases = &host->h_addr_list[2];
+	s = (char *)&host->h_aliases[nnames];
+	host->h_addr_list[0] = memcpy(s, addr, alen);
+	host->h_addr_list[1] = NULL;
+	s += alen;
+	host->h_name = memcpy(s, ans->canon, nlen);
+	for (i = 0, p = s + strlen(s) + 1; i < nnames - 1; i++) {
+		host->h_aliases[i] = (char *)p;
+		p += strlen(p) + 1;
+	}
+	host->h_aliases[i] = NULL;
+
+	return 0;
+}
+
+/* the names of addr, from the PTR records of its reverse name rname,
+ * asked for from the pool of the in-addr.arpa or ip6.arpa domain it is
+ * in like any other name */
+static enum nss_status gethostbyaddr2(const void *addr, socklen_t len,
+		int af, const char *rname, struct hostent *host, char *buf,
+		size_t buflen, int *errnop, int *h_errnop, int32_t *ttlp)
+{
+	struct dnsq_answer ans;
+	struct sockaddr_in *dnsservers[CONFIG_MAXSERVERS + 1];
+	stats_pool *sp = NULL;
+	uint32_t gid = 0;
+	int err = -1;
+
+	if (rname[0] != '\0' &&
+			get_dnss_for_domain(dnsservers, &gid, &sp, rname) &&
+			(err = lookup(dnsservers, gid, sp, DNSQ_PTR, rname, &ans)) == 0)
+	{
+		if (fill_ptrhostent(host, af, addr, len, buf, buflen, &ans) != 0) {
+			*errnop = ERANGE;
+			*h_errnop = NETDB_INTERNAL;
+			return NSS_STATUS_TRYAGAIN;
+		}
+		if (ttlp != NULL)
+			*ttlp = (int32_t)ans.ttl;
+
+		*errnop = 0;
+		*h_errnop = 0;
+		return NSS_STATUS_SUCCESS;
+	}
+
+	return lookup_status(err, &ans, errnop, h_errnop, ttlp);
+}
+
+/* monotonic time in usec, for the lookup-done probe */
+static inline int64_t probe_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
+enum nss_status _nss_dnspq_gethostbyname3_r(const char *name, int af,
+		struct hostent *host, char *buf, size_t buflen,
+		int *errnop, int *h_errnop, int32_t *ttlp, char **canonp)
+{
+	enum nss_status st;
+	int64_t begin = 0;
+
+	PROBE2(lookup__start, name, af);
+	if (PROBE_ENABLED(lookup__done))
+		begin = probe_now();
+	st = gethostbyname3(name, af, host, buf, buflen,
+			errnop, h_errnop, ttlp, canonp);
+	if (PROBE_ENABLED(lookup__done))
+		PROBE4(lookup__done, name, st, *h_errnop,
+				(unsigned int)(probe_now() - begin));
+	return st;
+}
+
+enum nss_status _nss_dnspq_gethostbyname4_r(const char *name,
+		struct gaih_addrtuple **pat, char *buffer, size_t buflen,
+		int *errnop, int *h_errnop, int32_t *ttlp)
+{
+	enum nss_status st;
+	int64_t begin = 0;
+
+	PROBE2(lookup__start, name, AF_UNSPEC);
+	if (PROBE_ENABLED(lookup__done))
+		begin = probe_now();
+	st = gethostbyname4(name, pat, buffer, buflen, errnop, h_errnop, ttlp);
+	if (PROBE_ENABLED(lookup__done))
+		PROBE4(lookup__done, name, st, *h_errnop,
+				(unsigned int)(probe_now() - begin));
+	return st;
 }
 
 enum nss_status _nss_dnspq_gethostbyname2_r(const char *name, int af,
@@ -329,34 +845,30 @@ enum nss_status _nss_dnspq_gethostbyaddr2_r(const void* addr, socklen_t len,
 		int af, struct hostent *host, char *buffer, size_t buflen,
 		int *errnop, int *h_errnop, int32_t *ttlp)
 {
-	/* pacify compiler */
-	(void) addr;
-	(void) len;
-	(void) af;
-	(void) host;
-	(void) buffer;
-	(void) buflen;
-	(void) ttlp;
+	char rname[DNSQ_MAXNAME];
+	enum nss_status st;
+	int64_t begin = 0;
 
-	*errnop = EINVAL;
-	*h_errnop = NO_RECOVERY;
-	return NSS_STATUS_UNAVAIL;
+	rname[0] = '\0';
+	if ((af == AF_INET && len == sizeof(struct in_addr)) ||
+			(af == AF_INET6 && len == sizeof(struct in6_addr)))
+		config_revname(af, addr, len * 8, rname);
+
+	PROBE2(lookup__start, rname, af);
+	if (PROBE_ENABLED(lookup__done))
+		begin = probe_now();
+	st = gethostbyaddr2(addr, len, af, rname, host, buffer, buflen,
+			errnop, h_errnop, ttlp);
+	if (PROBE_ENABLED(lookup__done))
+		PROBE4(lookup__done, rname, st, *h_errnop,
+				(unsigned int)(probe_now() - begin));
+	return st;
 }
 
 enum nss_status _nss_dnspq_gethostbyaddr_r(const void* addr, socklen_t len,
 		int af, struct hostent *host, char *buffer, size_t buflen,
 		int *errnop, int *h_errnop)
 {
-	/* pacify compiler */
-	(void) addr;
-	(void) len;
-	(void) af;
-	(void) host;
-	(void) buffer;
-	(void) buflen;
-
-	*errnop = EINVAL;
-	*h_errnop = NO_RECOVERY;
-	return NSS_STATUS_UNAVAIL;
+	return _nss_dnspq_gethostbyaddr2_r(addr, len, af, host, buffer, buflen,
+			errnop, h_errnop, NULL);
 }
-
@@ -0,0 +1,51 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* USDT probes, for bpftrace, perf and the like
+ *
+ * Built with USDT defined (make USDT=1), the probes are sys/sdt.h
+ * markers of provider dnspq, a nop each until a tracer attaches.  Each
+ * probe has a semaphore, declared with PROBE_SEMAPHORE() in the file
+ * using it, which the tracer increments while attached, such that
+ * arguments that cost something to compute can be skipped unless
+ * PROBE_ENABLED().  Without USDT, all of it compiles to nothing. */
+
+#ifdef USDT
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+# define PROBE_SEMAPHORE(name) \
+	__extension__ unsigned short dnspq_##name##_semaphore \
+		__attribute__((unused)) __attribute__((section(".probes")))
+# define PROBE_ENABLED(name)  __builtin_expect(dnspq_##name##_semaphore, 0)
+# define PROBE1(name, a)              STAP_PROBE1(dnspq, name, a)
+# define PROBE2(name, a, b)           STAP_PROBE2(dnspq, name, a, b)
+# define PROBE3(name, a, b, c)        STAP_PROBE3(dnspq, name, a, b, c)
+# define PROBE4(name, a, b, c, d)     STAP_PROBE4(dnspq, name, a, b, c, d)
+#else
+# define PROBE_SEMAPHORE(name)        struct _probe_##name##_unused
+# define PROBE_ENABLED(name)          0
+/* the arguments are referenced, but never evaluated */
+# define PROBE1(name, a) \
+	do { if (0) { (void)(a); } } while (0)
+# define PROBE2(name, a, b) \
+	do { if (0) { (void)(a); (void)(b); } } while (0)
+# define PROBE3(name, a, b, c) \
+	do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+# define PROBE4(name, a, b, c, d) \
+	do { if (0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while (0)
+#endif
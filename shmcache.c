@@ -0,0 +1,292 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* host-wide answer cache in a shared memory segment
+ *
+ * The segment is a file (typically under /dev/shm) mapped by every
+ * process using the nss module, such that short-lived processes benefit
+ * from answers retrieved by others.  It holds a fixed size open
+ * addressing hash table with linear probing.  Each bucket is guarded by
+ * a sequence lock: writers make the sequence odd while updating the
+ * bucket, readers never write to the segment, and retry when the
+ * sequence changed while they were copying the bucket.  Buckets are
+ * never deleted, expired entries are simply overwritten. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "dnspq.h"
+#include "shmcache.h"
+
+#define SHMCACHE_MAGIC    0x63717064  /* "dpqc" */
+#define SHMCACHE_VERSION  4
+
+#ifndef SHMCACHE_PROBES
+# define SHMCACHE_PROBES  8
+#endif
+#ifndef SHMCACHE_RETRIES
+# define SHMCACHE_RETRIES  4
+#endif
+
+typedef struct _shmcache_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nbuckets;
+	uint32_t bucketsize;
+} shmcache_hdr;
+
+typedef struct _shmcache_bucket {
+	uint32_t seq;        /* odd while a writer updates the bucket */
+	uint32_t hash;
+	uint32_t gid;
+	int64_t expire;      /* CLOCK_MONOTONIC seconds, 0 means unused */
+	char err;            /* dnsq error for negative entries, else 0 */
+	struct dnsq_answer ans;
+	char name[256];
+} shmcache_bucket;
+
+static shmcache_bucket *buckets = NULL;
+static uint32_t bucketmask = 0;
+static char writable = 0;
+
+/* CLOCK_MONOTONIC is the same for all processes on the host */
+static inline int64_t shmcache_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (int64_t)ts.tv_sec;
+}
+
+/* map the cache segment at path, creating it with room for size
+ * entries (rounded up to a power of 2) if it doesn't exist yet */
+int shmcache_open(const char *path, size_t size) {
+	int fd;
+	struct stat st;
+	uint32_t nb;
+	size_t len;
+	void *seg;
+	shmcache_hdr *hdr;
+	int prot = PROT_READ | PROT_WRITE;
+
+	if (path == NULL || size == 0)
+		return 0;
+
+	for (nb = 1; nb < size && nb < (1U << 24); nb <<= 1)
+		;
+	len = sizeof(shmcache_hdr) + sizeof(shmcache_bucket) * nb;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0664)) == -1) {
+		/* someone else owns it, we can still benefit from it */
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+			return 1;
+		prot = PROT_READ;
+	}
+
+	/* serialise initialisation of a fresh segment */
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return 1;
+	}
+	/* anyone that can write the segment can feed answers to us, so
+	 * only trust segments from ourself or root, and not world writable */
+	if ((st.st_uid != 0 && st.st_uid != geteuid()) || st.st_mode & S_IWOTH) {
+		close(fd);
+		return 1;
+	}
+	if (st.st_size == 0 && prot & PROT_WRITE) {
+		if (ftruncate(fd, len) != 0) {
+			close(fd);
+			return 1;
+		}
+		st.st_size = len;
+	}
+	if (st.st_size < sizeof(shmcache_hdr)) {
+		close(fd);
+		return 1;
+	}
+	len = st.st_size;
+	seg = mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+	flock(fd, LOCK_UN);
+	close(fd);
+	if (seg == MAP_FAILED)
+		return 1;
+
+	hdr = seg;
+	if (hdr->magic == 0 && prot & PROT_WRITE) {
+		/* freshly created, the remainder is zero filled already */
+		hdr->version = SHMCACHE_VERSION;
+		hdr->bucketsize = sizeof(shmcache_bucket);
+		hdr->nbuckets = nb;
+		__atomic_store_n(&hdr->magic, SHMCACHE_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	/* size is dictated by whoever created the segment */
+	nb = hdr->nbuckets;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHMCACHE_MAGIC ||
+			hdr->version != SHMCACHE_VERSION ||
+			hdr->bucketsize != sizeof(shmcache_bucket) ||
+			nb == 0 || (nb & (nb - 1)) != 0 ||
+			len < sizeof(shmcache_hdr) + sizeof(shmcache_bucket) * nb)
+	{
+		munmap(seg, len);
+		return 1;
+	}
+
+	bucketmask = nb - 1;
+	writable = (prot & PROT_WRITE) != 0;
+	buckets = (shmcache_bucket *)(hdr + 1);
+
+	return 0;
+}
+
+/* lookup name in the segment, hash is cache_hash(name), returns 1 and
+ * fills in err and ans on a hit, like cache_lookup() */
+int shmcache_lookup(
+		const char *name,
+		uint32_t hash,
+		uint32_t gid,
+		struct dnsq_answer *ans,
+		char *err)
+{
+	shmcache_bucket *b;
+	shmcache_bucket c;
+	uint32_t seq;
+	int64_t now;
+	int i;
+	int r;
+
+	if (buckets == NULL)
+		return 0;
+
+	now = shmcache_now();
+	for (i = 0; i < SHMCACHE_PROBES; i++) {
+		b = &buckets[(hash + i) & bucketmask];
+		for (r = 0; r < SHMCACHE_RETRIES; r++) {
+			seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+			if (seq & 1)
+				continue;
+			c.hash = __atomic_load_n(&b->hash, __ATOMIC_RELAXED);
+			c.gid = __atomic_load_n(&b->gid, __ATOMIC_RELAXED);
+			c.expire = __atomic_load_n(&b->expire, __ATOMIC_RELAXED);
+			if (c.hash == hash && c.gid == gid && c.expire > now) {
+				c.ans = b->ans;
+				c.err = b->err;
+				memcpy(c.name, b->name, sizeof(c.name));
+			}
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) == seq)
+				break;
+		}
+		if (r == SHMCACHE_RETRIES)
+			continue;  /* too busy, try the next one */
+		if (c.expire == 0)
+			return 0;  /* end of probe chain */
+		if (c.hash != hash || c.gid != gid || c.expire <= now)
+			continue;
+		c.name[sizeof(c.name) - 1] = '\0';
+		if (strcasecmp(c.name, name) != 0)
+			continue;
+
+		if (c.ans.naddrs < 0 || c.ans.naddrs > DNSQ_MAXADDRS ||
+				c.ans.naddrs6 < 0 || c.ans.naddrs6 > DNSQ_MAXADDRS6)
+			continue;  /* don't trust what others wrote blindly */
+		/* the names end in an empty one, whatever was written */
+		c.ans.canon[DNSQ_MAXNAME - 2] = '\0';
+		c.ans.canon[DNSQ_MAXNAME - 1] = '\0';
+		if ((*err = c.err) == 0)
+			*ans = c.ans;
+		ans->ttl = (unsigned int)(c.expire - now);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* store an answer, or a negative entry for err when ans is NULL */
+void shmcache_insert(
+		const char *name,
+		uint32_t hash,
+		uint32_t gid,
+		const struct dnsq_answer *ans,
+		unsigned int ttl,
+		char err)
+{
+	shmcache_bucket *b;
+	shmcache_bucket *victim = NULL;
+	uint32_t seq;
+	int64_t now;
+	int64_t expire;
+	int64_t vexpire = 0;
+	size_t len;
+	int i;
+
+	if (!writable || ttl == 0 || (len = strlen(name)) >= sizeof(b->name))
+		return;
+
+	/* reuse the bucket holding name, or else the first unused or
+	 * expired one, or else the one closest to expiry */
+	now = shmcache_now();
+	for (i = 0; i < SHMCACHE_PROBES; i++) {
+		b = &buckets[(hash + i) & bucketmask];
+		expire = __atomic_load_n(&b->expire, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&b->hash, __ATOMIC_RELAXED) == hash &&
+				__atomic_load_n(&b->gid, __ATOMIC_RELAXED) == gid &&
+				strncasecmp(b->name, name, sizeof(b->name)) == 0)
+		{
+			victim = b;
+			break;
+		}
+		if (expire <= now) {
+			victim = b;
+			if (expire == 0)
+				break;
+			vexpire = now;
+		} else if (victim == NULL || expire < vexpire) {
+			victim = b;
+			vexpire = expire;
+		}
+	}
+
+	/* if another writer holds the bucket, just give up, it's a cache */
+	b = victim;
+	seq = __atomic_load_n(&b->seq, __ATOMIC_RELAXED);
+	if (seq & 1 || !__atomic_compare_exchange_n(&b->seq, &seq, seq + 1,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&b->hash, hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&b->gid, gid, __ATOMIC_RELAXED);
+	if (ans != NULL)
+		b->ans = *ans;
+	else
+		b->ans.naddrs = b->ans.naddrs6 = 0;
+	b->err = err;
+	memcpy(b->name, name, len + 1);
+	__atomic_store_n(&b->expire, now + ttl, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&b->seq, seq + 2, __ATOMIC_RELEASE);
+}
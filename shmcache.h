@@ -0,0 +1,27 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+
+struct dnsq_answer;
+
+int shmcache_open(const char *path, size_t size);
+int shmcache_lookup(const char *name, uint32_t hash, uint32_t gid,
+		struct dnsq_answer *ans, char *err);
+void shmcache_insert(const char *name, uint32_t hash, uint32_t gid,
+		const struct dnsq_answer *ans, unsigned int ttl, char err);
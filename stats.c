@@ -0,0 +1,408 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* runtime statistics
+ *
+ * Counters per pool, next to the ones per server kept by health.c, all
+ * updated with relaxed atomics.  Both tables normally live in the
+ * process, stats_open() moves them into a file named after the pid,
+ * typically under /dev/shm, such that dnspq-stats can read the numbers
+ * of all processes on the host while the lookups don't do anything
+ * more than before: no locks, no syscalls.  The file is removed when
+ * the process exits, dnspq-stats ignores the ones of processes that
+ * didn't get to do so. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dnspq.h"
+#include "stats.h"
+
+#define STATS_MAGIC    0x73717064  /* "dpqs" */
+#define STATS_VERSION  2
+
+static stats_pool poolbuf[STATS_POOLS];
+static stats_pool *pooltab = poolbuf;
+static char segpath[1024];
+static pid_t segpid = 0;
+
+/* publish the counters in PREFIX.<pid>, called before any lookups */
+int stats_open(const char *prefix) {
+	stats_segment *seg;
+	int fd;
+
+	if (snprintf(segpath, sizeof(segpath), "%s.%d",
+				prefix, (int)getpid()) >= sizeof(segpath))
+		return 1;
+	/* a file left by a process with the same pid is ours now, but one
+	 * someone else put there, which the sticky /dev/shm doesn't let us
+	 * remove, is never opened: a fresh file or none */
+	unlink(segpath);
+	if ((fd = open(segpath, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW |
+					O_CLOEXEC, 0644)) == -1)
+		return 1;
+	if (ftruncate(fd, sizeof(stats_segment)) != 0 ||
+			(seg = mmap(NULL, sizeof(stats_segment), PROT_READ | PROT_WRITE,
+						MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		unlink(segpath);
+		return 1;
+	}
+	close(fd);
+
+	seg->version = STATS_VERSION;
+	seg->pid = (int32_t)getpid();
+	seg->nservers = HEALTH_SLOTS;
+	seg->serversize = sizeof(health_server);
+	seg->npools = STATS_POOLS;
+	seg->poolsize = sizeof(stats_pool);
+	seg->started = (int64_t)time(NULL);
+	health_table(seg->servers);
+	memcpy(seg->pools, pooltab, sizeof(poolbuf));
+	pooltab = seg->pools;
+	__atomic_store_n(&seg->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+	segpid = getpid();
+
+	return 0;
+}
+
+/* a forked child shares the segment of its parent, only the latter
+ * removes it */
+static void __attribute__((destructor)) stats_close(void) {
+	if (segpid != 0 && segpid == getpid())
+		unlink(segpath);
+}
+
+/* the counters for pool gid, NULL when the table is full */
+stats_pool *stats_pool_get(uint32_t gid) {
+	uint64_t key = (1ULL << 32) | gid;
+	uint64_t cur;
+	stats_pool *p;
+	unsigned int i;
+
+	for (i = 0; i < STATS_POOLS; i++) {
+		p = &pooltab[(gid + i) & (STATS_POOLS - 1)];
+		cur = __atomic_load_n(&p->key, __ATOMIC_ACQUIRE);
+		if (cur == key)
+			return p;
+		if (cur == 0 && __atomic_compare_exchange_n(&p->key, &cur, key,
+					0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return p;
+	}
+	return NULL;
+}
+
+/* label p, NULL or empty for the servers of traditional mode */
+void stats_pool_name(stats_pool *p, const char *domain) {
+	if (domain == NULL || *domain == '\0')
+		domain = ".";
+	/* the first byte last, such that readers never see a partial name */
+	strncpy(p->domain + 1, domain + 1, sizeof(p->domain) - 2);
+	__atomic_store_n(&p->domain[0], domain[0], __ATOMIC_RELEASE);
+}
+
+/* a lookup answered from a cache, past its expiry when stale */
+void stats_hit(stats_pool *p, char stale) {
+	if (p == NULL)
+		return;
+	__atomic_add_fetch(&p->lookups, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(stale ? &p->stale : &p->cachehits, 1, __ATOMIC_RELAXED);
+}
+
+/* a lookup that asked the servers, with dnsq error err, taking usec */
+void stats_query(stats_pool *p, int err, unsigned int usec) {
+	if (p == NULL)
+		return;
+	__atomic_add_fetch(&p->lookups, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&p->results[(unsigned int)err < STATS_ERRS ? err : 1], 1,
+			__ATOMIC_RELAXED);
+	__atomic_add_fetch(&p->latency[health_bucket(usec)], 1, __ATOMIC_RELAXED);
+}
+
+#ifdef DNSPQ_STATS
+typedef struct _stats_proc {
+	stats_segment *seg;
+	struct _stats_proc *next;
+} stats_proc;
+
+/* the segments of the running processes, with dead ones removed when
+ * clean is set */
+static stats_proc *readsegments(const char *prefix, char clean) {
+	char dir[1024];
+	char path[2048];
+	const char *base;
+	struct dirent *de;
+	struct stat st;
+	stats_proc *procs = NULL;
+	stats_proc *p;
+	stats_segment *seg;
+	size_t blen;
+	char *end;
+	DIR *d;
+	int fd;
+
+	if ((base = strrchr(prefix, '/')) != NULL) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(base - prefix), prefix);
+		base++;
+	} else {
+		snprintf(dir, sizeof(dir), ".");
+		base = prefix;
+	}
+	blen = strlen(base);
+	if ((d = opendir(dir[0] == '\0' ? "/" : dir)) == NULL)
+		return NULL;
+	while ((de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, base, blen) != 0 ||
+				de->d_name[blen] != '.' ||
+				strtol(de->d_name + blen + 1, &end, 10) <= 0 || *end != '\0')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+			continue;
+		if (fstat(fd, &st) != 0 || st.st_size != sizeof(stats_segment) ||
+				(seg = mmap(NULL, sizeof(stats_segment), PROT_READ,
+							MAP_SHARED, fd, 0)) == MAP_FAILED)
+		{
+			close(fd);
+			continue;
+		}
+		close(fd);
+		if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+				seg->version != STATS_VERSION ||
+				seg->nservers != HEALTH_SLOTS ||
+				seg->serversize != sizeof(health_server) ||
+				seg->npools != STATS_POOLS ||
+				seg->poolsize != sizeof(stats_pool))
+		{
+			munmap(seg, sizeof(stats_segment));
+			continue;
+		}
+		if (kill(seg->pid, 0) != 0 && errno == ESRCH) {
+			if (clean)
+				unlink(path);
+			munmap(seg, sizeof(stats_segment));
+			continue;
+		}
+		if ((p = malloc(sizeof(*p))) == NULL)
+			break;
+		p->seg = seg;
+		p->next = procs;
+		procs = p;
+	}
+	closedir(d);
+
+	return procs;
+}
+
+static void servers(stats_proc *procs, int nprocs) {
+	static const unsigned int permille[3] = { 500, 900, 990 };
+	health_server **hs;
+	health_server *h;
+	health_server sum;
+	stats_proc *p;
+	stats_proc *q;
+	struct in_addr addr;
+	unsigned int pct[3];
+	int open;
+	int n;
+	int i;
+	int j;
+
+	if ((hs = malloc(sizeof(*hs) * nprocs)) == NULL)
+		return;
+	printf("%-21s %10s %8s %10s %10s %8s %8s %8s %7s %7s %7s %4s\n",
+			"server", "queries", "retries", "answers", "wins", "rcodes",
+			"bad", "timeouts", "p50", "p90", "p99", "open");
+	for (p = procs; p != NULL; p = p->next) {
+		for (i = 0; i < HEALTH_SLOTS; i++) {
+			h = &p->seg->servers[i];
+			if (h->key == 0)
+				continue;
+			/* seen in an earlier process already? */
+			for (q = procs; q != p; q = q->next) {
+				for (j = 0; j < HEALTH_SLOTS; j++)
+					if (q->seg->servers[j].key == h->key)
+						break;
+				if (j < HEALTH_SLOTS)
+					break;
+			}
+			if (q != p)
+				continue;
+
+			memset(&sum, 0, sizeof(sum));
+			open = 0;
+			n = 0;
+			for (q = p; q != NULL; q = q->next) {
+				for (j = 0; j < HEALTH_SLOTS; j++)
+					if (q->seg->servers[j].key == h->key)
+						break;
+				if (j == HEALTH_SLOTS)
+					continue;
+				hs[n] = &q->seg->servers[j];
+				sum.queries += hs[n]->queries;
+				sum.retries += hs[n]->retries;
+				sum.answers += hs[n]->answers;
+				sum.wins += hs[n]->wins;
+				sum.rcodefails += hs[n]->rcodefails;
+				sum.parseerrs += hs[n]->parseerrs;
+				sum.timeouts += hs[n]->timeouts;
+				open += hs[n]->openuntil != 0;
+				n++;
+			}
+			memset(pct, 0, sizeof(pct));
+			health_percentiles(hs, n, permille, pct, 3);
+
+			/* see health_key() */
+			addr.s_addr = (uint32_t)(h->key >> 16);
+			printf("%15s:%-5u %10lu %8lu %10lu %10lu %8lu %8lu %8lu "
+					"%5uus %5uus %5uus %4d\n",
+					inet_ntoa(addr), ntohs((uint16_t)h->key),
+					sum.queries, sum.retries, sum.answers, sum.wins,
+					sum.rcodefails, sum.parseerrs, sum.timeouts,
+					pct[0], pct[1], pct[2], open);
+		}
+	}
+	free(hs);
+}
+
+/* the upper bound of the bucket holding the permille of hist */
+static unsigned int percentile(const unsigned long *hist, unsigned int permille) {
+	unsigned long total = 0;
+	unsigned long sum = 0;
+	int b;
+
+	for (b = 0; b < HEALTH_RTT_BUCKETS; b++)
+		total += hist[b];
+	if (total == 0)
+		return 0;
+	for (b = 0; b < HEALTH_RTT_BUCKETS - 1; b++)
+		if ((sum += hist[b]) * 1000 >= total * permille)
+			break;
+	return health_bucket_max(b);
+}
+
+static void pools(stats_proc *procs) {
+	stats_pool *sp;
+	stats_pool sum;
+	stats_proc *p;
+	stats_proc *q;
+	unsigned long lat[HEALTH_RTT_BUCKETS];
+	unsigned long fails;
+	int i;
+	int j;
+	int k;
+
+	printf("\n%-24s %10s %10s %8s %10s %8s %8s %8s %8s %7s %7s %7s\n",
+			"pool", "lookups", "cached", "stale", "answers", "nodata",
+			"nxdomain", "timeouts", "errors", "p50", "p90", "p99");
+	for (p = procs; p != NULL; p = p->next) {
+		for (i = 0; i < STATS_POOLS; i++) {
+			sp = &p->seg->pools[i];
+			if (sp->key == 0)
+				continue;
+			for (q = procs; q != p; q = q->next) {
+				for (j = 0; j < STATS_POOLS; j++)
+					if (q->seg->pools[j].key == sp->key)
+						break;
+				if (j < STATS_POOLS)
+					break;
+			}
+			if (q != p)
+				continue;
+
+			memset(&sum, 0, sizeof(sum));
+			memset(lat, 0, sizeof(lat));
+			for (q = p; q != NULL; q = q->next) {
+				for (j = 0; j < STATS_POOLS; j++)
+					if (q->seg->pools[j].key == sp->key)
+						break;
+				if (j == STATS_POOLS)
+					continue;
+				sum.lookups += q->seg->pools[j].lookups;
+				sum.cachehits += q->seg->pools[j].cachehits;
+				sum.stale += q->seg->pools[j].stale;
+				for (k = 0; k < STATS_ERRS; k++)
+					sum.results[k] += q->seg->pools[j].results[k];
+				for (k = 0; k < HEALTH_RTT_BUCKETS; k++)
+					lat[k] += q->seg->pools[j].latency[k];
+			}
+			for (fails = 0, k = 2; k < STATS_ERRS; k++)
+				if (k != 12 && k != 13)
+					fails += sum.results[k];
+
+			printf("%-24.*s %10lu %10lu %8lu %10lu %8lu %8lu %8lu %8lu "
+					"%5uus %5uus %5uus\n",
+					(int)sizeof(sp->domain) - 1,
+					sp->domain[0] == '\0' ? "?" : sp->domain,
+					sum.lookups, sum.cachehits, sum.stale, sum.results[0],
+					sum.results[12], sum.results[13], sum.results[1], fails,
+					percentile(lat, 500), percentile(lat, 900),
+					percentile(lat, 990));
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const char *prefix = STATS_PREFIX;
+	stats_proc *procs;
+	stats_proc *p;
+	char clean = 0;
+	int nprocs = 0;
+	int i;
+
+	while ((i = getopt(argc, argv, "p:c")) != -1) {
+		switch (i) {
+			case 'p':
+				prefix = optarg;
+				break;
+			case 'c':
+				clean = 1;
+				break;
+			default:
+				printf("DNS Parallel Query statistics v" VERSION
+						" (" GIT_VERSION ")\n");
+				printf("usage: dnspq-stats [-p " STATS_PREFIX "] [-c]\n");
+				return 1;
+		}
+	}
+
+	procs = readsegments(prefix, clean);
+	for (p = procs; p != NULL; p = p->next)
+		nprocs++;
+	printf("%d process%s\n\n", nprocs, nprocs == 1 ? "" : "es");
+	if (nprocs == 0)
+		return 0;
+
+	servers(procs, nprocs);
+	pools(procs);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,59 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+
+#include "health.h"
+
+#ifndef STATS_PREFIX
+#define STATS_PREFIX "/dev/shm/dnspq-stats"
+#endif
+#ifndef STATS_POOLS
+# define STATS_POOLS  64  /* pools tracked, must be a power of 2 */
+#endif
+#define STATS_ERRS  18    /* dnsq errors 0 up to 17 */
+
+typedef struct _stats_pool {
+	uint64_t key;             /* 1 << 32 | gid, 0 for unused */
+	char domain[256];         /* "." for traditional mode */
+	unsigned long lookups;
+	unsigned long cachehits;
+	unsigned long stale;      /* answers served past their expiry */
+	unsigned long results[STATS_ERRS];  /* of queries to the servers */
+	unsigned int latency[HEALTH_RTT_BUCKETS];  /* of those, in usec */
+} stats_pool;
+
+/* the segment of a process, see stats.c */
+typedef struct _stats_segment {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t nservers;
+	uint32_t serversize;
+	uint32_t npools;
+	uint32_t poolsize;
+	int64_t started;          /* wall clock seconds */
+	health_server servers[HEALTH_SLOTS];
+	stats_pool pools[STATS_POOLS];
+} stats_segment;
+
+int stats_open(const char *prefix);
+stats_pool *stats_pool_get(uint32_t gid);
+void stats_pool_name(stats_pool *p, const char *domain);
+void stats_hit(stats_pool *p, char stale);
+void stats_query(stats_pool *p, int err, unsigned int usec);
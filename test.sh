@@ -0,0 +1,211 @@
+#!/usr/bin/env bash
+
+# This file is part of dnspq.
+#
+# dnspq is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# dnspq is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+
+
+# regression tests, run by make test: dnstest -v against dnspq-fakesrv,
+# through the query engine, and through the nss module of dnstest-check,
+# which reads its config from ${TESTDIR}/resolv-dnspq.conf
+
+TESTDIR=${TESTDIR:-/tmp/dnspq-test}
+PORT=${TESTPORT:-5390}
+CONF=${TESTDIR}/resolv-dnspq.conf
+
+fails=0
+pids=
+
+mkdir -p "${TESTDIR}" || exit 1
+trap 'kill ${pids} 2>/dev/null; rm -f "${CONF}" "${CONF}".bin' EXIT
+
+# start a fake server on port $1 with the options following it, its
+# statistics go to ${TESTDIR}/fakesrv.<port>
+fakesrv() {
+	local port=$1
+	shift
+	./dnspq-fakesrv -S 1 "$@" ${port} > "${TESTDIR}"/fakesrv.${port} 2>&1 &
+	pids="${pids} $!"
+	eval fakesrv_${port}=$!
+	sleep 0.2
+}
+
+# stop the fake server on port $1
+stopsrv() {
+	local pid
+	eval pid=\${fakesrv_$1}
+	kill ${pid} 2>/dev/null
+	wait ${pid} 2>/dev/null
+}
+
+# the questions the stopped fake server on port $1 got
+queries() {
+	awk -v p=$1 '$1 == p { print $2 }' "${TESTDIR}"/fakesrv.$1
+}
+
+# the addresses the fake server on port $1 answers with, $2 A and $3
+# AAAA records
+addrs() {
+	local i
+	for ((i = 1; i <= $2; i++)) ; do
+		printf " 10.%d.%d.%d" $(($1 >> 8)) $(($1 & 255)) ${i}
+	done
+	for ((i = 1; i <= $3; i++)) ; do
+		printf " fd00::%x:%x" $1 ${i}
+	done
+}
+
+# compare the outcome of test $1, expected $2, with what we got, $3
+check() {
+	if [[ "$3" == "$2" ]] ; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		echo "     expected: $2"
+		echo "     got:      $3"
+		fails=$((fails + 1))
+	fi
+}
+
+# the outcome of each lookup of dnstest with the given options, without
+# the summary following them
+lookups() {
+	./dnstest-check -v "$@" | sed '/^\(dnsq\|nss\), /,$d'
+}
+
+# write the config, a pool for .test on port $1, with options $2
+config() {
+	printf ".test 127.0.0.1:%d\noptions %s\n" $1 "$2" > "${CONF}".new
+	mv "${CONF}".new "${CONF}"
+}
+
+P=${PORT}
+S="-m dnsq -s 127.0.0.1:${P}"
+
+fakesrv ${P} -a 2 -A 1
+check "answer" \
+	"a.test: ok ttl 60$(addrs ${P} 2 1)" \
+	"$(lookups ${S} -c 1 a.test)"
+stopsrv ${P}
+
+fakesrv ${P} -c 3 -a 1 -A 0
+check "CNAME chain" \
+	"a.test: ok ttl 60$(addrs ${P} 1 0) canon c3.a.test" \
+	"$(lookups ${S} -c 1 -4 a.test)"
+check "PTR through a CNAME" \
+	"10.1.2.3: ok ttl 60 h1.p${P}" \
+	"$(lookups ${S} -c 1 -x 10.1.2.3)"
+stopsrv ${P}
+
+fakesrv ${P} -c 9
+check "CNAME chain too long" \
+	"a.test: malformed" \
+	"$(lookups ${S} -c 1 -4 a.test)"
+stopsrv ${P}
+
+fakesrv ${P} -a 3
+check "PTR" \
+	"10.1.2.3: ok ttl 60 h1.p${P} h2.p${P} h3.p${P}" \
+	"$(lookups ${S} -c 1 -x 10.1.2.3)"
+check "PTR for IPv6" \
+	"2001:db8::1: ok ttl 60 h1.p${P} h2.p${P} h3.p${P}" \
+	"$(lookups ${S} -c 1 -x 2001:db8::1)"
+stopsrv ${P}
+
+# a server sending malformed answers first, none of which may end up
+# in the answer of the other, partially or not, also for the AAAA
+# records the other doesn't have
+fakesrv ${P} -a 3 -A 3 -m 1
+fakesrv $((P + 1)) -a 1 -A 0 -l 20000
+check "malformed answers" \
+	"$(for i in {1..20} ; do echo "a.test: ok ttl 60$(addrs $((P + 1)) 1 0)"; done)" \
+	"$(lookups -m dnsq -s 127.0.0.1:${P},127.0.0.1:$((P + 1)) -c 20 a.test)"
+stopsrv ${P}
+stopsrv $((P + 1))
+
+fakesrv ${P} -t 1
+check "truncated answer, over TCP" \
+	"a.test: ok ttl 60$(addrs ${P} 1 1)" \
+	"$(lookups ${S} -c 1 a.test)"
+stopsrv ${P}
+
+fakesrv ${P} -a 100 -A 0
+check "large answer, over TCP" \
+	"a.test: ok ttl 60$(addrs ${P} 32 0)" \
+	"$(lookups ${S} -c 1 -4 a.test)"
+stopsrv ${P}
+
+fakesrv ${P} -n 1 -L 7
+check "negative TTL from the SOA" \
+	"a.test: nxdomain ttl 7" \
+	"$(lookups ${S} -c 1 a.test)"
+stopsrv ${P}
+
+# through the nss module
+config ${P} "reload-interval:0"
+fakesrv ${P} -a 1 -A 0
+check "cache" \
+	"a.test: ok ttl 60$(addrs ${P} 1 0)" \
+	"$(lookups -m nss -c 3 -4 a.test | sort -u)"
+stopsrv ${P}
+check "cache, queries" "1" "$(queries ${P})"
+
+fakesrv ${P} -a 1 -A 0 -l 200000
+check "coalescing" \
+	"a.test: ok ttl 60$(addrs ${P} 1 0)" \
+	"$(lookups -m nss -t 8 -c 1 -4 a.test | sort -u)"
+stopsrv ${P}
+check "coalescing, queries" "1" "$(queries ${P})"
+
+# answers expire after a second, the server goes away after 1.5
+config ${P} "reload-interval:0 cache-max-ttl:1 serve-stale:60 stale-timeout:100"
+fakesrv ${P} -a 1 -A 0
+(sleep 1.5 ; stopsrv ${P}) &
+out=$(lookups -m nss -r 5 -d 3 -4 a.test)
+wait $!
+check "serve stale" \
+	"a.test: ok ttl 30$(addrs ${P} 1 0)" \
+	"$(echo "${out}" | tail -n 1)"
+check "serve stale, failures" "" "$(echo "${out}" | grep -v ': ok ')"
+
+# the pool moves to another server while lookups go on
+config ${P} "reload-interval:1 cache-max-ttl:0"
+fakesrv ${P} -a 1 -A 0
+fakesrv $((P + 1)) -a 1 -A 0
+(sleep 1 ; config $((P + 1)) "reload-interval:1 cache-max-ttl:0") &
+out=$(lookups -m nss -r 10 -d 3 -4 a.test)
+wait $!
+check "reload" \
+	"a.test: ok ttl 60$(addrs $((P + 1)) 1 0)" \
+	"$(echo "${out}" | tail -n 1)"
+
+# an edit after compiling the config wins over the compiled one
+config ${P} "reload-interval:0 cache-max-ttl:0"
+./dnspq-compile -f "${CONF}" -o "${CONF}".bin > /dev/null || fails=$((fails + 1))
+check "compiled config" \
+	"a.test: ok ttl 60$(addrs ${P} 1 0)" \
+	"$(lookups -m nss -c 1 -4 a.test)"
+sleep 0.1
+config $((P + 1)) "reload-interval:0 cache-max-ttl:0"
+check "compiled config, edited" \
+	"a.test: ok ttl 60$(addrs $((P + 1)) 1 0)" \
+	"$(lookups -m nss -c 1 -4 a.test)"
+stopsrv ${P}
+stopsrv $((P + 1))
+
+if [[ ${fails} -ne 0 ]] ; then
+	echo "${fails} test(s) failed"
+	exit 1
+fi
+echo "all tests passed"